@@ -1,11 +1,11 @@
 #define _GNU_SOURCE
-#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -23,6 +23,8 @@
 #define GIT_UNREACHABLE() do { fprintf(stderr, "%s:%d: UNREACHABLE\n", __FILE__, __LINE__); fflush(stderr); BREAKPOINT(); abort(); } while (0)
 #define GIT_UNIMPLENTED(fmt, ...) do { fprintf(stderr, "%s:%d: UNIMPLENTED %s: " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); fflush(stderr); BREAKPOINT(); abort(); } while (0)
 #define ARG() *argv++; argc--
+// Set GIT_TRACE to see decisions made along the way on stderr
+#define GIT_TRACE(fmt, ...) do { if (getenv("GIT_TRACE") != NULL) { fprintf(stderr, "trace: " fmt "\n", ##__VA_ARGS__); } } while (0)
 
 #define C_ARRAY_LEN(arr) (sizeof((arr))/(sizeof((arr)[0])))
 
@@ -173,84 +175,1440 @@ bool file_read_contents_fp(FILE *file, uint8_t **data, long *size) {
     expect(*size != -1);
     expect(fseek(file, 0L, SEEK_SET) != -1);
 
-    *data = malloc(*size);
+    // At least a byte, so empty files still get a buffer
+    *data = malloc(*size > 0 ? *size : 1);
     expect(*data != NULL);
-    expect(fread(*data, *size, 1, file) == 1);
+    expect(*size == 0 || fread(*data, *size, 1, file) == 1);
 
 #undef return_defer
 #undef expect
 defer:
-    if (!ret) {
-        if (*data) free(*data);
+    if (!ret && *data) {
+        free(*data);
+        *data = NULL;
     }
     return ret;
 }
 
-bool file_read_contents(const char *filename, uint8_t **data, long *size) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) return false;
-    bool ret = file_read_contents_fp(file, data, size);
-    fclose(file);
-    return ret;
+// Reads the whole of `fd`, sized by fstat rather than seeking about
+bool fd_read_contents(int fd, uint8_t **data, long *size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return false;
+    // At least a byte, so empty files still get a buffer
+    *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (*data == NULL) return false;
+    for (off_t done = 0; done < st.st_size;) {
+        ssize_t n = pread(fd, *data + done, st.st_size - done, done);
+        if (n <= 0) {
+            free(*data);
+            *data = NULL;
+            return false;
+        }
+        done += n;
+    }
+    *size = st.st_size;
+    return true;
 }
 
 bool file_read_contents_at(int dir_fd, const char *filename, uint8_t **data, long *size) {
-    int fd = openat(dir_fd, filename, O_RDONLY);
-    assert(fd > 0);
-    FILE *file = fdopen(fd, "rb");
-    if (file == NULL) {
+    int fd = openat(dir_fd, filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    bool ret = fd_read_contents(fd, data, size);
+    close(fd);
+    return ret;
+}
+
+bool file_read_contents(const char *filename, uint8_t **data, long *size) {
+    return file_read_contents_at(AT_FDCWD, filename, data, size);
+}
+
+typedef enum {
+    UNKNOWN,
+    BLOB,
+    TREE,
+    COMMIT,
+
+    NUM_OBJECTS, // Keep at end, _Static_assert's depend on it
+} git_object_t;
+
+// Parses an object header ("<type> <size>"), returning UNKNOWN if it isn't one
+git_object_t parse_object_header(const char *header, long *size) {
+    git_object_t type = UNKNOWN;
+    const char *p = header;
+    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
+    if (strncmp(header, "blob ", 5) == 0) {
+        type = BLOB;
+        p += 5;
+    } else if (strncmp(header, "tree ", 5) == 0) {
+        type = TREE;
+        p += 5;
+    } else if (strncmp(header, "commit ", 7) == 0) {
+        type = COMMIT;
+        p += 7;
+    } else {
+        return UNKNOWN;
+    }
+    char *end = NULL;
+    *size = strtol(p, &end, 10);
+    if (end == p || *end != '\0' || *size < 0) return UNKNOWN;
+    return type;
+}
+
+const char *object_type_name(git_object_t type) {
+    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
+    switch (type) {
+        case BLOB: return "blob";
+        case TREE: return "tree";
+        case COMMIT: return "commit";
+
+        case UNKNOWN:
+        default:
+            GIT_UNREACHABLE();
+            return NULL;
+    }
+}
+
+// Long enough for any object header, "commit " and a 64 bit size
+#define OBJECT_HEADER_MAX 32
+
+// Fills in the header an object starts with, returning its length. The NUL
+// after it is part of the object too.
+long object_header(git_object_t type, size_t size, char header[OBJECT_HEADER_MAX]) {
+    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
+    switch (type) {
+        case BLOB:
+            return snprintf(header, OBJECT_HEADER_MAX, "blob %zu", size);
+
+        case TREE:
+            return snprintf(header, OBJECT_HEADER_MAX, "tree %zu", size);
+
+        case COMMIT:
+            return snprintf(header, OBJECT_HEADER_MAX, "commit %zu", size);
+
+        default:
+            GIT_UNREACHABLE();
+            return -1;
+    }
+}
+// Deflate can't expand data by more than this much (RFC 1951 - 3.2.5, a
+// 258 byte match from 2 bits per symbol), so no object can be bigger than
+// this many times its file
+#define OBJECT_MAX_EXPANSION 1032
+
+// .git/objects, opened the first time it's needed and then kept open, so each
+// object file is opened relative to it rather than by its whole path
+int objects_dir_fd(void) {
+    static int fd = -1;
+    if (fd == -1) fd = open(".git/objects", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return fd;
+}
+
+// "xx/xxxx...", the loose object file for `hash` within .git/objects
+#define OBJECT_FILE_NAME_SIZE (SHA1_DIGEST_HEX_LENGTH + 2)
+void object_file_name(const char *hash, char name[OBJECT_FILE_NAME_SIZE]) {
+    name[0] = hash[0];
+    name[1] = hash[1];
+    name[2] = '/';
+    memcpy(name + 3, hash + 2, SHA1_DIGEST_HEX_LENGTH - 2);
+    name[OBJECT_FILE_NAME_SIZE - 1] = '\0';
+}
+
+// Loose object files up to this size are read into a buffer kept for the next
+// one, as that's cheaper than mapping and unmapping them. Most are this small.
+#define LOOSE_OBJECT_READ_MAX (16 * 1024)
+
+// A loose object file's compressed contents, which inflate reads from directly
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    void *map;     // The mapping if it was mapped, otherwise NULL
+    bool buffered; // Whether it's in the shared buffer
+    bool missing;  // Set when opening fails because there is no such file
+} loose_object;
+
+uint8_t loose_object_buffer[LOOSE_OBJECT_READ_MAX];
+bool loose_object_buffer_busy = false;
+
+bool loose_object_open(const char *hash, loose_object *object) {
+    char name[OBJECT_FILE_NAME_SIZE];
+    object_file_name(hash, name);
+    *object = (loose_object){0};
+    int fd = openat(objects_dir_fd(), name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    bool ok = fd != -1 && fstat(fd, &st) == 0;
+    if (ok && st.st_size <= LOOSE_OBJECT_READ_MAX && !loose_object_buffer_busy) {
+        size_t done = 0;
+        for (ssize_t n = 1; done < (size_t)st.st_size && n > 0; done += n) {
+            n = pread(fd, loose_object_buffer + done, st.st_size - done, done);
+            if (n < 0) n = 0;
+        }
+        ok = done == (size_t)st.st_size;
+        object->data = loose_object_buffer;
+        object->size = done;
+        object->buffered = loose_object_buffer_busy = ok;
+    } else if (ok) {
+        object->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = object->map != MAP_FAILED;
+        if (ok) {
+            // Inflate reads it front to back, once
+            madvise(object->map, st.st_size, MADV_SEQUENTIAL);
+            object->data = object->map;
+            object->size = st.st_size;
+        } else {
+            object->map = NULL;
+        }
+    }
+    object->missing = fd == -1 && errno == ENOENT;
+    if (fd != -1) close(fd);
+    // Not being loose is no error yet, it may be packed
+    if (!ok && !object->missing) fprintf(stderr, "Couldn't read file .git/objects/%s\n", name);
+    return ok;
+}
+
+void loose_object_close(loose_object *object) {
+    if (object->map != NULL) munmap(object->map, object->size);
+    if (object->buffered) loose_object_buffer_busy = false;
+    *object = (loose_object){0};
+}
+
+uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+uint64_t get_be64(const uint8_t *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void put_be64(uint8_t *p, uint64_t v) {
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+}
+
+void append_be32(uint8_array_t *out, uint32_t v) {
+    ARRAY_ENSURE(*out, 4);
+    put_be32(out->data + out->size, v);
+    out->size += 4;
+}
+
+void append_be64(uint8_array_t *out, uint64_t v) {
+    ARRAY_ENSURE(*out, 8);
+    put_be64(out->data + out->size, v);
+    out->size += 8;
+}
+
+// A pack from .git/objects/pack, with its index (version 2), both mapped. The
+// index starts with a fanout table: how many objects have hashes whose first
+// byte is at most each value. Then come the hashes in order, their CRCs, and
+// their offsets in the pack. Offsets with the top bit set index a table of
+// 64-bit offsets after that, for packs over 2GB.
+typedef struct {
+    char *name; // The .pack
+    const uint8_t *idx; // NULL for packs in the multi-pack-index
+    size_t idx_size;
+    const uint8_t *pack;
+    size_t pack_size;
+    uint32_t count;
+    const uint8_t *fanout;
+    const uint8_t *hashes;
+    const uint8_t *offsets;
+    const uint8_t *offsets64;
+    size_t offsets64_count;
+} pack_t;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    pack_t *data;
+} pack_array_t;
+
+#define PACK_IDX_MAGIC "\377tOc"
+#define PACK_IDX_HEADER_SIZE (8 + 256 * 4)
+#define PACK_HEADER_SIZE 12
+// Both end with checksums: the pack's, then (for the index) its own
+#define PACK_TRAILER_SIZE SHA1_DIGEST_BYTE_LENGTH
+
+pack_array_t packs = {0};
+bool packs_loaded = false;
+
+// .git/objects/pack, opened the first time it's needed and then kept open,
+// for packs that are only mapped once an object is found in them
+int packs_dir_fd(void) {
+    static int fd = -1;
+    if (fd == -1) fd = openat(objects_dir_fd(), "pack", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return fd;
+}
+
+void pack_unmap(pack_t *pack) {
+    if (pack->idx != NULL) munmap((void *)pack->idx, pack->idx_size);
+    if (pack->pack != NULL) munmap((void *)pack->pack, pack->pack_size);
+    free(pack->name);
+    *pack = (pack_t){0};
+}
+
+const uint8_t *pack_map_file(int dir_fd, const char *name, size_t *size) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    return map;
+}
+
+// The .pack that goes with `idx_name`, in a buffer from malloc
+char *pack_name_for_idx(const char *idx_name) {
+    size_t len = strlen(idx_name) - strlen(".idx");
+    char *name = malloc(len + strlen(".pack") + 1);
+    if (name == NULL) return NULL;
+    memcpy(name, idx_name, len);
+    strcpy(name + len, ".pack");
+    return name;
+}
+
+bool is_idx_name(const char *name) {
+    size_t len = strlen(name);
+    return len > strlen(".idx") && strcmp(name + len - strlen(".idx"), ".idx") == 0;
+}
+
+// Maps the .pack itself, checking its header. It has to have as many objects
+// as its index says, where that has been mapped too.
+bool pack_map_data(int dir_fd, pack_t *pack) {
+    pack->pack = pack_map_file(dir_fd, pack->name, &pack->pack_size);
+    if (pack->pack == NULL) return false;
+    if (pack->pack_size < PACK_HEADER_SIZE + PACK_TRAILER_SIZE || memcmp(pack->pack, "PACK", 4) != 0 ||
+            (pack->idx != NULL && get_be32(pack->pack + 8) != pack->count)) {
+        munmap((void *)pack->pack, pack->pack_size);
+        pack->pack = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Maps `idx_name` and the pack next to it, checking the index holds together
+bool pack_map(int dir_fd, const char *idx_name, pack_t *pack) {
+    *pack = (pack_t){0};
+    pack->name = pack_name_for_idx(idx_name);
+    if (pack->name == NULL) return false;
+
+    pack->idx = pack_map_file(dir_fd, idx_name, &pack->idx_size);
+    if (pack->idx == NULL) goto bad;
+    if (pack->idx_size < PACK_IDX_HEADER_SIZE + 2 * PACK_TRAILER_SIZE ||
+            memcmp(pack->idx, PACK_IDX_MAGIC, 4) != 0 || get_be32(pack->idx + 4) != 2) {
+        goto bad;
+    }
+    pack->fanout = pack->idx + 8;
+    pack->count = get_be32(pack->fanout + 255 * 4);
+    pack->hashes = pack->fanout + 256 * 4;
+    pack->offsets = pack->hashes + (size_t)pack->count * (SHA1_DIGEST_BYTE_LENGTH + 4);
+    pack->offsets64 = pack->offsets + (size_t)pack->count * 4;
+    size_t tables = PACK_IDX_HEADER_SIZE + (size_t)pack->count * (SHA1_DIGEST_BYTE_LENGTH + 4 + 4);
+    if (tables + 2 * PACK_TRAILER_SIZE > pack->idx_size) goto bad;
+    pack->offsets64_count = (pack->idx_size - tables - 2 * PACK_TRAILER_SIZE) / 8;
+    if (!pack_map_data(dir_fd, pack)) goto bad;
+    return true;
+
+bad:
+    fprintf(stderr, "Ignoring broken pack .git/objects/pack/%s\n", pack->name != NULL ? pack->name : idx_name);
+    pack_unmap(pack);
+    return false;
+}
+
+// .git/objects/pack/multi-pack-index, which indexes the objects of many packs
+// at once, so finding one takes a single binary search however many packs
+// there are. After the header is a table of chunk ids and where each chunk
+// starts, ending with where the last one ends. The chunks are the names of
+// the packs' indexes in order (PNAM), a fanout (OIDF) and hashes (OIDL) as in
+// a pack's index, and then for each hash the number of the pack it's in and
+// its offset there (OOFF). As in a pack's index, offsets with the top bit set
+// index a table of 64-bit offsets (LOFF) instead.
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    uint32_t count;
+    uint32_t pack_count; // They're the first in `packs`, in the same order
+    const uint8_t *fanout;
+    const uint8_t *hashes;
+    const uint8_t *offsets;
+    const uint8_t *offsets64;
+    size_t offsets64_count;
+} midx_t;
+
+#define MIDX_FILE "multi-pack-index"
+#define MIDX_SIGNATURE "MIDX"
+#define MIDX_VERSION 1
+#define MIDX_HASH_SHA1 1
+#define MIDX_HEADER_SIZE 12
+#define MIDX_CHUNK_ENTRY_SIZE 12
+#define MIDX_OFFSET_ENTRY_SIZE 8
+#define MIDX_LARGE_OFFSET 0x80000000
+
+midx_t midx = {0};
+
+// Maps the multi-pack-index if there is one, and adds its packs to `packs`
+// without mapping them yet
+bool midx_map(int dir_fd) {
+    midx.data = pack_map_file(dir_fd, MIDX_FILE, &midx.size);
+    if (midx.data == NULL) return false;
+    const uint8_t *d = midx.data;
+    size_t end = midx.size - PACK_TRAILER_SIZE;
+    if (midx.size < MIDX_HEADER_SIZE + MIDX_CHUNK_ENTRY_SIZE + PACK_TRAILER_SIZE ||
+            memcmp(d, MIDX_SIGNATURE, 4) != 0 || d[4] != MIDX_VERSION || d[5] != MIDX_HASH_SHA1 || d[7] != 0) {
+        goto bad;
+    }
+    size_t chunks = d[6];
+    midx.pack_count = get_be32(d + 8);
+    if (MIDX_HEADER_SIZE + (chunks + 1) * MIDX_CHUNK_ENTRY_SIZE > end) goto bad;
+
+    const uint8_t *names = NULL;
+    size_t names_size = 0, hashes_size = 0, offsets_size = 0;
+    for (size_t i = 0; i < chunks; i ++) {
+        const uint8_t *entry = d + MIDX_HEADER_SIZE + i * MIDX_CHUNK_ENTRY_SIZE;
+        uint64_t start = get_be64(entry + 4);
+        uint64_t next = get_be64(entry + MIDX_CHUNK_ENTRY_SIZE + 4);
+        if (start > next || next > end) goto bad;
+        size_t size = next - start;
+        if (memcmp(entry, "PNAM", 4) == 0) {
+            names = d + start;
+            names_size = size;
+        } else if (memcmp(entry, "OIDF", 4) == 0) {
+            if (size != 256 * 4) goto bad;
+            midx.fanout = d + start;
+        } else if (memcmp(entry, "OIDL", 4) == 0) {
+            midx.hashes = d + start;
+            hashes_size = size;
+        } else if (memcmp(entry, "OOFF", 4) == 0) {
+            midx.offsets = d + start;
+            offsets_size = size;
+        } else if (memcmp(entry, "LOFF", 4) == 0) {
+            midx.offsets64 = d + start;
+            midx.offsets64_count = size / 8;
+        }
+        // Anything else (reverse indexes, bitmapped packs) isn't needed
+    }
+    if (names == NULL || midx.fanout == NULL || midx.hashes == NULL || midx.offsets == NULL) goto bad;
+    midx.count = get_be32(midx.fanout + 255 * 4);
+    if (hashes_size != (size_t)midx.count * SHA1_DIGEST_BYTE_LENGTH ||
+            offsets_size != (size_t)midx.count * MIDX_OFFSET_ENTRY_SIZE) {
+        goto bad;
+    }
+
+    const char *name = (const char *)names;
+    for (uint32_t i = 0; i < midx.pack_count; i ++) {
+        size_t left = names_size - (name - (const char *)names);
+        size_t len = strnlen(name, left);
+        if (len == left || !is_idx_name(name)) goto bad;
+        pack_t pack = { .name = pack_name_for_idx(name) };
+        if (pack.name == NULL) goto bad;
+        ARRAY_APPEND(packs, pack);
+        name += len + 1;
+    }
+    return true;
+
+bad:
+    fprintf(stderr, "Ignoring broken .git/objects/pack/" MIDX_FILE "\n");
+    for (size_t i = 0; i < packs.size; i ++) pack_unmap(&packs.data[i]);
+    packs.size = 0;
+    munmap((void *)midx.data, midx.size);
+    midx = (midx_t){0};
+    return false;
+}
+
+int pack_name_compare(const void *a, const void *b) {
+    return strcmp(((const pack_t *)a)->name, ((const pack_t *)b)->name);
+}
+
+// Maps every pack's index (and the pack) in `dir`, skipping the first `skip`
+// in `all`, which are already there. That's the packs in the
+// multi-pack-index, which are in order.
+void packs_map_all(int dir_fd, pack_array_t *all, size_t skip) {
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
         close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_idx_name(entry->d_name)) continue;
+        if (skip > 0) {
+            pack_t key = { .name = pack_name_for_idx(entry->d_name) };
+            bool found = key.name != NULL && bsearch(&key, all->data, skip, sizeof(pack_t), pack_name_compare) != NULL;
+            free(key.name);
+            if (found) continue;
+        }
+        pack_t pack;
+        if (pack_map(dir_fd, entry->d_name, &pack)) ARRAY_APPEND(*all, pack);
+    }
+    closedir(dir);
+}
+
+// Finds the packs the first time they are needed. Those in the
+// multi-pack-index are only mapped when an object is found in them, and any
+// newer ones are looked through one by one after it.
+pack_array_t *packs_load(void) {
+    if (packs_loaded) return &packs;
+    packs_loaded = true;
+    int dir_fd = packs_dir_fd();
+    if (dir_fd == -1) return &packs;
+    midx_map(dir_fd);
+    packs_map_all(dir_fd, &packs, packs.size);
+    return &packs;
+}
+
+uint64_t pack_index_offset(const pack_t *pack, uint32_t index) {
+    uint32_t offset = get_be32(pack->offsets + (size_t)index * 4);
+    if ((offset & 0x80000000) == 0) return offset;
+    offset &= 0x7FFFFFFF;
+    // Past the table, which only a broken index does, is past the pack too
+    if (offset >= pack->offsets64_count) return UINT64_MAX;
+    return get_be64(pack->offsets64 + (size_t)offset * 8);
+}
+
+// The first of the sorted hashes in [lo, hi) that isn't less than `hash`, or
+// hi if they all are
+size_t hashes_lower_bound(const uint8_t *hashes, size_t lo, size_t hi, const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(hashes + mid * SHA1_DIGEST_BYTE_LENGTH, hash, SHA1_DIGEST_BYTE_LENGTH) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Where `hash` is, or would go, in a sorted table of `count` hashes: the
+// fanout narrows it down to the hashes starting with the same byte, then a
+// binary search finds it among them
+uint32_t oid_table_lower_bound(const uint8_t *fanout, const uint8_t *hashes, uint32_t count,
+                               const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
+    uint32_t lo = hash[0] == 0 ? 0 : get_be32(fanout + (hash[0] - 1) * 4);
+    uint32_t hi = get_be32(fanout + hash[0] * 4);
+    if (hi > count) hi = count;
+    if (lo > hi) lo = hi;
+    return hashes_lower_bound(hashes, lo, hi, hash);
+}
+
+bool oid_table_find(const uint8_t *fanout, const uint8_t *hashes, uint32_t count,
+                    const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], uint32_t *index) {
+    *index = oid_table_lower_bound(fanout, hashes, count, hash);
+    return *index < count &&
+           memcmp(hashes + (size_t)*index * SHA1_DIGEST_BYTE_LENGTH, hash, SHA1_DIGEST_BYTE_LENGTH) == 0;
+}
+
+bool midx_find(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], pack_t **pack, uint64_t *offset) {
+    uint32_t index = 0;
+    if (midx.data == NULL || !oid_table_find(midx.fanout, midx.hashes, midx.count, hash, &index)) return false;
+    const uint8_t *entry = midx.offsets + (size_t)index * MIDX_OFFSET_ENTRY_SIZE;
+    uint32_t pack_id = get_be32(entry);
+    uint32_t offset32 = get_be32(entry + 4);
+    if (pack_id >= midx.pack_count) return false;
+    *offset = offset32;
+    // Without a table of 64-bit offsets, the top bit is just part of the offset
+    if ((offset32 & MIDX_LARGE_OFFSET) && midx.offsets64 != NULL) {
+        offset32 &= ~MIDX_LARGE_OFFSET;
+        if (offset32 >= midx.offsets64_count) return false;
+        *offset = get_be64(midx.offsets64 + (size_t)offset32 * 8);
+    }
+    pack_t *p = &packs.data[pack_id];
+    if (p->pack == NULL && !pack_map_data(packs_dir_fd(), p)) {
+        fprintf(stderr, "Couldn't read .git/objects/pack/%s\n", p->name);
         return false;
     }
-    bool ret = file_read_contents_fp(file, data, size);
-    fclose(file);
-    return ret;
+    *pack = p;
+    return true;
 }
 
-bool read_object(char *hash, uint8_t **data, long *size) {
+// Looks `hash` up in the multi-pack-index, then in each pack's own index
+bool pack_find(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], pack_t **pack, uint64_t *offset) {
+    pack_array_t *all = packs_load();
+    if (midx_find(hash, pack, offset)) return true;
+    for (size_t i = midx.pack_count; i < all->size; i ++) {
+        pack_t *p = &all->data[i];
+        uint32_t index = 0;
+        if (oid_table_find(p->fanout, p->hashes, p->count, hash, &index)) {
+            *pack = p;
+            *offset = pack_index_offset(p, index);
+            return true;
+        }
+    }
+    return false;
+}
+
+// An object in one of the packs going into a multi-pack-index
+typedef struct {
+    const uint8_t *hash;
+    uint32_t pack;
+    uint64_t offset;
+} midx_object;
+
+int midx_object_compare(const void *a, const void *b) {
+    const midx_object *x = a, *y = b;
+    int cmp = memcmp(x->hash, y->hash, SHA1_DIGEST_BYTE_LENGTH);
+    if (cmp != 0) return cmp;
+    return (x->pack > y->pack) - (x->pack < y->pack);
+}
+
+// Writes a multi-pack-index covering every pack there is now, replacing any
+// that's there. An object in more than one pack is taken from the first, by
+// name.
+bool midx_write(void) {
     bool ret = false;
-    zlib_context ctx = {0};
-    char *object_path = NULL;
-    uint8_t *filedata = NULL;
+    pack_array_t all = {0};
+    midx_object *objects = NULL;
+    uint8_array_t out = {0};
+    int fd = -1;
 #define return_defer(code) do { ret = (code); goto defer; } while (0);
-    object_path = malloc(55);
-    if (object_path == NULL) {
-        fprintf(stderr, "Ran out of memory creating object path\n");
+    int dir_fd = packs_dir_fd();
+    if (dir_fd == -1) {
+        fprintf(stderr, "Couldn't open .git/objects/pack: %s\n", strerror(errno));
         return_defer(false);
     }
-    char *objects_dir = ".git/objects";
-    if (sprintf(object_path, "%s/xx/%38s", objects_dir, hash + 2) == -1) {
-        GIT_UNREACHABLE();
+    packs_map_all(dir_fd, &all, 0);
+    qsort(all.data, all.size, sizeof(pack_t), pack_name_compare);
+
+    size_t count = 0;
+    for (size_t i = 0; i < all.size; i ++) count += all.data[i].count;
+    objects = malloc((count > 0 ? count : 1) * sizeof(midx_object));
+    if (objects == NULL) return_defer(false);
+    count = 0;
+    for (size_t i = 0; i < all.size; i ++) {
+        pack_t *pack = &all.data[i];
+        for (uint32_t j = 0; j < pack->count; j ++) {
+            uint64_t offset = pack_index_offset(pack, j);
+            if (offset >= pack->pack_size) {
+                fprintf(stderr, "Broken offset for object %u in .git/objects/pack/%s\n", j, pack->name);
+                return_defer(false);
+            }
+            objects[count ++] = (midx_object){
+                .hash = pack->hashes + (size_t)j * SHA1_DIGEST_BYTE_LENGTH,
+                .pack = i,
+                .offset = offset,
+            };
+        }
+    }
+    qsort(objects, count, sizeof(midx_object), midx_object_compare);
+    size_t unique = 0;
+    size_t large = 0;
+    for (size_t i = 0; i < count; i ++) {
+        if (unique > 0 && memcmp(objects[unique - 1].hash, objects[i].hash, SHA1_DIGEST_BYTE_LENGTH) == 0) continue;
+        objects[unique ++] = objects[i];
+        if (objects[i].offset >= MIDX_LARGE_OFFSET) large ++;
+    }
+    count = unique;
+    if (count > UINT32_MAX || all.size > UINT32_MAX) {
+        fprintf(stderr, "Too many objects for a multi-pack-index\n");
         return_defer(false);
     }
-    object_path[strlen(objects_dir)+1] = hash[0];
-    object_path[strlen(objects_dir)+2] = hash[1];
 
-    long filesize = 0;
-    // FIXME check in right dir
-    if (!file_read_contents(object_path, &filedata, &filesize)) {
-        fprintf(stderr, "Couldn't read file %s\n", object_path);
+    // The names of the packs' indexes, padded out to 4 bytes
+    size_t names_size = 0;
+    for (size_t i = 0; i < all.size; i ++) names_size += strlen(all.data[i].name) - strlen(".pack") + strlen(".idx") + 1;
+    names_size = (names_size + 3) & ~(size_t)3;
+
+    const char *ids[] = { "PNAM", "OIDF", "OIDL", "OOFF", "LOFF" };
+    uint64_t sizes[] = {
+        names_size,
+        256 * 4,
+        count * SHA1_DIGEST_BYTE_LENGTH,
+        count * MIDX_OFFSET_ENTRY_SIZE,
+        large * 8,
+    };
+    size_t chunks = large > 0 ? 5 : 4;
+
+    ARRAY_APPEND_BYTES(out, MIDX_SIGNATURE, 4);
+    ARRAY_APPEND(out, MIDX_VERSION);
+    ARRAY_APPEND(out, MIDX_HASH_SHA1);
+    ARRAY_APPEND(out, chunks);
+    ARRAY_APPEND(out, 0); // No base multi-pack-indexes
+    append_be32(&out, all.size);
+    uint64_t offset = MIDX_HEADER_SIZE + (chunks + 1) * MIDX_CHUNK_ENTRY_SIZE;
+    for (size_t i = 0; i < chunks; i ++) {
+        ARRAY_APPEND_BYTES(out, ids[i], 4);
+        append_be64(&out, offset);
+        offset += sizes[i];
+    }
+    append_be32(&out, 0);
+    append_be64(&out, offset);
+
+    for (size_t i = 0; i < all.size; i ++) {
+        size_t len = strlen(all.data[i].name) - strlen(".pack");
+        ARRAY_APPEND_BYTES(out, all.data[i].name, len);
+        ARRAY_APPEND_BYTES(out, ".idx", strlen(".idx") + 1);
+    }
+    while (out.size % 4 != 0) ARRAY_APPEND(out, 0);
+
+    size_t next = 0;
+    for (int byte = 0; byte < 256; byte ++) {
+        while (next < count && objects[next].hash[0] == byte) next ++;
+        append_be32(&out, next);
+    }
+    for (size_t i = 0; i < count; i ++) {
+        ARRAY_APPEND_BYTES(out, objects[i].hash, SHA1_DIGEST_BYTE_LENGTH);
+    }
+    size_t large_index = 0;
+    for (size_t i = 0; i < count; i ++) {
+        append_be32(&out, objects[i].pack);
+        if (objects[i].offset >= MIDX_LARGE_OFFSET) {
+            append_be32(&out, MIDX_LARGE_OFFSET | large_index ++);
+        } else {
+            append_be32(&out, objects[i].offset);
+        }
+    }
+    for (size_t i = 0; i < count; i ++) {
+        if (objects[i].offset >= MIDX_LARGE_OFFSET) append_be64(&out, objects[i].offset);
+    }
+    assert(out.size == offset);
+
+    ARRAY_ENSURE(out, SHA1_DIGEST_BYTE_LENGTH);
+    sha1_digest(out.data, out.size, out.data + out.size);
+    out.size += SHA1_DIGEST_BYTE_LENGTH;
+
+    // Written next to it then renamed over it, so it's never seen half done
+    fd = openat(dir_fd, MIDX_FILE ".lock", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't create .git/objects/pack/" MIDX_FILE ".lock: %s\n", strerror(errno));
+        return_defer(false);
+    }
+    for (size_t done = 0; done < out.size;) {
+        ssize_t n = write(fd, out.data + done, out.size - done);
+        if (n < 0) {
+            fprintf(stderr, "Couldn't write .git/objects/pack/" MIDX_FILE ".lock: %s\n", strerror(errno));
+            unlinkat(dir_fd, MIDX_FILE ".lock", 0);
+            return_defer(false);
+        }
+        done += n;
+    }
+    if (renameat(dir_fd, MIDX_FILE ".lock", dir_fd, MIDX_FILE) == -1) {
+        fprintf(stderr, "Couldn't write .git/objects/pack/" MIDX_FILE ": %s\n", strerror(errno));
+        unlinkat(dir_fd, MIDX_FILE ".lock", 0);
         return_defer(false);
     }
+    ret = true;
+
+#undef return_defer
+defer:
+    if (fd != -1) close(fd);
+    for (size_t i = 0; i < all.size; i ++) pack_unmap(&all.data[i]);
+    free(all.data);
+    free(objects);
+    free(out.data);
+    return ret;
+}
+
+// Types as stored in a pack entry's header
+typedef enum {
+    PACK_COMMIT = 1,
+    PACK_TREE = 2,
+    PACK_BLOB = 3,
+    PACK_TAG = 4,
+    PACK_OFS_DELTA = 6,
+    PACK_REF_DELTA = 7,
+} pack_object_t;
+
+// A pack entry's header. Whole objects are followed by their zlib compressed
+// content, deltas first say what they're against: a distance back to an
+// earlier entry in the pack, or the hash of any object.
+typedef struct {
+    pack_object_t type;
+    uint64_t size;  // Of the content, or of the delta itself
+    uint64_t data;  // Offset of the zlib stream
+    uint64_t base;  // PACK_OFS_DELTA: offset of the base
+    const uint8_t *base_hash; // PACK_REF_DELTA
+} pack_entry;
+
+bool pack_entry_parse(const pack_t *pack, uint64_t offset, pack_entry *entry) {
+    uint64_t end = pack->pack_size - PACK_TRAILER_SIZE;
+    const uint8_t *p = pack->pack;
+    if (offset < PACK_HEADER_SIZE || offset >= end) return false;
+    uint64_t start = offset;
+
+    // Type in bits 4-6 of the first byte and the size after it, 4 bits then
+    // 7 per byte while the top bit is set
+    uint8_t c = p[offset++];
+    entry->type = (c >> 4) & 7;
+    entry->size = c & 0x0F;
+    for (int shift = 4; c & 0x80; shift += 7) {
+        if (offset >= end || shift > 57) return false;
+        c = p[offset++];
+        entry->size |= (uint64_t)(c & 0x7F) << shift;
+    }
+
+    switch (entry->type) {
+        case PACK_COMMIT:
+        case PACK_TREE:
+        case PACK_BLOB:
+        case PACK_TAG:
+            break;
+
+        case PACK_OFS_DELTA: {
+            // Big endian 7 bits a byte, with one added for each byte after
+            // the first so that no two encodings are the same number
+            if (offset >= end) return false;
+            c = p[offset++];
+            uint64_t distance = c & 0x7F;
+            while (c & 0x80) {
+                if (offset >= end || distance >= (UINT64_MAX >> 7) - 1) return false;
+                c = p[offset++];
+                distance = ((distance + 1) << 7) | (c & 0x7F);
+            }
+            // Back from the start of this entry
+            if (distance == 0 || distance > start) return false;
+            entry->base = start - distance;
+        }; break;
+
+        case PACK_REF_DELTA:
+            if (end - offset < SHA1_DIGEST_BYTE_LENGTH) return false;
+            entry->base_hash = p + offset;
+            offset += SHA1_DIGEST_BYTE_LENGTH;
+            break;
+
+        default:
+            return false;
+    }
+    entry->data = offset;
+    return true;
+}
+
+git_object_t pack_object_type(pack_object_t type) {
+    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
+    switch (type) {
+        case PACK_COMMIT: return COMMIT;
+        case PACK_TREE: return TREE;
+        case PACK_BLOB: return BLOB;
+        default: return UNKNOWN;
+    }
+}
+
+// Inflates an entry's zlib stream, which should come to `size` bytes. Room is
+// left for OBJECT_HEADER_MAX more after it, for read_object to put the header
+// in front. The size is only trusted as far as the bytes left in the pack
+// could inflate to, like loose objects against their file.
+bool pack_inflate(const pack_t *pack, const pack_entry *entry, uint8_t **data) {
+    zlib_context ctx = {0};
+    ctx.deflate.bits.data = (uint8_t *)pack->pack + entry->data;
+    ctx.deflate.bits.size = pack->pack_size - PACK_TRAILER_SIZE - entry->data;
+    if (entry->size / OBJECT_MAX_EXPANSION > ctx.deflate.bits.size ||
+            !deflate_reserve(&ctx.deflate, entry->size + OBJECT_HEADER_MAX)) {
+        return false;
+    }
+    bool ok = zlib_decompress(&ctx) && ctx.deflate.out.size == entry->size;
+    zlib_end(&ctx);
+    if (!ok) {
+        free(ctx.deflate.out.data);
+        return false;
+    }
+    *data = ctx.deflate.out.data;
+    return true;
+}
+
+// Finds the pack entry for an object that isn't loose
+bool packed_object_entry(const char *hash, pack_t **pack, uint64_t *offset, pack_entry *entry) {
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    if (!sha1_from_hex(hash, oid) || !pack_find(oid, pack, offset)) {
+        fprintf(stderr, "Couldn't find object %s\n", hash);
+        return false;
+    }
+    if (!pack_entry_parse(*pack, *offset, entry)) {
+        fprintf(stderr, "Broken entry at %lu in .git/objects/pack/%s\n", (unsigned long)*offset, (*pack)->name);
+        return false;
+    }
+    return true;
+}
+
+// Whole objects that were inflated as the bases of deltas, kept so that the
+// objects deltified against the same base, or against each other down a
+// chain, don't each inflate the whole chain again. They're looked up by where
+// they are in their pack and the least recently used go first once they come
+// to more than DELTA_BASE_CACHE_BYTES.
+typedef struct delta_base {
+    const pack_t *pack;
+    uint64_t offset;
+    git_object_t type;
+    uint8_t *data;
+    size_t size;
+    struct delta_base *newer, *older;
+    struct delta_base *next; // In the same bucket
+} delta_base;
+
+#define DELTA_BASE_CACHE_BITS 10
+#define DELTA_BASE_CACHE_BYTES (96 << 20)
+
+struct {
+    delta_base *buckets[1 << DELTA_BASE_CACHE_BITS];
+    delta_base *newest, *oldest;
+    size_t bytes;
+} delta_bases = {0};
+
+size_t delta_base_bucket(const pack_t *pack, uint64_t offset) {
+    return ((offset ^ (uintptr_t)pack) * 0x9E3779B97F4A7C15ull) >> (64 - DELTA_BASE_CACHE_BITS);
+}
+
+void delta_base_unlink(delta_base *base) {
+    if (base->newer != NULL) base->newer->older = base->older; else delta_bases.newest = base->older;
+    if (base->older != NULL) base->older->newer = base->newer; else delta_bases.oldest = base->newer;
+}
+
+void delta_base_link(delta_base *base) {
+    base->newer = NULL;
+    base->older = delta_bases.newest;
+    if (delta_bases.newest != NULL) delta_bases.newest->newer = base; else delta_bases.oldest = base;
+    delta_bases.newest = base;
+}
+
+delta_base *delta_base_find(const pack_t *pack, uint64_t offset) {
+    for (delta_base *base = delta_bases.buckets[delta_base_bucket(pack, offset)]; base != NULL; base = base->next) {
+        if (base->pack == pack && base->offset == offset) {
+            delta_base_unlink(base);
+            delta_base_link(base);
+            return base;
+        }
+    }
+    return NULL;
+}
+
+void delta_base_evict(delta_base *base) {
+    delta_base **p = &delta_bases.buckets[delta_base_bucket(base->pack, base->offset)];
+    while (*p != base) p = &(*p)->next;
+    *p = base->next;
+    delta_base_unlink(base);
+    delta_bases.bytes -= base->size;
+    free(base->data);
+    free(base);
+}
+
+// Takes `data` over, freeing it if it doesn't fit
+void delta_base_add(const pack_t *pack, uint64_t offset, git_object_t type, uint8_t *data, size_t size) {
+    delta_base *base = size <= DELTA_BASE_CACHE_BYTES ? malloc(sizeof(*base)) : NULL;
+    if (base == NULL) {
+        free(data);
+        return;
+    }
+    while (delta_bases.bytes + size > DELTA_BASE_CACHE_BYTES) delta_base_evict(delta_bases.oldest);
+    *base = (delta_base){ .pack = pack, .offset = offset, .type = type, .data = data, .size = size };
+    size_t bucket = delta_base_bucket(pack, offset);
+    base->next = delta_bases.buckets[bucket];
+    delta_bases.buckets[bucket] = base;
+    delta_base_link(base);
+    delta_bases.bytes += size;
+}
+
+// A delta starts with the sizes of its base and of the object it makes, 7
+// bits a byte, least significant first
+bool delta_read_size(const uint8_t **p, const uint8_t *end, uint64_t *size) {
+    *size = 0;
+    for (int shift = 0; *p < end && shift <= 63; shift += 7) {
+        uint8_t c = *(*p)++;
+        *size |= (uint64_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Makes an object from its base and a delta. After the sizes come
+// instructions, each either copying a range of the base or inserting bytes
+// from the delta itself. A copy has the top bit set, and its low 4 bits say
+// which bytes of the offset follow, the next 3 which bytes of the size (with
+// 0 meaning 64K). An insert is just the number of bytes (1-127) to take. The
+// object is left with room for OBJECT_HEADER_MAX more after it, as from
+// pack_inflate.
+bool delta_apply(const uint8_t *base, size_t base_size, const uint8_t *delta, size_t delta_size, uint8_t **data, size_t *size) {
+    const uint8_t *p = delta, *end = delta + delta_size;
+    uint64_t expected_base = 0, result_size = 0;
+    if (!delta_read_size(&p, end, &expected_base) || !delta_read_size(&p, end, &result_size) ||
+            expected_base != base_size || result_size > SIZE_MAX - OBJECT_HEADER_MAX) {
+        return false;
+    }
+    uint8_t *out = malloc(result_size + OBJECT_HEADER_MAX);
+    if (out == NULL) return false;
+    size_t written = 0;
+    while (p < end) {
+        uint8_t op = *p++;
+        if (op & 0x80) {
+            size_t copy_offset = 0, copy_size = 0;
+            for (int i = 0; i < 4; i ++) {
+                if ((op & (1 << i)) == 0) continue;
+                if (p == end) goto bad;
+                copy_offset |= (size_t)*p++ << (i * 8);
+            }
+            for (int i = 0; i < 3; i ++) {
+                if ((op & (0x10 << i)) == 0) continue;
+                if (p == end) goto bad;
+                copy_size |= (size_t)*p++ << (i * 8);
+            }
+            if (copy_size == 0) copy_size = 0x10000;
+            if (copy_offset > base_size || copy_size > base_size - copy_offset ||
+                    copy_size > result_size - written) {
+                goto bad;
+            }
+            memcpy(out + written, base + copy_offset, copy_size);
+            written += copy_size;
+        } else if (op != 0) {
+            if (op > end - p || op > result_size - written) goto bad;
+            memcpy(out + written, p, op);
+            p += op;
+            written += op;
+        } else {
+            // Reserved
+            goto bad;
+        }
+    }
+    if (written != result_size) goto bad;
+    *data = out;
+    *size = result_size;
+    return true;
+
+bad:
+    free(out);
+    return false;
+}
+
+// A delta on the way down a chain, to be applied on the way back up
+typedef struct {
+    pack_t *pack;
+    uint64_t offset;
+    pack_entry entry;
+} pack_delta;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    pack_delta *data;
+} pack_delta_array_t;
+
+// No real chain is anywhere near this long (git makes them up to 50 deep by
+// default, 4095 at most), but deltas by hash could loop back on themselves
+#define PACK_DELTA_DEPTH_MAX 10000
+
+// Follows the entry at `offset` down its chain of deltas to the whole object
+// at the bottom, or to a base in the cache, adding each delta on the way to
+// `chain`. The base's pack and offset are left in `pack` and `offset`.
+bool pack_delta_chain(pack_t **pack, uint64_t *offset, pack_delta_array_t *chain, delta_base **cached, pack_entry *entry) {
+    for (;;) {
+        *cached = delta_base_find(*pack, *offset);
+        if (*cached != NULL) return true;
+        if (!pack_entry_parse(*pack, *offset, entry)) {
+            fprintf(stderr, "Broken entry at %lu in .git/objects/pack/%s\n", (unsigned long)*offset, (*pack)->name);
+            return false;
+        }
+        if (entry->type != PACK_OFS_DELTA && entry->type != PACK_REF_DELTA) break;
+        if (chain->size == PACK_DELTA_DEPTH_MAX) {
+            fprintf(stderr, "Delta chain too long at %lu in .git/objects/pack/%s\n", (unsigned long)*offset, (*pack)->name);
+            return false;
+        }
+        ARRAY_APPEND(*chain, ((pack_delta){ .pack = *pack, .offset = *offset, .entry = *entry }));
+        if (entry->type == PACK_OFS_DELTA) {
+            *offset = entry->base;
+        } else if (!pack_find(entry->base_hash, pack, offset)) {
+            char hex[SHA1_DIGEST_HEX_LENGTH + 1];
+            sha1_to_hex(entry->base_hash, hex);
+            fprintf(stderr, "Couldn't find delta base %s\n", hex);
+            return false;
+        }
+    }
+    if (pack_object_type(entry->type) == UNKNOWN) {
+        // FIXME read tags
+        fprintf(stderr, "Can't read tag entries yet, at %lu in .git/objects/pack/%s\n", (unsigned long)*offset, (*pack)->name);
+        return false;
+    }
+    return true;
+}
+
+// Reads the entry at `offset` as a whole object, applying deltas as needed.
+// The chain is followed down first, then the deltas are applied back up it
+// one after the other, each result going in the cache once the next delta
+// has been applied to it. The object is left with room for OBJECT_HEADER_MAX
+// more after it.
+bool pack_resolve(pack_t *pack, uint64_t offset, git_object_t *type, uint8_t **data, size_t *size) {
+    bool ret = false;
+    pack_delta_array_t chain = {0};
+    uint8_t *base = NULL;
+    size_t base_size = 0;
+    bool owned = false;
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    delta_base *cached = NULL;
+    pack_entry entry;
+    if (!pack_delta_chain(&pack, &offset, &chain, &cached, &entry)) return_defer(false);
+    if (cached != NULL) {
+        *type = cached->type;
+        base = cached->data;
+        base_size = cached->size;
+    } else {
+        *type = pack_object_type(entry.type);
+        if (!pack_inflate(pack, &entry, &base)) {
+            fprintf(stderr, "Couldn't decompress entry at %lu in .git/objects/pack/%s\n", (unsigned long)offset, pack->name);
+            return_defer(false);
+        }
+        base_size = entry.size;
+        owned = true;
+    }
+
+    while (chain.size > 0) {
+        pack_delta *delta = &chain.data[-- chain.size];
+        uint8_t *instructions = NULL;
+        if (!pack_inflate(delta->pack, &delta->entry, &instructions)) {
+            fprintf(stderr, "Couldn't decompress entry at %lu in .git/objects/pack/%s\n", (unsigned long)delta->offset, delta->pack->name);
+            return_defer(false);
+        }
+        uint8_t *result = NULL;
+        size_t result_size = 0;
+        bool ok = delta_apply(base, base_size, instructions, delta->entry.size, &result, &result_size);
+        free(instructions);
+        if (!ok) {
+            fprintf(stderr, "Broken delta at %lu in .git/objects/pack/%s\n", (unsigned long)delta->offset, delta->pack->name);
+            return_defer(false);
+        }
+        if (owned) delta_base_add(pack, offset, *type, base, base_size);
+        base = result;
+        base_size = result_size;
+        owned = true;
+        pack = delta->pack;
+        offset = delta->offset;
+    }
+
+    if (!owned) {
+        // Asked for a base that's in the cache, which keeps its copy
+        uint8_t *copy = malloc(base_size + OBJECT_HEADER_MAX);
+        if (copy == NULL) return_defer(false);
+        memcpy(copy, base, base_size);
+        base = copy;
+        owned = true;
+    }
+    *data = base;
+    *size = base_size;
+    base = NULL;
+    ret = true;
+
+#undef return_defer
+defer:
+    if (owned) free(base);
+    free(chain.data);
+    return ret;
+}
+
+// The size of the object a delta makes, from the start of the delta, so the
+// rest of it needn't be inflated
+bool pack_delta_result_size(const pack_t *pack, const pack_entry *entry, uint64_t *size) {
+    zlib_context ctx = {0};
+    ctx.deflate.bits.data = (uint8_t *)pack->pack + entry->data;
+    ctx.deflate.bits.size = pack->pack_size - PACK_TRAILER_SIZE - entry->data;
+    // Both sizes, at their longest
+    ctx.deflate.limit = 20;
+    zlib_decompress(&ctx);
+    const uint8_t *p = ctx.deflate.out.data;
+    uint64_t base_size = 0;
+    bool ok = ctx.state != ZLIB_ERROR && p != NULL &&
+              delta_read_size(&p, ctx.deflate.out.data + ctx.deflate.out.size, &base_size) &&
+              delta_read_size(&p, ctx.deflate.out.data + ctx.deflate.out.size, size);
+    zlib_end(&ctx);
+    if (ctx.deflate.out.data) free(ctx.deflate.out.data);
+    return ok;
+}
+
+// read_object for objects that aren't loose
+bool read_packed_object(const char *hash, uint8_t **data, long *size) {
+    pack_t *pack = NULL;
+    uint64_t offset = 0;
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    if (!sha1_from_hex(hash, oid) || !pack_find(oid, &pack, &offset)) {
+        fprintf(stderr, "Couldn't find object %s\n", hash);
+        return false;
+    }
+    git_object_t type = UNKNOWN;
+    uint8_t *content = NULL;
+    size_t content_size = 0;
+    if (!pack_resolve(pack, offset, &type, &content, &content_size)) return false;
+
+    // The header goes in front, as in a loose object
+    char header[OBJECT_HEADER_MAX];
+    long headersize = object_header(type, content_size, header) + 1;
+    memmove(content + headersize, content, content_size);
+    memcpy(content, header, headersize);
+    *data = content;
+    *size = headersize + content_size;
+    return true;
+}
+
+// read_object_info for objects that aren't loose. The size is in the entry's
+// header, or at the start of its delta, and the type at the bottom of the
+// chain, so none of it needs resolving.
+bool read_packed_object_info(const char *hash, git_object_t *type, long *size) {
+    pack_t *pack = NULL;
+    uint64_t offset = 0;
+    pack_entry entry;
+    if (!packed_object_entry(hash, &pack, &offset, &entry)) return false;
+    uint64_t object_size = entry.size;
+    if ((entry.type == PACK_OFS_DELTA || entry.type == PACK_REF_DELTA) &&
+            !pack_delta_result_size(pack, &entry, &object_size)) {
+        fprintf(stderr, "Couldn't decompress entry at %lu in .git/objects/pack/%s\n", (unsigned long)offset, pack->name);
+        return false;
+    }
+
+    pack_delta_array_t chain = {0};
+    delta_base *cached = NULL;
+    bool ok = pack_delta_chain(&pack, &offset, &chain, &cached, &entry);
+    free(chain.data);
+    if (!ok) return false;
+    *type = cached != NULL ? cached->type : pack_object_type(entry.type);
+    *size = object_size;
+    return true;
+}
+
+// Objects read so far, so that reading one again is a copy rather than
+// another inflate (and for deltas, another resolve). They're kept one after
+// the other in an arena used as a ring: each goes after the last, and once
+// that comes round to the oldest, the oldest are evicted to make room. An
+// open addressing table finds them by hash. GIT_OBJECT_CACHE_SIZE sets how
+// big the arena is, in bytes or with a k, m or g after, and 0 turns it off.
+typedef struct {
+    uint8_t hash[SHA1_DIGEST_BYTE_LENGTH];
+    size_t size; // Of the object, header and all, which follows
+} object_cache_record;
+
+typedef struct {
+    uint8_t hash[SHA1_DIGEST_BYTE_LENGTH];
+    size_t record; // Its offset in the arena plus one, 0 for an empty slot
+} object_cache_slot;
+
+#define OBJECT_CACHE_DEFAULT_SIZE (64 << 20)
+#define OBJECT_CACHE_ALIGN 8
+
+struct {
+    bool ready;
+    uint8_t *arena;
+    size_t budget;
+    // Records are in [tail, head), or once head has wrapped round to the
+    // start, in [tail, end) then [0, head)
+    size_t head;
+    size_t tail;
+    size_t end;
+    bool wrapped;
+    size_t count;
+    object_cache_slot *slots;
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} object_cache = {0};
+
+bool object_cache_init(void) {
+    if (object_cache.ready) return object_cache.arena != NULL;
+    object_cache.ready = true;
+    object_cache.budget = OBJECT_CACHE_DEFAULT_SIZE;
+    const char *size = getenv("GIT_OBJECT_CACHE_SIZE");
+    if (size != NULL) {
+        char *end = NULL;
+        unsigned long long budget = strtoull(size, &end, 10);
+        switch (*end) {
+            case 'k': case 'K': budget <<= 10; end ++; break;
+            case 'm': case 'M': budget <<= 20; end ++; break;
+            case 'g': case 'G': budget <<= 30; end ++; break;
+        }
+        if (end == size || *end != '\0') {
+            fprintf(stderr, "Ignoring bad GIT_OBJECT_CACHE_SIZE %s\n", size);
+        } else {
+            object_cache.budget = budget;
+        }
+    }
+    // Pages the arena hasn't got to yet aren't really allocated
+    if (object_cache.budget > 0) object_cache.arena = malloc(object_cache.budget);
+    return object_cache.arena != NULL;
+}
+
+// The hashes are already as random as can be
+size_t object_cache_home(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    return h & (object_cache.capacity - 1);
+}
+
+object_cache_slot *object_cache_slot_for(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
+    if (object_cache.capacity == 0) return NULL;
+    for (size_t i = object_cache_home(hash);; i = (i + 1) & (object_cache.capacity - 1)) {
+        object_cache_slot *slot = &object_cache.slots[i];
+        if (slot->record == 0) return slot;
+        if (memcmp(slot->hash, hash, SHA1_DIGEST_BYTE_LENGTH) == 0) return slot;
+    }
+}
+
+// Empties `slot`, moving back any later in its run that would then be cut
+// off from where they belong, so a lookup never stops short at the gap
+void object_cache_slot_clear(object_cache_slot *slot) {
+    size_t mask = object_cache.capacity - 1;
+    size_t i = slot - object_cache.slots;
+    for (size_t j = (i + 1) & mask; object_cache.slots[j].record != 0; j = (j + 1) & mask) {
+        size_t home = object_cache_home(object_cache.slots[j].hash);
+        // Whether home is cyclically in (i, j], in which case it stays put
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            object_cache.slots[i] = object_cache.slots[j];
+            i = j;
+        }
+    }
+    object_cache.slots[i].record = 0;
+}
+
+bool object_cache_grow(void) {
+    size_t capacity = object_cache.capacity == 0 ? 1024 : object_cache.capacity * 2;
+    object_cache_slot *old = object_cache.slots;
+    size_t old_capacity = object_cache.capacity;
+    object_cache.slots = calloc(capacity, sizeof(object_cache_slot));
+    if (object_cache.slots == NULL) {
+        object_cache.slots = old;
+        return false;
+    }
+    object_cache.capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i ++) {
+        if (old[i].record != 0) *object_cache_slot_for(old[i].hash) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+size_t object_cache_record_size(size_t size) {
+    return (sizeof(object_cache_record) + size + OBJECT_CACHE_ALIGN - 1) & ~(size_t)(OBJECT_CACHE_ALIGN - 1);
+}
+
+void object_cache_evict_oldest(void) {
+    object_cache_record *record = (object_cache_record *)(object_cache.arena + object_cache.tail);
+    object_cache_slot_clear(object_cache_slot_for(record->hash));
+    object_cache.tail += object_cache_record_size(record->size);
+    object_cache.count --;
+    object_cache.evictions ++;
+    if (object_cache.wrapped && object_cache.tail == object_cache.end) {
+        object_cache.tail = 0;
+        object_cache.wrapped = false;
+    }
+}
+
+// Makes room for `size` bytes at the head, evicting as needed
+size_t object_cache_alloc(size_t size) {
+    for (;;) {
+        if (object_cache.count == 0) {
+            object_cache.head = object_cache.tail = 0;
+            object_cache.wrapped = false;
+        }
+        if (!object_cache.wrapped) {
+            if (object_cache.budget - object_cache.head >= size) break;
+            object_cache.end = object_cache.head;
+            object_cache.head = 0;
+            object_cache.wrapped = true;
+        } else if (object_cache.tail - object_cache.head >= size) {
+            break;
+        } else {
+            object_cache_evict_oldest();
+        }
+    }
+    size_t offset = object_cache.head;
+    object_cache.head += size;
+    return offset;
+}
+
+// Finds an object read before. What's returned is only good until the next
+// object_cache_put.
+bool object_cache_get(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], const uint8_t **data, size_t *size) {
+    if (!object_cache_init()) return false;
+    object_cache_slot *slot = object_cache_slot_for(hash);
+    if (slot == NULL || slot->record == 0) {
+        object_cache.misses ++;
+        return false;
+    }
+    object_cache.hits ++;
+    object_cache_record *record = (object_cache_record *)(object_cache.arena + slot->record - 1);
+    *data = (const uint8_t *)(record + 1);
+    *size = record->size;
+    return true;
+}
+
+// Keeps a copy of an object, unless it would take up more than a quarter of
+// the cache by itself
+void object_cache_put(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], const uint8_t *data, size_t size) {
+    if (!object_cache_init() || object_cache_record_size(size) > object_cache.budget / 4) return;
+    object_cache_slot *slot = object_cache_slot_for(hash);
+    if (slot != NULL && slot->record != 0) return;
+    if ((object_cache.count + 1) * 2 > object_cache.capacity && !object_cache_grow()) return;
+
+    size_t offset = object_cache_alloc(object_cache_record_size(size));
+    object_cache_record *record = (object_cache_record *)(object_cache.arena + offset);
+    memcpy(record->hash, hash, SHA1_DIGEST_BYTE_LENGTH);
+    record->size = size;
+    memcpy(record + 1, data, size);
+    // Evicting may have moved things about in the table
+    slot = object_cache_slot_for(hash);
+    memcpy(slot->hash, hash, SHA1_DIGEST_BYTE_LENGTH);
+    slot->record = offset + 1;
+    object_cache.count ++;
+}
+
+bool read_object(char *hash, uint8_t **data, long *size) {
+    bool ret = false;
+    zlib_context ctx = {0};
+    loose_object file = {0};
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    bool valid = sha1_from_hex(hash, oid);
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    const uint8_t *cached = NULL;
+    size_t cached_size = 0;
+    if (valid && object_cache_get(oid, &cached, &cached_size)) {
+        *data = malloc(cached_size > 0 ? cached_size : 1);
+        if (*data == NULL) return false;
+        memcpy(*data, cached, cached_size);
+        *size = cached_size;
+        return true;
+    }
 
-    /* hexdump(filedata, size); */
+    // FIXME check in right dir
+    if (!loose_object_open(hash, &file)) {
+        if (!file.missing || !read_packed_object(hash, data, size)) return_defer(false);
+        if (valid) object_cache_put(oid, *data, *size);
+        return_defer(true);
+    }
 
-    ctx.deflate.bits.data = filedata;
-    ctx.deflate.bits.size = filesize;
+    ctx.deflate.bits.data = (uint8_t *)file.data;
+    ctx.deflate.bits.size = file.size;
 
+    // Stop once the header is out, so the output can be sized for the whole
+    // object up front rather than growing as it goes
+    ctx.deflate.limit = OBJECT_HEADER_MAX;
     if (!zlib_decompress(&ctx)) {
-        fprintf(stderr, "Couldn't decompress object file %s\n", object_path);
-        return_defer(false);
+        uint8_t *nul = memchr(ctx.deflate.out.data, '\0', ctx.deflate.out.size);
+        long object_size = 0;
+        if (ctx.state != ZLIB_ERROR && nul != NULL &&
+                parse_object_header((char *)ctx.deflate.out.data, &object_size) != UNKNOWN &&
+                (size_t)object_size / OBJECT_MAX_EXPANSION <= file.size &&
+                !deflate_reserve(&ctx.deflate, nul - ctx.deflate.out.data + 1 + object_size)) {
+            ctx.state = ZLIB_ERROR;
+        }
+        ctx.deflate.limit = 0;
+        if (ctx.state == ZLIB_ERROR || !zlib_decompress(&ctx)) {
+            fprintf(stderr, "Couldn't decompress object file for %s\n", hash);
+            return_defer(false);
+        }
     }
 
     *data = ctx.deflate.out.data;
     *size = ctx.deflate.out.size;
+    if (valid) object_cache_put(oid, *data, *size);
     ret = true;
 
 #undef return_defer
 defer:
-    if (filedata) free(filedata);
-    if (object_path) free(object_path);
+    zlib_end(&ctx);
+    if (!ret && ctx.deflate.out.data) free(ctx.deflate.out.data);
+    loose_object_close(&file);
     return ret;
 }
 
@@ -315,14 +1673,207 @@ int init_command(command_t *command, const char *program, int argc, char *argv[]
     return 0;
 }
 
-typedef enum {
-    UNKNOWN,
-    BLOB,
-    TREE,
-    COMMIT,
+// Gets the type and size of an object from its header, inflating only as much
+// of the object file as it takes to get the header
+bool read_object_info(char *hash, git_object_t *type, long *size) {
+    bool ret = false;
+    zlib_context ctx = {0};
+    loose_object file = {0};
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    const uint8_t *cached = NULL;
+    size_t cached_size = 0;
+    if (sha1_from_hex(hash, oid) && object_cache_get(oid, &cached, &cached_size)) {
+        *type = parse_object_header((const char *)cached, size);
+        return_defer(true);
+    }
 
-    NUM_OBJECTS, // Keep at end, _Static_assert's depend on it
-} git_object_t;
+    // FIXME check in right dir
+    if (!loose_object_open(hash, &file)) {
+        return_defer(file.missing && read_packed_object_info(hash, type, size));
+    }
+
+    ctx.deflate.bits.data = (uint8_t *)file.data;
+    ctx.deflate.bits.size = file.size;
+    ctx.deflate.limit = OBJECT_HEADER_MAX;
+    zlib_decompress(&ctx);
+    if (ctx.state == ZLIB_ERROR) {
+        fprintf(stderr, "Couldn't decompress object file for %s\n", hash);
+        return_defer(false);
+    }
+    deflate_array *out = &ctx.deflate.out;
+    if (out->size == 0 || memchr(out->data, '\0', out->size) == NULL) {
+        fprintf(stderr, "Decompressed data is not a valid object\n");
+        return_defer(false);
+    }
+
+    *type = parse_object_header((char *)ctx.deflate.out.data, size);
+    if (*type == UNKNOWN) {
+        fprintf(stderr, "Decompressed data is not a valid object\n");
+        return_defer(false);
+    }
+    ret = true;
+
+#undef return_defer
+defer:
+    zlib_end(&ctx);
+    if (ctx.deflate.out.data) free(ctx.deflate.out.data);
+    loose_object_close(&file);
+    return ret;
+}
+
+// State for streaming an object out as it is decompressed. The header is
+// split off and checked, then the content goes to `out` (or is dropped if
+// that's NULL), so only the decompression window is kept in memory.
+typedef struct {
+    const char *hash;
+    git_object_t expected; // UNKNOWN to allow any type
+    FILE *out;
+    bool keep_trees;       // Collect tree content in `tree` rather than writing it
+
+    char header[32];
+    size_t header_size;
+    bool have_header;
+    git_object_t type;
+    long size;
+    long written;
+    uint8_array_t tree;
+    bool failed;
+} object_stream;
+
+bool object_stream_sink(void *data, const uint8_t *buf, size_t size) {
+    object_stream *stream = data;
+    if (!stream->have_header) {
+        uint8_t *nul = memchr(buf, '\0', size);
+        size_t len = nul == NULL ? size : (size_t)(nul - buf) + 1;
+        if (stream->header_size + len > sizeof(stream->header)) {
+            fprintf(stderr, "Decompressed data is not a valid object\n");
+            stream->failed = true;
+            return false;
+        }
+        memcpy(stream->header + stream->header_size, buf, len);
+        stream->header_size += len;
+        buf += len;
+        size -= len;
+        if (nul == NULL) return true;
+
+        stream->have_header = true;
+        stream->type = parse_object_header(stream->header, &stream->size);
+        if (stream->type == UNKNOWN) {
+            fprintf(stderr, "Decompressed data is not a valid object\n");
+            stream->failed = true;
+            return false;
+        }
+        if (stream->expected != UNKNOWN && stream->type != stream->expected) {
+            fprintf(stderr, "Invalid type in object file %s\n", stream->hash);
+            stream->failed = true;
+            return false;
+        }
+    }
+
+    if ((long)size > stream->size - stream->written) {
+        fprintf(stderr, "Invalid size in object file at %s\n", stream->hash);
+        stream->failed = true;
+        return false;
+    }
+    stream->written += size;
+    if (stream->type == TREE && stream->keep_trees) {
+        if (size > 0) ARRAY_APPEND_BYTES(stream->tree, buf, size);
+    } else if (stream->out != NULL && fwrite(buf, 1, size, stream->out) != size) {
+        fprintf(stderr, "Couldn't write out object %s: %s\n", stream->hash, strerror(errno));
+        stream->failed = true;
+        return false;
+    }
+    return true;
+}
+
+// stream_object for objects that aren't loose. A whole object is inflated
+// straight into the stream, after the header that it doesn't have in a pack.
+// A delta has to be resolved first, and is then handed over in one go.
+bool stream_packed_object(const char *hash, object_stream *stream) {
+    pack_t *pack = NULL;
+    uint64_t offset = 0;
+    pack_entry entry;
+    if (!packed_object_entry(hash, &pack, &offset, &entry)) return false;
+    if (pack_object_type(entry.type) == UNKNOWN) {
+        git_object_t type = UNKNOWN;
+        uint8_t *content = NULL;
+        size_t size = 0;
+        if (!pack_resolve(pack, offset, &type, &content, &size)) return false;
+        char header[OBJECT_HEADER_MAX];
+        long headersize = object_header(type, size, header);
+        bool ok = object_stream_sink(stream, (uint8_t *)header, headersize + 1) &&
+                  object_stream_sink(stream, content, size);
+        free(content);
+        return ok;
+    }
+
+    char header[OBJECT_HEADER_MAX];
+    long headersize = object_header(pack_object_type(entry.type), entry.size, header);
+    if (!object_stream_sink(stream, (uint8_t *)header, headersize + 1)) return false;
+
+    zlib_context ctx = {
+        .sink = object_stream_sink,
+        .sink_data = stream,
+    };
+    ctx.deflate.bits.data = (uint8_t *)pack->pack + entry.data;
+    ctx.deflate.bits.size = pack->pack_size - PACK_TRAILER_SIZE - entry.data;
+    bool ok = zlib_decompress(&ctx);
+    zlib_end(&ctx);
+    if (ctx.deflate.out.data) free(ctx.deflate.out.data);
+    if (!ok) {
+        if (!stream->failed) fprintf(stderr, "Couldn't decompress entry at %lu in .git/objects/pack/%s\n", (unsigned long)offset, pack->name);
+        return false;
+    }
+    if (stream->written != stream->size) {
+        fprintf(stderr, "Invalid size in object file at %s\n", hash);
+        return false;
+    }
+    return true;
+}
+
+// Like read_object, but hands the output to `stream` as it is decompressed
+// rather than keeping it all
+bool stream_object(char *hash, object_stream *stream) {
+    bool ret = false;
+    zlib_context ctx = {
+        .sink = object_stream_sink,
+        .sink_data = stream,
+    };
+    loose_object file = {0};
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    const uint8_t *cached = NULL;
+    size_t cached_size = 0;
+    if (sha1_from_hex(hash, oid) && object_cache_get(oid, &cached, &cached_size)) {
+        return_defer(object_stream_sink(stream, cached, cached_size));
+    }
+
+    // FIXME check in right dir
+    if (!loose_object_open(hash, &file)) {
+        return_defer(file.missing && stream_packed_object(hash, stream));
+    }
+
+    ctx.deflate.bits.data = (uint8_t *)file.data;
+    ctx.deflate.bits.size = file.size;
+    if (!zlib_decompress(&ctx)) {
+        if (!stream->failed) fprintf(stderr, "Couldn't decompress object file for %s\n", hash);
+        return_defer(false);
+    }
+
+    if (!stream->have_header || stream->written != stream->size) {
+        fprintf(stderr, "Invalid size in object file at %s\n", hash);
+        return_defer(false);
+    }
+    ret = true;
+
+#undef return_defer
+defer:
+    zlib_end(&ctx);
+    if (ctx.deflate.out.data) free(ctx.deflate.out.data);
+    loose_object_close(&file);
+    return ret;
+}
 
 // blob blob
 //
@@ -344,14 +1895,296 @@ typedef enum {
 // FIXME need assertion that argc <= 32
 //
 #define cat_file_args ARGS( \
-    REQUIRES( \
-        CONFLICTS( \
-            CONFLICTS(FLAG("-p"), FLAG("-t")), \
-            { .typ = OBJECT_TYPE } \
+    CONFLICTS( \
+        REQUIRES( \
+            CONFLICTS( \
+                CONFLICTS(FLAG("-p"), FLAG("-t"), FLAG("-s"), FLAG("-e")), \
+                { .typ = OBJECT_TYPE } \
+            ), \
+            { .typ = OBJECT_HASH } \
         ), \
-        { .typ = OBJECT_HASH } \
+        REQUIRES( \
+            CONFLICTS(FLAG("--batch"), FLAG("--batch-check")), \
+            FLAG("[--buffer]") \
+        ) \
     ) \
 )
+
+// The loose objects in each .git/objects/xx, listed the first time a short
+// hash needs them and kept sorted, so each directory is read at most once
+typedef struct {
+    bool listed;
+    size_t count;
+    size_t capacity;
+    uint8_t (*hashes)[SHA1_DIGEST_BYTE_LENGTH];
+} loose_bucket;
+
+loose_bucket loose_buckets[256] = {0};
+
+int hash_compare(const void *a, const void *b) {
+    return memcmp(a, b, SHA1_DIGEST_BYTE_LENGTH);
+}
+
+loose_bucket *loose_bucket_list(uint8_t byte) {
+    loose_bucket *bucket = &loose_buckets[byte];
+    if (bucket->listed) return bucket;
+    bucket->listed = true;
+    char hex[SHA1_DIGEST_HEX_LENGTH + 1];
+    snprintf(hex, sizeof(hex), "%02x", byte);
+    int fd = openat(objects_dir_fd(), hex, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return bucket;
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return bucket;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strlen(entry->d_name) != SHA1_DIGEST_HEX_LENGTH - 2) continue;
+        memcpy(hex + 2, entry->d_name, SHA1_DIGEST_HEX_LENGTH - 2);
+        uint8_t hash[SHA1_DIGEST_BYTE_LENGTH];
+        if (!sha1_from_hex(hex, hash)) continue;
+        if (bucket->count == bucket->capacity) {
+            bucket->capacity = bucket->capacity == 0 ? 64 : bucket->capacity * 2;
+            bucket->hashes = realloc(bucket->hashes, bucket->capacity * SHA1_DIGEST_BYTE_LENGTH);
+            assert(bucket->hashes != NULL);
+        }
+        memcpy(bucket->hashes[bucket->count ++], hash, SHA1_DIGEST_BYTE_LENGTH);
+    }
+    closedir(dir);
+    qsort(bucket->hashes, bucket->count, SHA1_DIGEST_BYTE_LENGTH, hash_compare);
+    return bucket;
+}
+
+// An object name as the first few digits of its hash. There have to be at
+// least 4, as in git, to have much chance of naming just the one object.
+#define OBJECT_NAME_MIN_DIGITS 4
+typedef struct {
+    uint8_t bytes[SHA1_DIGEST_BYTE_LENGTH]; // The digits given, then zeros
+    size_t digits;
+} oid_prefix;
+
+bool oid_prefix_parse(const char *name, oid_prefix *prefix) {
+    *prefix = (oid_prefix){0};
+    size_t len = strlen(name);
+    if (len < OBJECT_NAME_MIN_DIGITS || len > SHA1_DIGEST_HEX_LENGTH) return false;
+    for (size_t i = 0; i < len; i ++) {
+        char c = name[i];
+        int value = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                  : -1;
+        if (value == -1) return false;
+        prefix->bytes[i / 2] |= i % 2 == 0 ? value << 4 : value;
+    }
+    prefix->digits = len;
+    return true;
+}
+
+bool oid_prefix_matches(const oid_prefix *prefix, const uint8_t *hash) {
+    size_t whole = prefix->digits / 2;
+    if (memcmp(hash, prefix->bytes, whole) != 0) return false;
+    return prefix->digits % 2 == 0 || (hash[whole] & 0xF0) == prefix->bytes[whole];
+}
+
+// The objects a short name could be, as many as there's room to list. `count`
+// keeps going past that, so it can still say there were more.
+#define OBJECT_NAME_CANDIDATES_MAX 16
+typedef struct {
+    uint8_t hashes[OBJECT_NAME_CANDIDATES_MAX][SHA1_DIGEST_BYTE_LENGTH];
+    size_t count;
+} object_candidates;
+
+void object_candidates_add(object_candidates *candidates, const uint8_t *hash) {
+    size_t listed = candidates->count < OBJECT_NAME_CANDIDATES_MAX ? candidates->count : OBJECT_NAME_CANDIDATES_MAX;
+    // The same object can be loose and in a pack, or in more than one pack
+    for (size_t i = 0; i < listed; i ++) {
+        if (memcmp(candidates->hashes[i], hash, SHA1_DIGEST_BYTE_LENGTH) == 0) return;
+    }
+    if (candidates->count < OBJECT_NAME_CANDIDATES_MAX) {
+        memcpy(candidates->hashes[candidates->count], hash, SHA1_DIGEST_BYTE_LENGTH);
+    }
+    candidates->count ++;
+}
+
+// Adds the run of sorted hashes from `index` that start with `prefix`
+void object_candidates_add_run(object_candidates *candidates, const uint8_t *hashes, size_t index, size_t count,
+                               const oid_prefix *prefix) {
+    for (; index < count; index ++) {
+        const uint8_t *hash = hashes + index * SHA1_DIGEST_BYTE_LENGTH;
+        if (!oid_prefix_matches(prefix, hash) || candidates->count > OBJECT_NAME_CANDIDATES_MAX) break;
+        object_candidates_add(candidates, hash);
+    }
+}
+
+typedef enum {
+    OBJECT_NAME_FOUND,
+    OBJECT_NAME_INVALID,
+    OBJECT_NAME_MISSING,
+    OBJECT_NAME_AMBIGUOUS,
+} object_name_result;
+
+// Finds the object `name` is the hash of, or the start of the hash of. A whole
+// hash is taken as it is. Otherwise the sorted list of the loose objects that
+// start with the same byte and each pack's index (or the multi-pack-index)
+// are searched for it, where a binary search finds the first hash that could
+// match, and any after it that do too.
+object_name_result find_object_name(const char *name, uint8_t oid[SHA1_DIGEST_BYTE_LENGTH], object_candidates *candidates) {
+    candidates->count = 0;
+    if (strlen(name) == SHA1_DIGEST_HEX_LENGTH) {
+        return sha1_from_hex(name, oid) ? OBJECT_NAME_FOUND : OBJECT_NAME_INVALID;
+    }
+    oid_prefix prefix;
+    if (!oid_prefix_parse(name, &prefix)) return OBJECT_NAME_INVALID;
+
+    loose_bucket *bucket = loose_bucket_list(prefix.bytes[0]);
+    object_candidates_add_run(candidates, (const uint8_t *)bucket->hashes,
+                              hashes_lower_bound((const uint8_t *)bucket->hashes, 0, bucket->count, prefix.bytes),
+                              bucket->count, &prefix);
+    pack_array_t *all = packs_load();
+    if (midx.data != NULL) {
+        object_candidates_add_run(candidates, midx.hashes,
+                                  oid_table_lower_bound(midx.fanout, midx.hashes, midx.count, prefix.bytes),
+                                  midx.count, &prefix);
+    }
+    for (size_t i = midx.pack_count; i < all->size; i ++) {
+        pack_t *pack = &all->data[i];
+        object_candidates_add_run(candidates, pack->hashes,
+                                  oid_table_lower_bound(pack->fanout, pack->hashes, pack->count, prefix.bytes),
+                                  pack->count, &prefix);
+    }
+
+    if (candidates->count == 0) return OBJECT_NAME_MISSING;
+    if (candidates->count > 1) return OBJECT_NAME_AMBIGUOUS;
+    memcpy(oid, candidates->hashes[0], SHA1_DIGEST_BYTE_LENGTH);
+    return OBJECT_NAME_FOUND;
+}
+
+// find_object_name for commands, which say what's wrong with a name that
+// doesn't work out. The hash is given back in lower case, as object files
+// are named.
+bool resolve_object_name(const char *name, char hash[SHA1_DIGEST_HEX_LENGTH + 1]) {
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    object_candidates candidates;
+    switch (find_object_name(name, oid, &candidates)) {
+        case OBJECT_NAME_FOUND:
+            sha1_to_hex(oid, hash);
+            hash[SHA1_DIGEST_HEX_LENGTH] = '\0';
+            return true;
+
+        case OBJECT_NAME_INVALID:
+            fprintf(stderr, "ERROR: %s is not a valid SHA-1 hash\n", name);
+            return false;
+
+        case OBJECT_NAME_MISSING:
+            fprintf(stderr, "ERROR: Not a valid object name %s\n", name);
+            return false;
+
+        case OBJECT_NAME_AMBIGUOUS:
+            fprintf(stderr, "ERROR: short object ID %s is ambiguous\n", name);
+            fprintf(stderr, "The candidates are:\n");
+            for (size_t i = 0; i < candidates.count && i < OBJECT_NAME_CANDIDATES_MAX; i ++) {
+                char candidate[SHA1_DIGEST_HEX_LENGTH + 1];
+                sha1_to_hex(candidates.hashes[i], candidate);
+                candidate[SHA1_DIGEST_HEX_LENGTH] = '\0';
+                git_object_t type = UNKNOWN;
+                long size = 0;
+                fprintf(stderr, "  %s %s\n", candidate,
+                        read_object_info(candidate, &type, &size) ? object_type_name(type) : "(unreadable)");
+            }
+            if (candidates.count > OBJECT_NAME_CANDIDATES_MAX) fprintf(stderr, "  ...\n");
+            return false;
+
+        default:
+            GIT_UNREACHABLE();
+            return false;
+    }
+}
+
+// Whether there's an object file or a pack entry for `hash`, without reading
+// either
+bool object_exists(const char *hash) {
+    char name[OBJECT_FILE_NAME_SIZE];
+    object_file_name(hash, name);
+    if (faccessat(objects_dir_fd(), name, F_OK, 0) == 0) return true;
+    uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+    pack_t *pack = NULL;
+    uint64_t offset = 0;
+    return sha1_from_hex(hash, oid) && pack_find(oid, &pack, &offset);
+}
+
+// Blobs at least this big are streamed out by --batch rather than read whole
+#define CAT_FILE_BATCH_STREAM_SIZE (1 << 20)
+
+// Reads object names from stdin, one a line, answering each with
+// "<hash> <type> <size>" (or "<name> missing"), followed for --batch by the
+// object itself and a newline. Each answer is flushed as it's made, so a
+// program on the other end can wait for it, unless --buffer says it's only
+// going to read them all at the end.
+int cat_file_batch(bool contents, bool buffer) {
+    int ret = 0;
+    char *line = NULL;
+    size_t capacity = 0;
+    uint8_t *data = NULL;
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    ssize_t len;
+    while ((len = getline(&line, &capacity, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[-- len] = '\0';
+        uint8_t oid[SHA1_DIGEST_BYTE_LENGTH];
+        char hash[SHA1_DIGEST_HEX_LENGTH + 1];
+        object_candidates candidates;
+        object_name_result found = find_object_name(line, oid, &candidates);
+        if (found == OBJECT_NAME_AMBIGUOUS) {
+            printf("%s ambiguous\n", line);
+        } else if (found != OBJECT_NAME_FOUND) {
+            printf("%s missing\n", line);
+        } else {
+            // Object files are named in lower case
+            sha1_to_hex(oid, hash);
+            hash[SHA1_DIGEST_HEX_LENGTH] = '\0';
+            git_object_t type = UNKNOWN;
+            long size = 0;
+            if (!object_exists(hash)) {
+                printf("%s missing\n", line);
+            } else if (!read_object_info(hash, &type, &size)) {
+                fprintf(stderr, "Couldn't read object file %s\n", hash);
+                return_defer(1);
+            } else {
+                printf("%s %s %ld\n", hash, object_type_name(type), size);
+            }
+            if (contents && type != UNKNOWN && size >= CAT_FILE_BATCH_STREAM_SIZE) {
+                object_stream stream = {
+                    .hash = hash,
+                    .expected = type,
+                    .out = stdout,
+                };
+                if (!stream_object(hash, &stream)) {
+                    fprintf(stderr, "Couldn't read object file %s\n", hash);
+                    return_defer(1);
+                }
+                putchar('\n');
+            } else if (contents && type != UNKNOWN) {
+                long filesize = 0;
+                if (!read_object(hash, &data, &filesize)) {
+                    fprintf(stderr, "Couldn't read object file %s\n", hash);
+                    return_defer(1);
+                }
+                fwrite(data + filesize - size, 1, size, stdout);
+                putchar('\n');
+                free(data);
+                data = NULL;
+            }
+        }
+        if (!buffer && fflush(stdout) == EOF) return_defer(1);
+    }
+
+#undef return_defer
+defer:
+    free(data);
+    free(line);
+    return ret;
+}
+
 int cat_file_command(command_t *command, const char *program, int argc, char *argv[]) {
     int ret = 0;
     uint8_t *data = NULL;
@@ -378,14 +2211,36 @@ int cat_file_command(command_t *command, const char *program, int argc, char *ar
     }
     bool pretty = false;
     bool showtype = false;
+    bool showsize = false;
+    bool exists = false;
+    bool batch = false;
+    bool batch_contents = false;
+    bool buffer = false;
+    char *flag = NULL;
     char *hash = NULL;
     git_object_t type = UNKNOWN;
     while (argc > 0) {
         char *arg = ARG();
-        if (strcmp(arg, "-p") == 0) {
-            pretty = true;
-        } else if (strcmp(arg, "-t") == 0) {
-            showtype = true;
+        if (strcmp(arg, "--buffer") == 0) {
+            buffer = true;
+        } else if (strcmp(arg, "--batch") == 0 || strcmp(arg, "--batch-check") == 0) {
+            if (flag != NULL) {
+                fprintf(stderr, "ERROR: %s is incompatible with %s\n", flag, arg);
+                return_defer(1);
+            }
+            flag = arg;
+            batch = true;
+            batch_contents = strcmp(arg, "--batch") == 0;
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "-t") == 0 || strcmp(arg, "-s") == 0 || strcmp(arg, "-e") == 0) {
+            if (flag != NULL) {
+                fprintf(stderr, "ERROR: %s is incompatible with %s\n", flag, arg);
+                return_defer(1);
+            }
+            flag = arg;
+            pretty = arg[1] == 'p';
+            showtype = arg[1] == 't';
+            showsize = arg[1] == 's';
+            exists = arg[1] == 'e';
         } else {
             _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
             if (strcmp(arg, "blob") == 0) {
@@ -405,15 +2260,18 @@ int cat_file_command(command_t *command, const char *program, int argc, char *ar
         }
     }
 
-    if (pretty && showtype) {
-        fprintf(stderr, "ERROR: -p is incompatible with -t\n");
-        return_defer(1);
+    if (batch) {
+        if (type != UNKNOWN || hash != NULL) {
+            usage();
+            return_defer(1);
+        }
+        return_defer(cat_file_batch(batch_contents, buffer));
     }
-    if (!pretty && !showtype && type == UNKNOWN) {
+    if (buffer || (flag == NULL && type == UNKNOWN)) {
         usage();
         return_defer(1);
     }
-    if (showtype && type != UNKNOWN) {
+    if ((showtype || showsize || exists) && type != UNKNOWN) {
         usage();
         return_defer(1);
     }
@@ -421,118 +2279,73 @@ int cat_file_command(command_t *command, const char *program, int argc, char *ar
         usage();
         return_defer(1);
     }
-    if (strlen(hash) != SHA1_DIGEST_HEX_LENGTH) {
-        fprintf(stderr, "ERROR: %s is not a valid SHA-1 hash\n", hash);
-        return_defer(1);
-    }
-    for (size_t i = 0; i < SHA1_DIGEST_HEX_LENGTH; i ++) {
-        if (isxdigit(hash[i]) == 0) {
-            fprintf(stderr, "ERROR: %s is not a valid SHA-1 hash\n", hash);
+    char full_hash[SHA1_DIGEST_HEX_LENGTH + 1];
+    if (!resolve_object_name(hash, full_hash)) return_defer(1);
+    hash = full_hash;
+
+    // Missing objects fail quietly, broken ones still get an error
+    if (exists && !object_exists(hash)) return_defer(1);
+
+    if (showtype || showsize || exists) {
+        // Only the header is needed, not the object itself
+        git_object_t object_type = UNKNOWN;
+        long size = 0;
+        if (!read_object_info(hash, &object_type, &size)) {
+            fprintf(stderr, "Couldn't read object file %s\n", hash);
             return_defer(1);
         }
+        if (showsize) {
+            printf("%ld\n", size);
+        } else if (showtype) {
+            printf("%s\n", object_type_name(object_type));
+        }
+        return_defer(0);
     }
 
-    long filesize = 0;
-    if (!read_object(hash, &data, &filesize)) {
+    // Blobs and commits go straight to stdout as they are decompressed
+    object_stream stream = {
+        .hash = hash,
+        .expected = type,
+        .out = stdout,
+        .keep_trees = pretty,
+    };
+    if (!stream_object(hash, &stream)) {
         fprintf(stderr, "Couldn't read object file %s\n", hash);
         return_defer(1);
     }
+    data = stream.tree.data;
 
-    char *header_end = NULL;
-    long size = 0;
-    git_object_t object_type = UNKNOWN;
-    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
-    if (filesize > 5 && strncmp((char *)data, "blob ", 5) == 0) {
-        object_type = BLOB;
-        if (showtype) {
-            printf("blob\n");
-            return_defer(0);
-        }
-        size = strtol((char *)data + 5, &header_end, 10);
-    } else if (filesize > 5 && strncmp((char *)data, "tree ", 5) == 0) {
-        object_type = TREE;
-        if (showtype) {
-            printf("tree\n");
-            return_defer(0);
-        }
-        size = strtol((char *)data + 5, &header_end, 10);
-    } else if (filesize > 5 && strncmp((char *)data, "commit ", 7) == 0) {
-        object_type = COMMIT;
-        if (showtype) {
-            printf("commit\n");
-            return_defer(0);
-        }
-        size = strtol((char *)data + 7, &header_end, 10);
-    } else {
-        fprintf(stderr, "Decompressed data is not a valid object\n");
-        return_defer(1);
-    }
-
-    if (type != UNKNOWN && object_type != type) {
-        fprintf(stderr, "Invalid type in object file %s\n", hash);
-        return_defer(1);
-    }
-
-    if (*header_end != '\0') {
-        fprintf(stderr, "Invalid size in object file at %s\n", hash);
-        return_defer(1);
-    }
-
-    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
-    switch (object_type) {
-        case UNKNOWN:
-            fprintf(stderr, "Decompressed data is not a valid object\n");
-            return_defer(1);
-            break;
-
-        case BLOB:
-        case COMMIT:
-            assert(size == (char*)(data + filesize) - header_end - 1);
-            assert(fwrite(header_end + 1, 1, size, stdout) == (size_t)size);
-            break;
-
-        case TREE: {
-            assert(size == (char*)(data + filesize) - header_end - 1);
-            if (type == TREE) {
-                assert(fwrite(header_end + 1, 1, size, stdout) == (size_t)size);
-                return_defer(0);
-            }
-            char *end = (char *)data + filesize;
-            char *p = header_end + 1;
-            while (p < end) {
-                char *start = p;
-                while (p < end && *p != '\0') {
-                    p ++;
-                }
-                assert(p + SHA1_DIGEST_BYTE_LENGTH + 1 <= end);
-                uint8_t *hash = (uint8_t*)p + 1;
-                p += SHA1_DIGEST_BYTE_LENGTH + 1;
-                char *file = NULL;
-                long mode = strtol(start, &file, 8);
-                assert(*file == ' ');
-                file ++;
-                printf("%06lo", mode);
-                switch (mode & S_IFMT) {
-                    case S_IFDIR: printf(" tree "); break;
-                    case S_IFREG: printf(" blob "); break;
-
-                    case S_IFBLK:
-                    case S_IFCHR:
-                    case S_IFIFO:
-                    case S_IFLNK:
-                    case S_IFSOCK:
-                    default:
-                        GIT_UNREACHABLE();
-                }
-                SHA1_PRINTF_HEX(hash);
-                printf("    %s\n", file);
+    if (stream.type == TREE && pretty) {
+        char *end = (char *)data + stream.tree.size;
+        char *p = (char *)data;
+        while (p < end) {
+            char *start = p;
+            while (p < end && *p != '\0') {
+                p ++;
             }
-        }; break;
-
+            assert(p + SHA1_DIGEST_BYTE_LENGTH + 1 <= end);
+            uint8_t *hash = (uint8_t*)p + 1;
+            p += SHA1_DIGEST_BYTE_LENGTH + 1;
+            char *file = NULL;
+            long mode = strtol(start, &file, 8);
+            assert(*file == ' ');
+            file ++;
+            printf("%06lo", mode);
+            switch (mode & S_IFMT) {
+                case S_IFDIR: printf(" tree "); break;
+                case S_IFREG: printf(" blob "); break;
 
-        default:
-            GIT_UNREACHABLE();
-            return_defer(1);
+                case S_IFBLK:
+                case S_IFCHR:
+                case S_IFIFO:
+                case S_IFLNK:
+                case S_IFSOCK:
+                default:
+                    GIT_UNREACHABLE();
+            }
+            SHA1_PRINTF_HEX(hash);
+            printf("    %s\n", file);
+        }
     }
 
 #undef usage
@@ -542,178 +2355,210 @@ defer:
     return ret;
 }
 
-bool hash_object(git_object_t type, uint8_t *data, size_t size, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], bool writeobject) {
+// Objects are hashed this many at a time by hash_objects
+#define HASH_OBJECTS_BATCH 64
+
+// Works out the hashes of `count` objects of one type. Hashing them together
+// lets the multi-buffer SHA-1 work on several at once, which is much faster
+// for small objects than one after another.
+bool hash_objects(git_object_t type, const uint8_t *const data[], const size_t sizes[], size_t count,
+                  uint8_t (*hashes)[SHA1_DIGEST_BYTE_LENGTH]) {
+    for (size_t base = 0; base < count; base += HASH_OBJECTS_BATCH) {
+        size_t n = count - base < HASH_OBJECTS_BATCH ? count - base : HASH_OBJECTS_BATCH;
+        sha1_context sha[HASH_OBJECTS_BATCH];
+        sha1_context *shas[HASH_OBJECTS_BATCH];
+        for (size_t i = 0; i < n; i ++) {
+            char header[OBJECT_HEADER_MAX];
+            long headersize = object_header(type, sizes[base + i], header);
+            if (headersize < 0) return false;
+            assert(header[headersize] == '\0');
+            // The data is hashed where it is, after the header (and its NUL)
+            sha1_init(&sha[i]);
+            if (!sha1_update(&sha[i], header, headersize + 1)) return false;
+            shas[i] = &sha[i];
+        }
+        if (!sha1_update_many(shas, (const void *const *)(data + base), sizes + base, n)) return false;
+        sha1_final_many(shas, hashes + base, n);
+    }
+    return true;
+}
+
+// Writes an object already hashed to `hash` to .git/objects
+bool write_object(git_object_t type, const uint8_t *data, size_t size, const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
     bool ret = true;
     uint8_t *object = NULL;
     int dir_fd = AT_FDCWD;
+    int object_fd = -1;
     zlib_context ctx = {0};
 #define return_defer(code) do { ret = (code); goto defer; } while (0);
 
-    long numlen = 0;
-    long tmp = size;
-    while (tmp != 0) {
-        numlen ++;
-        tmp /= 10;
+    char header[OBJECT_HEADER_MAX];
+    long headersize = object_header(type, size, header);
+    if (headersize < 0) {
+        return_defer(false);
     }
+    size_t objectsize = headersize + 1 + size;
 
-    // type SP size NULL filedata
-    long objectsize = size + numlen + 1;
-    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
-    switch (type) {
-        case BLOB:
-        case TREE:
-            objectsize += 5;
-            break;
-
-        case COMMIT:
-            objectsize += 7;
-            break;
+    // mkdir .git/objects
+    // TODO different git dir locations
+    // TODO find parent dir if within the git file system
+    if ((mkdirat(dir_fd, ".git", 0755) == -1 && errno != EEXIST) ||
+        (mkdirat(dir_fd, ".git/objects", 0755) == -1 && errno != EEXIST)) {
+        fprintf(stderr, "Failed to create directory: .git/objects: %s\n", strerror(errno));
+        return_defer(false);
+    }
+    int fd = openat(dir_fd, ".git/objects", O_DIRECTORY);
+    if (dir_fd != AT_FDCWD) close(dir_fd);
+    dir_fd = fd;
+
+    char digest[SHA1_DIGEST_HEX_LENGTH + 1];
+    SHA1_SNPRINTF_HEX(digest, C_ARRAY_LEN(digest), hash);
+    char byte1[3] = { digest[0], digest[1], '\0' };
+    char *rest = digest + 2;
+    if (mkdirat(dir_fd, byte1, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory: .git/objects/%s: %s\n", byte1, strerror(errno));
+        return_defer(false);
+    }
+    fd = openat(dir_fd, byte1, O_DIRECTORY);
+    if (dir_fd != AT_FDCWD) close(dir_fd);
+    dir_fd = fd;
 
-        default:
-            GIT_UNREACHABLE();
-            return_defer(false);
+    int unlink_ret = unlinkat(dir_fd, rest, 0);
+    if (unlink_ret == -1) {
+        assert(errno == ENOENT);
+    }
+    object_fd = openat(dir_fd, rest, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (object_fd == -1) {
+        fprintf(stderr, "Failed to create object file: .git/objects/%s/%s: %s\n", byte1, rest, strerror(errno));
+        return_defer(false);
     }
+
+    // Only compression needs the header and data in one piece
     object = malloc(objectsize);
     if (object == NULL) {
         fprintf(stderr, "Ran out of memory creating object\n");
-        return_defer(1);
-    }
-
-    long headersize = 0;
-    _Static_assert(NUM_OBJECTS == 4, "Objects have changed. May need handling here");
-    switch (type) {
-        case BLOB:
-            headersize = snprintf((char *)object, objectsize, "blob %ld", size);
-            assert(headersize == numlen + 5);
-            break;
-
-        case TREE:
-            headersize = snprintf((char *)object, objectsize, "tree %ld", size);
-            assert(headersize == numlen + 5);
-            break;
-
-        case COMMIT:
-            headersize = snprintf((char *)object, objectsize, "commit %ld", size);
-            assert(headersize == numlen + 7);
-            break;
-
-
-        default:
-            GIT_UNREACHABLE();
-            return_defer(false);
+        return_defer(false);
     }
-    assert(object[headersize] == '\0');
-
+    memcpy(object, header, headersize + 1);
     memcpy(object + headersize + 1, data, size);
 
-/* hexdump(object, objectsize); */
-    if (!sha1_digest(object, objectsize, hash)) {
-        fprintf(stderr, "Error while creating SHA1 digest of object\n");
-        return_defer(1);
+    ctx.flevel = ZLIB_DEFAULT_COMPRESSOR;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ctx.threads = cpus > 0 ? (size_t)cpus : 1;
+    ctx.deflate.in.data = object;
+    ctx.deflate.in.size = objectsize;
+    // Blobs are often already compressed (images, archives), which isn't
+    // worth trying again
+    ctx.probe = type == BLOB;
+    if (!zlib_compress(&ctx)) {
+        fprintf(stderr, "Error while zlib compressing the object\n");
+        return_defer(false);
     }
-
-    if (writeobject) {
-        // mkdir .git/objects
-        // TODO different git dir locations
-        // TODO find parent dir if within the git file system
-        if ((mkdirat(dir_fd, ".git", 0755) == -1 && errno != EEXIST) ||
-            (mkdirat(dir_fd, ".git/objects", 0755) == -1 && errno != EEXIST)) {
-            fprintf(stderr, "Failed to create directory: .git/objects: %s\n", strerror(errno));
-            return_defer(1);
-        }
-        int fd = openat(dir_fd, ".git/objects", O_DIRECTORY);
-        if (dir_fd != AT_FDCWD) close(dir_fd);
-        dir_fd = fd;
-
-        char digest[SHA1_DIGEST_HEX_LENGTH + 1];
-        SHA1_SNPRINTF_HEX(digest, C_ARRAY_LEN(digest), hash);
-        char byte1[3] = { digest[0], digest[1], '\0' };
-        char *rest = digest + 2;
-        if (mkdirat(dir_fd, byte1, 0755) == -1 && errno != EEXIST) {
-            fprintf(stderr, "Failed to create directory: .git/objects/%s: %s\n", byte1, strerror(errno));
-            return_defer(1);
-        }
-        fd = openat(dir_fd, byte1, O_DIRECTORY);
-        if (dir_fd != AT_FDCWD) close(dir_fd);
-        dir_fd = fd;
-
-        int unlink_ret = unlinkat(dir_fd, rest, 0);
-        if (unlink_ret == -1) {
-            assert(errno == ENOENT);
-        }
-        int object_fd = openat(dir_fd, rest, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-        if (object_fd == -1) {
-            fprintf(stderr, "Failed to create object file: .git/objects/%s/%s: %s\n", byte1, rest, strerror(errno));
-            return_defer(1);
-        }
-
-        ctx.deflate.in.data = object;
-        ctx.deflate.in.size = objectsize;
-        if (!zlib_compress(&ctx)) {
-            fprintf(stderr, "Error while zlib compressing the object\n");
-            return_defer(1);
+    if (ctx.probe) {
+        GIT_TRACE("zlib probe: %s (entropy %u.%03u bits/byte, %u.%u%% repeats, %zu bytes sampled)",
+                  zlib_probe_name(ctx.probed.decision), ctx.probed.entropy / 1000, ctx.probed.entropy % 1000,
+                  ctx.probed.repeats / 10, ctx.probed.repeats % 10, ctx.probed.sampled);
+    }
+    for (size_t done = 0; done < ctx.deflate.out.size;) {
+        ssize_t n = write(object_fd, ctx.deflate.out.data + done, ctx.deflate.out.size - done);
+        if (n < 0) {
+            fprintf(stderr, "Failed to write object file: .git/objects/%s/%s: %s\n", byte1, rest, strerror(errno));
+            // Don't leave a truncated object behind to be read later
+            unlinkat(dir_fd, rest, 0);
+            return_defer(false);
         }
-        assert(write(object_fd, ctx.deflate.out.data, ctx.deflate.out.size) == (ssize_t)ctx.deflate.out.size);
+        done += n;
     }
 
 #undef return_defer
 defer:
+    if (object_fd != -1) close(object_fd);
     if (dir_fd != AT_FDCWD) close(dir_fd);
+    zlib_end(&ctx);
     if (ctx.deflate.out.data) free(ctx.deflate.out.data);
     if (object) free(object);
     return ret;
 }
 
+bool hash_object(git_object_t type, uint8_t *data, size_t size, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], bool writeobject) {
+    const uint8_t *objects[1] = { data };
+    if (!hash_objects(type, objects, &size, 1, (uint8_t (*)[SHA1_DIGEST_BYTE_LENGTH])hash)) {
+        fprintf(stderr, "Error while creating SHA1 digest of object\n");
+        return false;
+    }
+    return !writeobject || write_object(type, data, size, hash);
+}
+
+// Files are read and hashed HASH_OBJECTS_BATCH at a time, so that several
+// can be hashed at once without holding all of them in memory
 int hash_object_command(command_t *command, const char *program, int argc, char *argv[]) {
     (void)command;
     int ret = 0;
-    FILE *file = NULL;
-    uint8_t *filedata = NULL;
-    uint8_t *blob = NULL;
-    int blob_fd = -1;
+    char **filenames = NULL;
+    uint8_t *filedata[HASH_OBJECTS_BATCH] = {0};
+    size_t sizes[HASH_OBJECTS_BATCH];
+    uint8_t hashes[HASH_OBJECTS_BATCH][SHA1_DIGEST_BYTE_LENGTH];
 #define return_defer(code) do { ret = (code); goto defer; } while (0);
 #define usage() do { \
-    fprintf(stderr, "usage: %s hash-object [-w] <filename>\n", program); \
+    fprintf(stderr, "usage: %s hash-object [-w] <filename>...\n", program); \
 } while (0)
 
     bool writeblob = false;
-    char *filename = NULL;
+    size_t count = 0;
+    filenames = malloc(sizeof(*filenames) * (argc > 0 ? argc : 1));
+    if (filenames == NULL) {
+        fprintf(stderr, "Ran out of memory\n");
+        return_defer(1);
+    }
     while (argc > 0) {
         char *arg = ARG();
         if (strcmp(arg, "-w") == 0) {
             writeblob = true;
         } else {
-            filename = arg;
+            filenames[count++] = arg;
         }
     }
 
-    if (filename == NULL) {
+    if (count == 0) {
         usage();
         return_defer(1);
     }
 
-    long size = 0;
-    if (!file_read_contents(filename, &filedata, &size)) {
-        fprintf(stderr, "Error reading file %s\n", filename);
-        return_defer(1);
-    }
+    for (size_t base = 0; base < count; base += HASH_OBJECTS_BATCH) {
+        size_t n = count - base < HASH_OBJECTS_BATCH ? count - base : HASH_OBJECTS_BATCH;
+        for (size_t i = 0; i < n; i ++) {
+            long size = 0;
+            if (!file_read_contents(filenames[base + i], &filedata[i], &size)) {
+                fprintf(stderr, "Error reading file %s\n", filenames[base + i]);
+                return_defer(1);
+            }
+            sizes[i] = size;
+        }
 
-    uint8_t hash[SHA1_DIGEST_BYTE_LENGTH];
-    if (!hash_object(BLOB, filedata, size, hash, writeblob)) {
-        fprintf(stderr, "Error hashing blob for %s\n", filename);
-        return_defer(1);
-    }
+        if (!hash_objects(BLOB, (const uint8_t *const *)filedata, sizes, n, hashes)) {
+            fprintf(stderr, "Error hashing blobs\n");
+            return_defer(1);
+        }
 
-    SHA1_PRINTF_HEX(hash);
-    printf("\n");
+        for (size_t i = 0; i < n; i ++) {
+            if (writeblob && !write_object(BLOB, filedata[i], sizes[i], hashes[i])) {
+                fprintf(stderr, "Error writing blob for %s\n", filenames[base + i]);
+                return_defer(1);
+            }
+            SHA1_PRINTF_HEX(hashes[i]);
+            printf("\n");
+            free(filedata[i]);
+            filedata[i] = NULL;
+        }
+    }
 
 #undef usage
 #undef return_defer
 defer:
-    if (file != NULL) fclose(file);
-    if (filedata != NULL) free(filedata);
-    if (blob != NULL) free(blob);
-    if (blob_fd != -1) close(blob_fd);
+    for (size_t i = 0; i < HASH_OBJECTS_BATCH; i ++) {
+        if (filedata[i] != NULL) free(filedata[i]);
+    }
+    if (filenames != NULL) free(filenames);
     return ret;
 }
 
@@ -759,16 +2604,9 @@ int ls_tree_command(command_t *command, const char *program, int argc, char *arg
         usage();
         return_defer(1);
     }
-    if (strlen(hash) != 2 * SHA1_DIGEST_BYTE_LENGTH) {
-        fprintf(stderr, "ERROR: %s is not a valid SHA-1 hash\n", hash);
-        return_defer(1);
-    }
-    for (size_t i = 0; i < 2 * SHA1_DIGEST_BYTE_LENGTH; i ++) {
-        if (isxdigit(hash[i]) == 0) {
-            fprintf(stderr, "ERROR: %s is not a valid SHA-1 hash\n", hash);
-            return_defer(1);
-        }
-    }
+    char full_hash[SHA1_DIGEST_HEX_LENGTH + 1];
+    if (!resolve_object_name(hash, full_hash)) return_defer(1);
+    hash = full_hash;
 
     long filesize = 0;
     if (!read_object(hash, &data, &filesize)) {
@@ -841,9 +2679,35 @@ defer:
     return ret;
 }
 
+// A directory's files, read and waiting to be hashed together
+typedef struct {
+    uint8_t *data[HASH_OBJECTS_BATCH];
+    size_t sizes[HASH_OBJECTS_BATCH];
+    size_t offsets[HASH_OBJECTS_BATCH]; // Where each one's hash goes in the tree
+    size_t count;
+    size_t bytes;
+} blob_batch_t;
+
+// Past this much data a batch is hashed even if it isn't full
+#define BLOB_BATCH_BYTES (16 << 20)
+
+bool blob_batch_flush(blob_batch_t *batch, uint8_t *tree) {
+    uint8_t hashes[HASH_OBJECTS_BATCH][SHA1_DIGEST_BYTE_LENGTH];
+    bool ok = hash_objects(BLOB, (const uint8_t *const *)batch->data, batch->sizes, batch->count, hashes);
+    for (size_t i = 0; i < batch->count; i ++) {
+        ok = ok && write_object(BLOB, batch->data[i], batch->sizes[i], hashes[i]);
+        if (ok) memcpy(tree + batch->offsets[i], hashes[i], SHA1_DIGEST_BYTE_LENGTH);
+        free(batch->data[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+    return ok;
+}
+
 bool write_tree(int dir_fd, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
     bool ret = true;
     uint8_array_t tree_data = {0};
+    blob_batch_t blobs = {0};
     int n = -1;
     struct dirent **dirlist = NULL;
 #define return_defer(code) do { ret = (code); goto defer; } while (0);
@@ -860,12 +2724,20 @@ bool write_tree(int dir_fd, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
             continue;
         }
         struct stat filestat = {0};
-        assert(fstatat(dir_fd, dirlist[i]->d_name, &filestat, 0) == 0);
+        if (fstatat(dir_fd, dirlist[i]->d_name, &filestat, 0) == -1) {
+            fprintf(stderr, "Couldn't stat %s: %s\n", dirlist[i]->d_name, strerror(errno));
+            return_defer(false);
+        }
         switch (filestat.st_mode & S_IFMT) {
             case S_IFDIR: {
-                int fd = openat(dir_fd, dirlist[i]->d_name, O_RDONLY);
-                assert(fd > 0);
-                if (!write_tree(fd, hash)) {
+                int fd = openat(dir_fd, dirlist[i]->d_name, O_RDONLY | O_DIRECTORY);
+                if (fd == -1) {
+                    fprintf(stderr, "Couldn't open directory %s: %s\n", dirlist[i]->d_name, strerror(errno));
+                    return_defer(false);
+                }
+                bool written_tree = write_tree(fd, hash);
+                close(fd);
+                if (!written_tree) {
                     continue;
                 }
                 ARRAY_ENSURE(tree_data, 8 + strlen(dirlist[i]->d_name) + SHA1_DIGEST_BYTE_LENGTH);
@@ -895,11 +2767,23 @@ bool write_tree(int dir_fd, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
 
                 uint8_t *data = NULL;
                 long size = 0;
-                assert(file_read_contents_at(dir_fd, dirlist[i]->d_name, &data, &size));
-                assert(hash_object(BLOB, data, size, hash, true));
-                free(data);
-
-                ARRAY_APPEND_BYTES(tree_data, hash, SHA1_DIGEST_BYTE_LENGTH);
+                if (!file_read_contents_at(dir_fd, dirlist[i]->d_name, &data, &size)) {
+                    fprintf(stderr, "Couldn't read %s\n", dirlist[i]->d_name);
+                    return_defer(false);
+                }
+                // The hash is filled in once the batch is hashed
+                ARRAY_ENSURE(tree_data, SHA1_DIGEST_BYTE_LENGTH);
+                blobs.data[blobs.count] = data;
+                blobs.sizes[blobs.count] = size;
+                blobs.offsets[blobs.count] = tree_data.size;
+                blobs.count ++;
+                blobs.bytes += size;
+                tree_data.size += SHA1_DIGEST_BYTE_LENGTH;
+                if (blobs.count == HASH_OBJECTS_BATCH || blobs.bytes >= BLOB_BATCH_BYTES) {
+                    if (!blob_batch_flush(&blobs, tree_data.data)) {
+                        return_defer(false);
+                    }
+                }
             }; break;
 
             case S_IFBLK:
@@ -911,6 +2795,9 @@ bool write_tree(int dir_fd, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
                 GIT_UNREACHABLE();
         }
     }
+    if (!blob_batch_flush(&blobs, tree_data.data)) {
+        return_defer(false);
+    }
     hexdump(tree_data.data, tree_data.size);
     if (tree_data.size == 0) {
         return_defer(false);
@@ -929,6 +2816,9 @@ defer:
         }
         free(dirlist);
     }
+    for (size_t i = 0; i < blobs.count; i ++) {
+        free(blobs.data[i]);
+    }
     if (tree_data.data) free(tree_data.data);
     return ret;
 }
@@ -949,7 +2839,10 @@ int write_tree_command(command_t *command, const char *program, int argc, char *
     uint8_t hash[SHA1_DIGEST_BYTE_LENGTH];
     // FIXME work inside folders
     root_fd = openat(root_fd, ".", O_RDONLY);
-    assert(root_fd > 0);
+    if (root_fd == -1) {
+        fprintf(stderr, "Couldn't open the working directory: %s\n", strerror(errno));
+        return_defer(1);
+    }
     if (!write_tree(root_fd, hash)) {
         return_defer(1);
     }
@@ -959,7 +2852,7 @@ int write_tree_command(command_t *command, const char *program, int argc, char *
 
 #undef return_defer
 defer:
-    if (root_fd != AT_FDCWD) close(root_fd);
+    if (root_fd >= 0) close(root_fd);
     return ret;
 }
 
@@ -988,10 +2881,11 @@ int commit_tree_command(command_t *command, const char *program, int argc, char
                 return_defer(1);
             }
             arg = ARG();
-            char *parent = strdup(arg);
+            char *parent = malloc(SHA1_DIGEST_HEX_LENGTH + 1);
             assert(parent != NULL);
-            if (strlen(parent) != SHA1_DIGEST_HEX_LENGTH) {
-                GIT_UNIMPLENTED("Get hash from partial hash");
+            if (!resolve_object_name(arg, parent)) {
+                free(parent);
+                return_defer(1);
             }
             ARRAY_APPEND(parents, parent);
         } else if (strcmp(arg, "-m") == 0) {
@@ -1033,12 +2927,9 @@ int commit_tree_command(command_t *command, const char *program, int argc, char
                 fprintf(stderr, "Can't have multiple tree's. Already have %s, and also have %s\n", tree, arg);
                 return_defer(1);
             }
-            tree = strdup(arg);
+            tree = malloc(SHA1_DIGEST_HEX_LENGTH + 1);
             assert(tree != NULL);
-            if (strlen(tree) != SHA1_DIGEST_HEX_LENGTH) {
-                printf("tree = %s, len = %ld\n", tree, strlen(tree));
-                GIT_UNIMPLENTED("Get hash from partial hash");
-            }
+            if (!resolve_object_name(arg, tree)) return_defer(1);
         }
     }
 
@@ -1148,6 +3039,211 @@ defer:
     return ret;
 }
 
+// Only "write" for now: packs are found through the multi-pack-index
+// whenever there is one
+int multi_pack_index_command(command_t *command, const char *program, int argc, char *argv[]) {
+    (void)command;
+    if (argc != 1 || strcmp(argv[0], "write") != 0) {
+        fprintf(stderr, "usage: %s multi-pack-index write\n", program);
+        return 1;
+    }
+    return midx_write() ? 0 : 1;
+}
+
+// Hashes the same buffer with each SHA-1 kernel this CPU supports, checking
+// they agree and how fast they go
+int bench_sha1_command(command_t *command, const char *program, int argc, char *argv[]) {
+    (void)command;
+    int ret = 0;
+    uint8_t *data = NULL;
+    const uint8_t **messages = NULL;
+    size_t *lengths = NULL;
+    uint8_t (*hashes)[SHA1_DIGEST_BYTE_LENGTH] = NULL;
+    uint8_t (*expected_many)[SHA1_DIGEST_BYTE_LENGTH] = NULL;
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+
+    long megabytes = 256;
+    if (argc > 0) {
+        char *arg = ARG();
+        char *end = NULL;
+        megabytes = strtol(arg, &end, 10);
+        if (*end != '\0' || megabytes <= 0 || argc > 0) {
+            fprintf(stderr, "usage: %s bench-sha1 [<megabytes>]\n", program);
+            return_defer(1);
+        }
+    }
+    size_t size = (size_t)megabytes << 20;
+    data = malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Ran out of memory for %ldMB of data\n", megabytes);
+        return_defer(1);
+    }
+    // Not worth anything random, but not all the same either
+    uint32_t x = 2463534242;
+    for (size_t i = 0; i < size; i ++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+
+    uint8_t expected[SHA1_DIGEST_BYTE_LENGTH];
+    for (size_t i = 0; i < sha1_kernels_count; i ++) {
+        const sha1_kernel *kernel = &sha1_kernels[i];
+        if (!kernel->supported()) {
+            printf("%-8s not supported\n", kernel->name);
+            continue;
+        }
+        sha1_use_kernel(kernel);
+        uint8_t hash[SHA1_DIGEST_BYTE_LENGTH];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sha1_digest(data, size, hash);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        // The first kernel is the plain one the rest are checked against
+        if (i == 0) memcpy(expected, hash, sizeof(hash));
+        bool same = memcmp(expected, hash, sizeof(hash)) == 0;
+        printf("%-8s %8.1f MB/s%s\n", kernel->name, megabytes / secs, same ? "" : "  WRONG HASH");
+        if (!same) ret = 1;
+    }
+    sha1_use_kernel(NULL);
+
+    // Then as many small messages, of 1-4KB like most source files, for the
+    // multi-buffer kernels
+    messages = malloc(sizeof(*messages) * (size >> 10));
+    lengths = malloc(sizeof(*lengths) * (size >> 10));
+    hashes = malloc(sizeof(*hashes) * (size >> 10));
+    expected_many = malloc(sizeof(*expected_many) * (size >> 10));
+    if (messages == NULL || lengths == NULL || hashes == NULL || expected_many == NULL) {
+        fprintf(stderr, "Ran out of memory for the small messages\n");
+        return_defer(1);
+    }
+    size_t count = 0, offset = 0;
+    for (; offset + 4096 <= size; offset += lengths[count++]) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        messages[count] = data + offset;
+        lengths[count] = 1024 + x % 3072;
+    }
+    for (size_t i = 0; i < count; i ++) {
+        sha1_digest(messages[i], lengths[i], expected_many[i]);
+    }
+    for (size_t i = 0; i < sha1_many_kernels_count; i ++) {
+        const sha1_many_kernel *kernel = &sha1_many_kernels[i];
+        if (!kernel->supported()) {
+            printf("%-8s not supported\n", kernel->name);
+            continue;
+        }
+        sha1_use_many_kernel(kernel);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sha1_digest_many(messages, lengths, count, hashes);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        bool same = memcmp(expected_many, hashes, sizeof(*hashes) * count) == 0;
+        printf("%-8s %8.1f MB/s in %zu messages, %zu lanes%s\n", kernel->name, (double)offset / (1 << 20) / secs, count,
+               kernel->lanes, same ? "" : "  WRONG HASH");
+        if (!same) ret = 1;
+    }
+    sha1_use_many_kernel(NULL);
+
+#undef return_defer
+defer:
+    if (data) free(data);
+    if (messages) free(messages);
+    if (lengths) free(lengths);
+    if (hashes) free(hashes);
+    if (expected_many) free(expected_many);
+    return ret;
+}
+
+// Compresses inputs that have tripped up the compressor before, at every
+// level and on 1-4 threads, checking each comes back as it went in. Those are
+// mostly runs of one byte crossing the ends of the 64K segments the optimal
+// parser works through, where its longest matches get cut short.
+int check_zlib_command(command_t *command, const char *program, int argc, char *argv[]) {
+    (void)command;
+    (void)argv;
+    int ret = 0;
+    uint8_t *data = NULL;
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    if (argc > 0) {
+        fprintf(stderr, "usage: %s check-zlib\n", program);
+        return_defer(1);
+    }
+
+    // Big enough for a few whole parallel chunks and part of another
+    size_t size = 3 * ZLIB_PARALLEL_CHUNK + ZLIB_PARALLEL_CHUNK / 2;
+    data = malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Ran out of memory for the inputs\n");
+        return_defer(1);
+    }
+    for (size_t shape = 0; shape < 7; shape ++) {
+        size_t n = shape < 6 ? 4 << 16 : size;
+        uint32_t x = 2463534242;
+        for (size_t i = 0; i < n; i ++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            data[i] = x;
+        }
+        if (shape == 0) {
+            // Half random, half one byte
+            n = 70000;
+            memset(data + n / 2, 'x', n / 2);
+        } else if (shape < 6) {
+            // Runs ending just before, on, and just after segment ends
+            for (size_t end = 1 << 16; end < n; end += 1 << 16) {
+                size_t stop = end + shape - 3;
+                memset(data + stop - 1000, 'x', 1000);
+            }
+        } else {
+            // Every other 8K repeats what came 3000 bytes before, so chunks
+            // split across threads find matches back in the chunk before
+            for (size_t i = 3000; i < n; i ++) {
+                if ((i + 4096) / 8192 % 2 == 0) data[i] = data[i - 3000];
+            }
+        }
+        for (zlib_compression_level level = ZLIB_FASTEST_COMPRESSOR; level <= ZLIB_MAX_COMPRESSOR; level ++) {
+            for (size_t threads = 1; threads <= 4; threads ++) {
+                zlib_context ctx = {
+                    .flevel = level,
+                    .threads = threads,
+                };
+                ctx.deflate.in.data = data;
+                ctx.deflate.in.size = n;
+                zlib_context check = {0};
+                bool ok = zlib_compress(&ctx);
+                if (ok) {
+                    check.deflate.bits.data = ctx.deflate.out.data;
+                    check.deflate.bits.size = ctx.deflate.out.size;
+                    ok = zlib_decompress(&check) && check.deflate.out.size == n &&
+                         memcmp(check.deflate.out.data, data, n) == 0;
+                }
+                if (!ok) {
+                    printf("shape %zu, level %d, %zu threads: WRONG ROUND TRIP\n", shape, level, threads);
+                    ret = 1;
+                }
+                zlib_end(&ctx);
+                zlib_end(&check);
+                free(ctx.deflate.out.data);
+                free(check.deflate.out.data);
+            }
+        }
+    }
+    if (ret == 0) printf("ok\n");
+
+#undef return_defer
+defer:
+    if (data) free(data);
+    return ret;
+}
+
 command_t commands[] = {
     // FIXME order this and do binary chop?
     //       or could hash it for O(1)
@@ -1180,6 +3276,18 @@ command_t commands[] = {
         .name = "commit-tree",
         .func = commit_tree_command,
     },
+    {
+        .name = "multi-pack-index",
+        .func = multi_pack_index_command,
+    },
+    {
+        .name = "bench-sha1",
+        .func = bench_sha1_command,
+    },
+    {
+        .name = "check-zlib",
+        .func = check_zlib_command,
+    },
 };
 
 void print_arg(command_arg_t *arg) {
@@ -1266,9 +3374,14 @@ int help_command(command_t *command, const char *program, int argc, char **argv)
 
 int main(int argc, char *argv[]) {
 
-    // Disable output buffering
-    setbuf(stdout, NULL);
+    // Everything for stdout goes through its buffer, which is written out in
+    // big pieces (or a line at a time to a terminal) rather than a write per
+    // printf. Errors still go out straight away.
+    setvbuf(stdout, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, 1 << 16);
     setbuf(stderr, NULL);
+#ifdef ZLIB_BACKEND
+    GIT_TRACE("zlib backend: %s", zlib_backend_name());
+#endif
 
     const char *program = ARG();
 
@@ -1281,7 +3394,12 @@ int main(int argc, char *argv[]) {
 
     for (size_t i = 0; i < C_ARRAY_LEN(commands); i ++) {
         if (strcmp(command, commands[i].name) == 0) {
-            return commands[i].func(&commands[i], program, argc, argv);
+            int ret = commands[i].func(&commands[i], program, argc, argv);
+            if (object_cache.hits + object_cache.misses > 0) {
+                GIT_TRACE("object cache: %zu hits, %zu misses, %zu evicted, %zu kept",
+                          object_cache.hits, object_cache.misses, object_cache.evictions, object_cache.count);
+            }
+            return ret;
         }
     }
 
@@ -26,7 +26,7 @@ SOFTWARE.
 #define SHA1_H
 
 #define SHA1_H_VERSION_MAJOR 2
-#define SHA1_H_VERSION_MINOR 3
+#define SHA1_H_VERSION_MINOR 6
 #define SHA1_H_VERSION_PATCH 0
 
 #include <stdint.h>
@@ -40,34 +40,110 @@ SOFTWARE.
 #define SHA1_DIGEST_BYTE_LENGTH (SHA1_DIGEST_BIT_LENGTH / 8)
 #define SHA1_DIGEST_HEX_LENGTH 2 * SHA1_DIGEST_BYTE_LENGTH
 
-#define SHA1_SNPRINTF_HEX(str, n, hash) do { \
-    for (size_t i = 0; i < ((n) / 2 < SHA1_DIGEST_BYTE_LENGTH ? (n) / 2 : SHA1_DIGEST_BYTE_LENGTH); i ++) { \
-        snprintf((str) + i * 2, (n) - i * 2, "%02x", (hash)[i]); \
-    } \
-} while (0)
+// Hashes are turned into hex with a table of every byte's two digits, rather
+// than printf, and written out in one go
+#define SHA1_SNPRINTF_HEX(str, n, hash) sha1_snprintf_hex((str), (n), (hash))
 #define SHA1_DPRINTF_HEX(fd, hash) do { \
-    for (size_t i = 0; i < SHA1_DIGEST_BYTE_LENGTH; i ++) { \
-        dprintf((fd), "%02x", (hash)[i]); \
-    } \
+    char _sha1_hex[SHA1_DIGEST_HEX_LENGTH]; \
+    sha1_to_hex((hash), _sha1_hex); \
+    dprintf((fd), "%.*s", (int)sizeof(_sha1_hex), _sha1_hex); \
 } while (0)
-#define SHA1_FPRINTF_HEX(file, hash) SHA1_DPRINTF_HEX(fileno((file)), (hash))
-#define SHA1_PRINTF_HEX(hash) SHA1_DPRINTF_HEX(STDOUT_FILENO, (hash))
+// Through `file`'s buffer, unlike SHA1_DPRINTF_HEX
+#define SHA1_FPRINTF_HEX(file, hash) do { \
+    char _sha1_hex[SHA1_DIGEST_HEX_LENGTH]; \
+    sha1_to_hex((hash), _sha1_hex); \
+    fwrite(_sha1_hex, 1, sizeof(_sha1_hex), (file)); \
+} while (0)
+#define SHA1_PRINTF_HEX(hash) SHA1_FPRINTF_HEX(stdout, (hash))
+
+#define SHA1_BLOCK_SIZE 64
+
+// For hashing data that comes in pieces, e.g. an object header and then its
+// contents, without gathering it all in one buffer first
+typedef struct {
+    uint32_t H[5];
+    uint64_t length; // Bytes hashed so far
+    uint8_t block[SHA1_BLOCK_SIZE]; // Holds the start of a block until it is complete
+} sha1_context;
+
+// Ways of hashing whole blocks. All give the same results, but not all of
+// them run on every CPU
+typedef struct {
+    const char *name;
+    void (*blocks)(uint32_t H[5], const uint8_t *data, size_t count);
+    bool (*supported)(void);
+} sha1_kernel;
+
+extern const sha1_kernel sha1_kernels[];
+extern const size_t sha1_kernels_count;
+
+const sha1_kernel *sha1_current_kernel(void);
+// Hashes with `kernel` from now on, or the fastest one this CPU supports if
+// NULL (which is the default). Mostly to compare them.
+void sha1_use_kernel(const sha1_kernel *kernel);
+
+void sha1_init(sha1_context *ctx);
+bool sha1_update(sha1_context *ctx, const void *data, size_t length);
+void sha1_final(sha1_context *ctx, uint8_t result[SHA1_DIGEST_BYTE_LENGTH]);
 
 bool sha1_digest(const uint8_t *data,
                 size_t length,
                 uint8_t result[SHA1_DIGEST_BYTE_LENGTH]);
 
+// Lower case, without a NUL after it
+void sha1_to_hex(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], char hex[SHA1_DIGEST_HEX_LENGTH]);
+// As much of the hex as fits in `n` bytes, with a NUL after it
+void sha1_snprintf_hex(char *str, size_t n, const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]);
+// Either case. False if `hex` doesn't start with SHA1_DIGEST_HEX_LENGTH hex
+// digits, though it may go on after them.
+bool sha1_from_hex(const char *hex, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]);
+
+// Multi-buffer hashing: many separate messages at once, each in its own lane
+// of a vector register. A kernel with 8 lanes hashes 8 messages in little more
+// time than one, which is what hashing lots of small objects needs, where one
+// message has too few blocks to keep a single-buffer kernel busy.
+#define SHA1_MAX_LANES 16
+
+typedef struct {
+    const char *name;
+    size_t lanes;
+    // `H` holds the lanes' states word by word, word w of lane i being
+    // H[w * lanes + i]. Each lane hashes `count` blocks from its own `data[i]`.
+    // NULL for the kernel that hashes one message after another instead.
+    void (*blocks)(uint32_t *H, const uint8_t *const data[], size_t count);
+    bool (*supported)(void);
+} sha1_many_kernel;
+
+extern const sha1_many_kernel sha1_many_kernels[];
+extern const size_t sha1_many_kernels_count;
+
+const sha1_many_kernel *sha1_current_many_kernel(void);
+// As sha1_use_kernel, for the multi-buffer kernels
+void sha1_use_many_kernel(const sha1_many_kernel *kernel);
+
+// sha1_update and sha1_final on each of `count` contexts, `data[i]` going to
+// `ctxs[i]`. Nothing is hashed if any of them would be too long.
+bool sha1_update_many(sha1_context *const ctxs[], const void *const data[], const size_t lengths[], size_t count);
+void sha1_final_many(sha1_context *const ctxs[], uint8_t (*results)[SHA1_DIGEST_BYTE_LENGTH], size_t count);
+
+bool sha1_digest_many(const uint8_t *const data[],
+                      const size_t lengths[],
+                      size_t count,
+                      uint8_t (*results)[SHA1_DIGEST_BYTE_LENGTH]);
+
 #endif // SHA1_H
 
 #ifdef SHA1_IMPLEMENTATION
 
+#include <string.h>
+
 #define _SHA1_MAX_LENGTH 18446744073709551614UL // 2^64 - 1
-#define _SHA1_BLOCK_SIZE 64
+#define _SHA1_BLOCK_SIZE SHA1_BLOCK_SIZE
 #define _BYTE_MASK 0xFF
 
 #define SHA1_S(n, X) (((X) << (n)) | ((X) >> (32-(n))))
 
-void _sha1_process_block(uint8_t M[_SHA1_BLOCK_SIZE], uint32_t H[5]) {
+void _sha1_process_block(const uint8_t M[_SHA1_BLOCK_SIZE], uint32_t H[5]) {
     // This function is implementing Method 1 of RFC 3174.
 
     // Names from RFC 3174
@@ -146,56 +222,386 @@ void _sha1_process_block(uint8_t M[_SHA1_BLOCK_SIZE], uint32_t H[5]) {
     H[4] += E;
 }
 
-void _sha1_pad_block(uint8_t M[_SHA1_BLOCK_SIZE], uint32_t H[5], uint64_t length) {
-    int idx = length % _SHA1_BLOCK_SIZE;
-    length *= 8;
-    M[idx++] = 0x80;
-    if (idx > (_SHA1_BLOCK_SIZE) - 8) {
-        while (idx < _SHA1_BLOCK_SIZE) {
-            M[idx++] = 0;
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(__TINYC__)
+#define SHA1_X86_SIMD
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+void _sha1_blocks_scalar(uint32_t H[5], const uint8_t *data, size_t count) {
+    for (; count > 0; count --, data += _SHA1_BLOCK_SIZE) {
+        _sha1_process_block(data, H);
+    }
+}
+
+bool _sha1_supported_always(void) {
+    return true;
+}
+
+#ifdef SHA1_X86_SIMD
+const uint32_t _SHA1_K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+// Steps c. to e. of Method 1, with W(t) + K(t) already worked out by a vector
+// kernel. Those are in groups of 4, `stride` apart. Rather than shifting A-E
+// along every round, each round of 5 names them differently.
+#define _SHA1_F0(B, C, D) ((B & C) | ((~B) & D))
+#define _SHA1_F1(B, C, D) (B ^ C ^ D)
+#define _SHA1_F2(B, C, D) ((B & C) | (B & D) | (C & D))
+#define _SHA1_F3(B, C, D) (B ^ C ^ D)
+#define _SHA1_ROUND(A, B, C, D, E, F, t) do { \
+    E += SHA1_S(5, A) + F(B, C, D) + WK[((t) >> 2) * stride + ((t) & 3)]; \
+    B = SHA1_S(30, B); \
+} while (0)
+#define _SHA1_ROUNDS5(F, t) do { \
+    _SHA1_ROUND(A, B, C, D, E, F, (t)); \
+    _SHA1_ROUND(E, A, B, C, D, F, (t) + 1); \
+    _SHA1_ROUND(D, E, A, B, C, F, (t) + 2); \
+    _SHA1_ROUND(C, D, E, A, B, F, (t) + 3); \
+    _SHA1_ROUND(B, C, D, E, A, F, (t) + 4); \
+} while (0)
+
+static inline __attribute__((always_inline))
+void _sha1_rounds(uint32_t H[5], const uint32_t *WK, size_t stride) {
+    uint32_t A = H[0], B = H[1], C = H[2], D = H[3], E = H[4];
+    for (int t = 0; t < 20; t += 5) _SHA1_ROUNDS5(_SHA1_F0, t);
+    for (int t = 20; t < 40; t += 5) _SHA1_ROUNDS5(_SHA1_F1, t);
+    for (int t = 40; t < 60; t += 5) _SHA1_ROUNDS5(_SHA1_F2, t);
+    for (int t = 60; t < 80; t += 5) _SHA1_ROUNDS5(_SHA1_F3, t);
+    H[0] += A;
+    H[1] += B;
+    H[2] += C;
+    H[3] += D;
+    H[4] += E;
+}
+#undef _SHA1_ROUNDS5
+#undef _SHA1_ROUND
+
+// The vector kernels work out W(t) four at a time. W(t+3) needs W(t), so for
+// t < 32 that lane is patched up after the other three. Past that, the
+// equivalent W(t) = S^2(W(t-6) XOR W(t-16) XOR W(t-28) XOR W(t-32)) only
+// reaches back 6 words, so all four come out at once.
+#define _SHA1_ROL128(x, n) _mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+#define _SHA1_ROL256(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+__attribute__((target("ssse3")))
+void _sha1_blocks_ssse3(uint32_t H[5], const uint8_t *data, size_t count) {
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (; count > 0; count --, data += _SHA1_BLOCK_SIZE) {
+        __m128i W[20];
+        uint32_t WK[80] __attribute__((aligned(16)));
+        for (int k = 0; k < 4; k ++) {
+            W[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * k)), bswap);
+        }
+        for (int k = 4; k < 8; k ++) {
+            __m128i x = _mm_xor_si128(_mm_xor_si128(W[k - 4], _mm_alignr_epi8(W[k - 3], W[k - 4], 8)),
+                                      _mm_xor_si128(W[k - 2], _mm_srli_si128(W[k - 1], 4)));
+            W[k] = _mm_xor_si128(_SHA1_ROL128(x, 1), _SHA1_ROL128(_mm_slli_si128(x, 12), 2));
+        }
+        for (int k = 8; k < 20; k ++) {
+            __m128i x = _mm_xor_si128(_mm_xor_si128(W[k - 8], W[k - 7]),
+                                      _mm_xor_si128(W[k - 4], _mm_alignr_epi8(W[k - 1], W[k - 2], 8)));
+            W[k] = _SHA1_ROL128(x, 2);
+        }
+        for (int k = 0; k < 20; k ++) {
+            _mm_store_si128((__m128i *)(WK + 4 * k), _mm_add_epi32(W[k], _mm_set1_epi32(_SHA1_K[k / 5])));
+        }
+        _sha1_rounds(H, WK, 4);
+    }
+}
+
+// Same as the SSSE3 kernel, with two blocks side by side in the two halves
+__attribute__((target("avx2")))
+void _sha1_blocks_avx2(uint32_t H[5], const uint8_t *data, size_t count) {
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (; count >= 2; count -= 2, data += 2 * _SHA1_BLOCK_SIZE) {
+        __m256i W[20];
+        uint32_t WK[160] __attribute__((aligned(32)));
+        for (int k = 0; k < 4; k ++) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(data + 16 * k));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(data + _SHA1_BLOCK_SIZE + 16 * k));
+            W[k] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), bswap);
+        }
+        for (int k = 4; k < 8; k ++) {
+            __m256i x = _mm256_xor_si256(_mm256_xor_si256(W[k - 4], _mm256_alignr_epi8(W[k - 3], W[k - 4], 8)),
+                                         _mm256_xor_si256(W[k - 2], _mm256_srli_si256(W[k - 1], 4)));
+            W[k] = _mm256_xor_si256(_SHA1_ROL256(x, 1), _SHA1_ROL256(_mm256_slli_si256(x, 12), 2));
+        }
+        for (int k = 8; k < 20; k ++) {
+            __m256i x = _mm256_xor_si256(_mm256_xor_si256(W[k - 8], W[k - 7]),
+                                         _mm256_xor_si256(W[k - 4], _mm256_alignr_epi8(W[k - 1], W[k - 2], 8)));
+            W[k] = _SHA1_ROL256(x, 2);
         }
-        _sha1_process_block(M, H);
-        idx = 0;
+        for (int k = 0; k < 20; k ++) {
+            _mm256_store_si256((__m256i *)(WK + 8 * k), _mm256_add_epi32(W[k], _mm256_set1_epi32(_SHA1_K[k / 5])));
+        }
+        _sha1_rounds(H, WK, 8);
+        _sha1_rounds(H, WK + 4, 8);
     }
-    while (idx < (_SHA1_BLOCK_SIZE - 8)) {
-        M[idx++] = 0;
+    if (count > 0) _sha1_blocks_ssse3(H, data, count);
+}
+
+// The SHA extensions do 4 rounds per instruction, and most of the message
+// schedule. Each group of 4 rounds g uses message words W[4g..4g+3] from
+// m[g % 4], and works on the words for the groups after it.
+#define _SHA1_NI_GROUP(g) do { \
+    if ((g) == 0) { \
+        E[0] = _mm_add_epi32(E[0], m[0]); \
+    } else { \
+        E[(g) % 2] = _mm_sha1nexte_epu32(E[(g) % 2], m[(g) % 4]); \
+    } \
+    E[((g) + 1) % 2] = abcd; \
+    if ((g) >= 3 && (g) < 19) m[((g) + 1) % 4] = _mm_sha1msg2_epu32(m[((g) + 1) % 4], m[(g) % 4]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, E[(g) % 2], (g) / 5); \
+    if ((g) >= 2 && (g) < 18) m[((g) + 2) % 4] = _mm_xor_si128(m[((g) + 2) % 4], m[(g) % 4]); \
+    if ((g) >= 1 && (g) < 17) m[((g) + 3) % 4] = _mm_sha1msg1_epu32(m[((g) + 3) % 4], m[(g) % 4]); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+void _sha1_blocks_shani(uint32_t H[5], const uint8_t *data, size_t count) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    // A in the top lane down to D in the bottom, and E in the top lane of its own
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)H), 0x1B);
+    __m128i e = _mm_set_epi32(H[4], 0, 0, 0);
+    for (; count > 0; count --, data += _SHA1_BLOCK_SIZE) {
+        __m128i abcd_save = abcd, e_save = e;
+        __m128i m[4], E[2] = { e, e };
+        for (int k = 0; k < 4; k ++) {
+            m[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * k)), bswap);
+        }
+        _SHA1_NI_GROUP(0); _SHA1_NI_GROUP(1); _SHA1_NI_GROUP(2); _SHA1_NI_GROUP(3);
+        _SHA1_NI_GROUP(4); _SHA1_NI_GROUP(5); _SHA1_NI_GROUP(6); _SHA1_NI_GROUP(7);
+        _SHA1_NI_GROUP(8); _SHA1_NI_GROUP(9); _SHA1_NI_GROUP(10); _SHA1_NI_GROUP(11);
+        _SHA1_NI_GROUP(12); _SHA1_NI_GROUP(13); _SHA1_NI_GROUP(14); _SHA1_NI_GROUP(15);
+        _SHA1_NI_GROUP(16); _SHA1_NI_GROUP(17); _SHA1_NI_GROUP(18); _SHA1_NI_GROUP(19);
+        e = _mm_sha1nexte_epu32(E[0], e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
     }
-    M[_SHA1_BLOCK_SIZE - 8] = (length >> 56) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 7] = (length >> 48) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 6] = (length >> 40) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 5] = (length >> 32) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 4] = (length >> 24) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 3] = (length >> 16) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 2] = (length >> 8) & _BYTE_MASK;
-    M[_SHA1_BLOCK_SIZE - 1] = length & _BYTE_MASK;
+    _mm_storeu_si128((__m128i *)H, _mm_shuffle_epi32(abcd, 0x1B));
+    H[4] = _mm_extract_epi32(e, 3);
 }
+#undef _SHA1_NI_GROUP
 
-bool sha1_digest(const uint8_t *data,
-                uint64_t length,
-                uint8_t result[SHA1_DIGEST_BYTE_LENGTH]) {
+bool _sha1_supported_ssse3(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
 
-    if (length > _SHA1_MAX_LENGTH) return false;
+bool _sha1_supported_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
 
-    // Name and initialisation values from RFC 3174
-    uint32_t H[5] = {
-        0x67452301,
-        0xEFCDAB89,
-        0x98BADCFE,
-        0x10325476,
-        0xC3D2E1F0
-    };
+bool _sha1_supported_shani(void) {
+    // Not every compiler knows "sha" for __builtin_cpu_supports, so ask CPUID
+    // directly: leaf 7, EBX bit 29
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    __builtin_cpu_init();
+    return (ebx >> 29 & 1) && __builtin_cpu_supports("sse4.1");
+}
+
+// The multi-buffer kernels are the same code at each width, written with GCC's
+// vector extensions, where lane i of every vector belongs to message i. Only
+// getting the words of the blocks into lanes differs: the blocks are loaded a
+// row each and transposed, so that row t ends up holding word t of every lane.
+static inline __attribute__((always_inline, target("sse2")))
+void _sha1_mb_load_sse2(__m128i W[16], const uint8_t *const data[], size_t offset) {
+    for (int k = 0; k < 4; k ++) {
+        __m128i r[4];
+        for (int i = 0; i < 4; i ++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(data[i] + offset + 16 * k));
+            // Byte swapped without SSSE3's shuffle: halves, then bytes
+            x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+            r[i] = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        }
+        __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]), t1 = _mm_unpackhi_epi32(r[0], r[1]);
+        __m128i t2 = _mm_unpacklo_epi32(r[2], r[3]), t3 = _mm_unpackhi_epi32(r[2], r[3]);
+        W[4 * k] = _mm_unpacklo_epi64(t0, t2);
+        W[4 * k + 1] = _mm_unpackhi_epi64(t0, t2);
+        W[4 * k + 2] = _mm_unpacklo_epi64(t1, t3);
+        W[4 * k + 3] = _mm_unpackhi_epi64(t1, t3);
+    }
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void _sha1_mb_load_avx2(__m256i W[16], const uint8_t *const data[], size_t offset) {
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (int k = 0; k < 2; k ++) {
+        __m256i r[8], t[8], u[8];
+        for (int i = 0; i < 8; i ++) {
+            r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(data[i] + offset + 32 * k)), bswap);
+        }
+        for (int i = 0; i < 8; i += 2) {
+            t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+            t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+        }
+        for (int i = 0; i < 8; i += 4) {
+            u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+            u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+            u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+            u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+        }
+        for (int i = 0; i < 4; i ++) {
+            W[8 * k + i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+            W[8 * k + i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+        }
+    }
+}
+
+// Two sets of 8 lanes, one in each half
+static inline __attribute__((always_inline, target("avx512f")))
+void _sha1_mb_load_avx512(__m512i W[16], const uint8_t *const data[], size_t offset) {
+    __m256i lo[16], hi[16];
+    _sha1_mb_load_avx2(lo, data, offset);
+    _sha1_mb_load_avx2(hi, data + 8, offset);
+    for (int t = 0; t < 16; t ++) {
+        W[t] = _mm512_inserti64x4(_mm512_castsi256_si512(lo[t]), hi[t], 1);
+    }
+}
+
+#define _SHA1_MB_ROUND(F, K) do { \
+    T = SHA1_S(5, A) + F(B, C, D) + E + W[t & 15] + (K); \
+    E = D; \
+    D = C; \
+    C = SHA1_S(30, B); \
+    B = A; \
+    A = T; \
+} while (0)
+#define _SHA1_MB_SCHEDULE() do { \
+    T = W[(t - 3) & 15] ^ W[(t - 8) & 15] ^ W[(t - 14) & 15] ^ W[t & 15]; \
+    W[t & 15] = SHA1_S(1, T); \
+} while (0)
+#define _SHA1_MB_KERNEL(NAME, TARGET, LANES, LOAD, VEC) \
+typedef uint32_t NAME##_vec __attribute__((vector_size(4 * (LANES)))); \
+__attribute__((target(TARGET))) \
+void NAME(uint32_t *H, const uint8_t *const data[], size_t count) { \
+    NAME##_vec h[5], W[16], A, B, C, D, E, T; \
+    memcpy(h, H, sizeof(h)); \
+    for (size_t n = 0; n < count; n ++) { \
+        LOAD((VEC *)W, data, n * _SHA1_BLOCK_SIZE); \
+        A = h[0]; B = h[1]; C = h[2]; D = h[3]; E = h[4]; \
+        int t = 0; \
+        for (; t < 16; t ++) _SHA1_MB_ROUND(_SHA1_F0, _SHA1_K[0]); \
+        for (; t < 20; t ++) { _SHA1_MB_SCHEDULE(); _SHA1_MB_ROUND(_SHA1_F0, _SHA1_K[0]); } \
+        for (; t < 40; t ++) { _SHA1_MB_SCHEDULE(); _SHA1_MB_ROUND(_SHA1_F1, _SHA1_K[1]); } \
+        for (; t < 60; t ++) { _SHA1_MB_SCHEDULE(); _SHA1_MB_ROUND(_SHA1_F2, _SHA1_K[2]); } \
+        for (; t < 80; t ++) { _SHA1_MB_SCHEDULE(); _SHA1_MB_ROUND(_SHA1_F3, _SHA1_K[3]); } \
+        h[0] += A; h[1] += B; h[2] += C; h[3] += D; h[4] += E; \
+    } \
+    memcpy(H, h, sizeof(h)); \
+}
+
+_SHA1_MB_KERNEL(_sha1_many_sse2, "sse2", 4, _sha1_mb_load_sse2, __m128i)
+_SHA1_MB_KERNEL(_sha1_many_avx2, "avx2", 8, _sha1_mb_load_avx2, __m256i)
+_SHA1_MB_KERNEL(_sha1_many_avx512, "avx512f", 16, _sha1_mb_load_avx512, __m512i)
+#undef _SHA1_MB_KERNEL
+#undef _SHA1_MB_SCHEDULE
+#undef _SHA1_MB_ROUND
 
-    uint8_t block[_SHA1_BLOCK_SIZE];
-    for (size_t idx = 0; idx < length; ) {
-        block[idx % _SHA1_BLOCK_SIZE] = data[idx];
-        if ((++idx) % _SHA1_BLOCK_SIZE == 0) {
-            _sha1_process_block(block, H);
+bool _sha1_supported_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+bool _sha1_supported_avx512(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+#undef _SHA1_F0
+#undef _SHA1_F1
+#undef _SHA1_F2
+#undef _SHA1_F3
+#endif // SHA1_X86_SIMD
+
+// Slowest first
+const sha1_kernel sha1_kernels[] = {
+    { .name = "scalar", .blocks = _sha1_blocks_scalar, .supported = _sha1_supported_always },
+#ifdef SHA1_X86_SIMD
+    { .name = "ssse3", .blocks = _sha1_blocks_ssse3, .supported = _sha1_supported_ssse3 },
+    { .name = "avx2", .blocks = _sha1_blocks_avx2, .supported = _sha1_supported_avx2 },
+    { .name = "sha-ni", .blocks = _sha1_blocks_shani, .supported = _sha1_supported_shani },
+#endif
+};
+const size_t sha1_kernels_count = sizeof(sha1_kernels) / sizeof(sha1_kernels[0]);
+
+const sha1_kernel *_sha1_kernel = NULL;
+
+const sha1_kernel *sha1_current_kernel(void) {
+    if (_sha1_kernel == NULL) sha1_use_kernel(NULL);
+    return _sha1_kernel;
+}
+
+void sha1_use_kernel(const sha1_kernel *kernel) {
+    if (kernel == NULL) {
+        kernel = &sha1_kernels[0];
+        for (size_t i = 1; i < sha1_kernels_count; i ++) {
+            if (sha1_kernels[i].supported()) kernel = &sha1_kernels[i];
         }
     }
+    _sha1_kernel = kernel;
+}
 
-    _sha1_pad_block(block, H, length);
-    _sha1_process_block(block, H);
+void _sha1_blocks(uint32_t H[5], const uint8_t *data, size_t count) {
+    sha1_current_kernel()->blocks(H, data, count);
+}
 
+// Pads the last `length % 64` bytes of a message, already at the start of
+// `M`, into the one or two blocks that finish it off, returning how many
+size_t _sha1_pad(uint8_t M[2 * _SHA1_BLOCK_SIZE], uint64_t length) {
+    size_t idx = length % _SHA1_BLOCK_SIZE;
+    size_t blocks = idx + 1 > _SHA1_BLOCK_SIZE - 8 ? 2 : 1;
+    size_t end = blocks * _SHA1_BLOCK_SIZE;
+    length *= 8;
+    M[idx++] = 0x80;
+    memset(M + idx, 0, end - 8 - idx);
+    M[end - 8] = (length >> 56) & _BYTE_MASK;
+    M[end - 7] = (length >> 48) & _BYTE_MASK;
+    M[end - 6] = (length >> 40) & _BYTE_MASK;
+    M[end - 5] = (length >> 32) & _BYTE_MASK;
+    M[end - 4] = (length >> 24) & _BYTE_MASK;
+    M[end - 3] = (length >> 16) & _BYTE_MASK;
+    M[end - 2] = (length >> 8) & _BYTE_MASK;
+    M[end - 1] = length & _BYTE_MASK;
+    return blocks;
+}
+
+void sha1_init(sha1_context *ctx) {
+    // Initialisation values from RFC 3174
+    ctx->H[0] = 0x67452301;
+    ctx->H[1] = 0xEFCDAB89;
+    ctx->H[2] = 0x98BADCFE;
+    ctx->H[3] = 0x10325476;
+    ctx->H[4] = 0xC3D2E1F0;
+    ctx->length = 0;
+}
+
+// Whole blocks are hashed straight out of `data`, only the pieces either side
+// of them go through `ctx->block`
+bool sha1_update(sha1_context *ctx, const void *data, size_t length) {
+    if (length > _SHA1_MAX_LENGTH - ctx->length) return false;
+    const uint8_t *p = data;
+    size_t used = ctx->length % _SHA1_BLOCK_SIZE;
+    ctx->length += length;
+
+    if (used > 0) {
+        size_t len = _SHA1_BLOCK_SIZE - used < length ? _SHA1_BLOCK_SIZE - used : length;
+        memcpy(ctx->block + used, p, len);
+        p += len;
+        length -= len;
+        if (used + len < _SHA1_BLOCK_SIZE) return true;
+        _sha1_blocks(ctx->H, ctx->block, 1);
+    }
+    size_t blocks = length / _SHA1_BLOCK_SIZE;
+    if (blocks > 0) _sha1_blocks(ctx->H, p, blocks);
+    p += blocks * _SHA1_BLOCK_SIZE;
+    length -= blocks * _SHA1_BLOCK_SIZE;
+    if (length > 0) memcpy(ctx->block, p, length);
+    return true;
+}
+
+void _sha1_result(const uint32_t H[5], uint8_t result[SHA1_DIGEST_BYTE_LENGTH]) {
 //  After processing M(n), the message digest is the 160-bit string
 //     represented by the 5 words
 //              H0 H1 H2 H3 H4
@@ -207,7 +613,242 @@ bool sha1_digest(const uint8_t *data,
         result[(idx * 4) + 2] = (H[idx] >> 8) & _BYTE_MASK;
         result[(idx * 4) + 3] = H[idx] & _BYTE_MASK;
     }
+}
+
+void sha1_final(sha1_context *ctx, uint8_t result[SHA1_DIGEST_BYTE_LENGTH]) {
+    uint8_t M[2 * _SHA1_BLOCK_SIZE];
+    memcpy(M, ctx->block, ctx->length % _SHA1_BLOCK_SIZE);
+    _sha1_blocks(ctx->H, M, _sha1_pad(M, ctx->length));
+    _sha1_result(ctx->H, result);
+}
+
+#define _SHA1_HEX_ROW(d) d "0" d "1" d "2" d "3" d "4" d "5" d "6" d "7" \
+                         d "8" d "9" d "a" d "b" d "c" d "d" d "e" d "f"
+// The two digits of every byte, one after another
+const char _sha1_hex_pairs[2 * 256 + 1] =
+    _SHA1_HEX_ROW("0") _SHA1_HEX_ROW("1") _SHA1_HEX_ROW("2") _SHA1_HEX_ROW("3")
+    _SHA1_HEX_ROW("4") _SHA1_HEX_ROW("5") _SHA1_HEX_ROW("6") _SHA1_HEX_ROW("7")
+    _SHA1_HEX_ROW("8") _SHA1_HEX_ROW("9") _SHA1_HEX_ROW("a") _SHA1_HEX_ROW("b")
+    _SHA1_HEX_ROW("c") _SHA1_HEX_ROW("d") _SHA1_HEX_ROW("e") _SHA1_HEX_ROW("f");
+#undef _SHA1_HEX_ROW
+
+// Each hex digit's value plus one, so anything else is 0
+const uint8_t _sha1_hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+void sha1_to_hex(const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH], char hex[SHA1_DIGEST_HEX_LENGTH]) {
+    for (size_t idx = 0; idx < SHA1_DIGEST_BYTE_LENGTH; idx ++) {
+        memcpy(hex + 2 * idx, _sha1_hex_pairs + 2 * hash[idx], 2);
+    }
+}
+
+void sha1_snprintf_hex(char *str, size_t n, const uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
+    if (n == 0) return;
+    char hex[SHA1_DIGEST_HEX_LENGTH];
+    sha1_to_hex(hash, hex);
+    size_t len = n - 1 < sizeof(hex) ? n - 1 : sizeof(hex);
+    memcpy(str, hex, len);
+    str[len] = '\0';
+}
+
+bool sha1_from_hex(const char *hex, uint8_t hash[SHA1_DIGEST_BYTE_LENGTH]) {
+    for (size_t idx = 0; idx < SHA1_DIGEST_BYTE_LENGTH; idx ++) {
+        // Checked one at a time, so as not to read past a NUL
+        uint8_t hi = _sha1_hex_values[(uint8_t)hex[2 * idx]];
+        if (hi == 0) return false;
+        uint8_t lo = _sha1_hex_values[(uint8_t)hex[2 * idx + 1]];
+        if (lo == 0) return false;
+        hash[idx] = (hi - 1) << 4 | (lo - 1);
+    }
+    return true;
+}
+
+bool sha1_digest(const uint8_t *data,
+                uint64_t length,
+                uint8_t result[SHA1_DIGEST_BYTE_LENGTH]) {
+    sha1_context ctx;
+    sha1_init(&ctx);
+    if (!sha1_update(&ctx, data, length)) return false;
+    sha1_final(&ctx, result);
+    return true;
+}
+
+// Slowest first
+const sha1_many_kernel sha1_many_kernels[] = {
+    { .name = "serial", .lanes = 1, .blocks = NULL, .supported = _sha1_supported_always },
+#ifdef SHA1_X86_SIMD
+    { .name = "sse2", .lanes = 4, .blocks = _sha1_many_sse2, .supported = _sha1_supported_sse2 },
+    { .name = "avx2", .lanes = 8, .blocks = _sha1_many_avx2, .supported = _sha1_supported_avx2 },
+    { .name = "avx512", .lanes = 16, .blocks = _sha1_many_avx512, .supported = _sha1_supported_avx512 },
+#endif
+};
+const size_t sha1_many_kernels_count = sizeof(sha1_many_kernels) / sizeof(sha1_many_kernels[0]);
+
+const sha1_many_kernel *_sha1_many_kernel = NULL;
+
+const sha1_many_kernel *sha1_current_many_kernel(void) {
+    if (_sha1_many_kernel == NULL) sha1_use_many_kernel(NULL);
+    return _sha1_many_kernel;
+}
+
+void sha1_use_many_kernel(const sha1_many_kernel *kernel) {
+    if (kernel == NULL) {
+        kernel = &sha1_many_kernels[0];
+        for (size_t i = 1; i < sha1_many_kernels_count; i ++) {
+            if (sha1_many_kernels[i].supported()) kernel = &sha1_many_kernels[i];
+        }
+    }
+    _sha1_many_kernel = kernel;
+}
+
+// `count` blocks from `data` to hash into `H`
+typedef struct {
+    uint32_t *H;
+    const uint8_t *data;
+    size_t count;
+} _sha1_job;
+
+// Hashes the jobs a lane each, handing a lane the next job as soon as it's
+// done with the last, so messages of different lengths still keep them busy
+void _sha1_run_jobs(_sha1_job jobs[], size_t n) {
+    const sha1_many_kernel *kernel = sha1_current_many_kernel();
+    size_t lanes = kernel->lanes, next = 0;
+    if (kernel->blocks != NULL) {
+        uint32_t H[5 * SHA1_MAX_LANES];
+        const uint8_t *data[SHA1_MAX_LANES];
+        size_t left[SHA1_MAX_LANES];
+        _sha1_job *lane[SHA1_MAX_LANES] = {0};
+        size_t busy = 0;
+        for (;;) {
+            for (size_t i = 0; i < lanes && next < n; i ++) {
+                if (lane[i] != NULL) continue;
+                while (next < n && jobs[next].count == 0) next ++;
+                if (next == n) break;
+                lane[i] = &jobs[next++];
+                data[i] = lane[i]->data;
+                left[i] = lane[i]->count;
+                for (size_t w = 0; w < 5; w ++) H[w * lanes + i] = lane[i]->H[w];
+                busy ++;
+            }
+            // Only the last few messages are left. Hashing them one by one is
+            // faster than running the whole width for them.
+            if (busy * 2 < lanes) break;
+
+            size_t step = SIZE_MAX;
+            const uint8_t *any = NULL;
+            for (size_t i = 0; i < lanes; i ++) {
+                if (lane[i] == NULL) continue;
+                if (left[i] < step) step = left[i];
+                any = data[i];
+            }
+            // Idle lanes hash a busy lane's blocks over again, for nothing
+            for (size_t i = 0; i < lanes; i ++) {
+                if (lane[i] == NULL) data[i] = any;
+            }
+            kernel->blocks(H, data, step);
+            for (size_t i = 0; i < lanes; i ++) {
+                if (lane[i] == NULL) continue;
+                data[i] += step * _SHA1_BLOCK_SIZE;
+                left[i] -= step;
+                if (left[i] > 0) continue;
+                for (size_t w = 0; w < 5; w ++) lane[i]->H[w] = H[w * lanes + i];
+                lane[i] = NULL;
+                busy --;
+            }
+        }
+        for (size_t i = 0; i < lanes; i ++) {
+            if (lane[i] == NULL) continue;
+            for (size_t w = 0; w < 5; w ++) lane[i]->H[w] = H[w * lanes + i];
+            _sha1_blocks(lane[i]->H, data[i], left[i]);
+        }
+    }
+    for (; next < n; next ++) {
+        if (jobs[next].count > 0) _sha1_blocks(jobs[next].H, jobs[next].data, jobs[next].count);
+    }
+}
+
+// Contexts are worked through this many at a time, so the jobs fit on the stack
+#define _SHA1_MANY_BATCH 128
 
+// As sha1_update, in three rounds: finishing the blocks the contexts had
+// started, the whole blocks in `data`, and keeping what's left over
+bool sha1_update_many(sha1_context *const ctxs[], const void *const data[], const size_t lengths[], size_t count) {
+    for (size_t i = 0; i < count; i ++) {
+        if (lengths[i] > _SHA1_MAX_LENGTH - ctxs[i]->length) return false;
+    }
+    for (size_t base = 0; base < count; base += _SHA1_MANY_BATCH) {
+        size_t batch = count - base < _SHA1_MANY_BATCH ? count - base : _SHA1_MANY_BATCH;
+        _sha1_job jobs[_SHA1_MANY_BATCH];
+        size_t skip[_SHA1_MANY_BATCH];
+        size_t n = 0;
+        for (size_t i = 0; i < batch; i ++) {
+            sha1_context *ctx = ctxs[base + i];
+            size_t used = ctx->length % _SHA1_BLOCK_SIZE;
+            skip[i] = 0;
+            if (used == 0) continue;
+            skip[i] = _SHA1_BLOCK_SIZE - used < lengths[base + i] ? _SHA1_BLOCK_SIZE - used : lengths[base + i];
+            memcpy(ctx->block + used, data[base + i], skip[i]);
+            if (used + skip[i] == _SHA1_BLOCK_SIZE) {
+                jobs[n++] = (_sha1_job){ .H = ctx->H, .data = ctx->block, .count = 1 };
+            }
+        }
+        _sha1_run_jobs(jobs, n);
+
+        n = 0;
+        for (size_t i = 0; i < batch; i ++) {
+            sha1_context *ctx = ctxs[base + i];
+            const uint8_t *p = (const uint8_t *)data[base + i] + skip[i];
+            jobs[n++] = (_sha1_job){ .H = ctx->H, .data = p, .count = (lengths[base + i] - skip[i]) / _SHA1_BLOCK_SIZE };
+        }
+        _sha1_run_jobs(jobs, n);
+
+        for (size_t i = 0; i < batch; i ++) {
+            sha1_context *ctx = ctxs[base + i];
+            size_t length = lengths[base + i] - skip[i];
+            size_t rest = length % _SHA1_BLOCK_SIZE;
+            if (rest > 0) memcpy(ctx->block, (const uint8_t *)data[base + i] + skip[i] + length - rest, rest);
+            ctx->length += lengths[base + i];
+        }
+    }
+    return true;
+}
+
+void sha1_final_many(sha1_context *const ctxs[], uint8_t (*results)[SHA1_DIGEST_BYTE_LENGTH], size_t count) {
+    for (size_t base = 0; base < count; base += _SHA1_MANY_BATCH) {
+        size_t batch = count - base < _SHA1_MANY_BATCH ? count - base : _SHA1_MANY_BATCH;
+        _sha1_job jobs[_SHA1_MANY_BATCH];
+        uint8_t M[_SHA1_MANY_BATCH][2 * _SHA1_BLOCK_SIZE];
+        for (size_t i = 0; i < batch; i ++) {
+            sha1_context *ctx = ctxs[base + i];
+            memcpy(M[i], ctx->block, ctx->length % _SHA1_BLOCK_SIZE);
+            jobs[i] = (_sha1_job){ .H = ctx->H, .data = M[i], .count = _sha1_pad(M[i], ctx->length) };
+        }
+        _sha1_run_jobs(jobs, batch);
+        for (size_t i = 0; i < batch; i ++) {
+            _sha1_result(ctxs[base + i]->H, results[base + i]);
+        }
+    }
+}
+
+bool sha1_digest_many(const uint8_t *const data[],
+                      const size_t lengths[],
+                      size_t count,
+                      uint8_t (*results)[SHA1_DIGEST_BYTE_LENGTH]) {
+    for (size_t base = 0; base < count; base += _SHA1_MANY_BATCH) {
+        size_t batch = count - base < _SHA1_MANY_BATCH ? count - base : _SHA1_MANY_BATCH;
+        sha1_context ctx[_SHA1_MANY_BATCH];
+        sha1_context *ctxs[_SHA1_MANY_BATCH];
+        for (size_t i = 0; i < batch; i ++) {
+            sha1_init(&ctx[i]);
+            ctxs[i] = &ctx[i];
+        }
+        if (!sha1_update_many(ctxs, (const void *const *)(data + base), lengths + base, batch)) return false;
+        sha1_final_many(ctxs, results + base, batch);
+    }
     return true;
 }
 
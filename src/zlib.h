@@ -17,23 +17,24 @@ typedef enum {
     DEFLATE_UNCOMPRESSED,
     DEFLATE_UNCOMPRESSED_DATA,
     DEFLATE_COMPRESSED_DYNAMIC,
-    DEFLATE_COMPRESSED_DYNAMIC_LITERAL,
-    DEFLATE_COMPRESSED_DYNAMIC_LENGTH,
+    DEFLATE_COMPRESSED_DYNAMIC_CODES,
+    DEFLATE_COMPRESSED_DYNAMIC_TREES,
     DEFLATE_COMPRESSED_FIXED,
-    DEFLATE_COMPRESSED_FIXED_LENGTH,
-    DEFLATE_COMPRESSED_FIXED_LENGTH_EXTRA,
-    DEFLATE_COMPRESSED_FIXED_DISTANCE,
-    DEFLATE_COMPRESSED_FIXED_DISTANCE_EXTRA,
-    DEFLATE_COMPRESSED_FIXED_COPY,
+    DEFLATE_COMPRESSED_LITERAL,
+    DEFLATE_COMPRESSED_LENGTH_EXTRA,
+    DEFLATE_COMPRESSED_DISTANCE,
+    DEFLATE_COMPRESSED_DISTANCE_EXTRA,
+    DEFLATE_COMPRESSED_COPY,
     DEFLATE_FINISHED,
 
     DEFLATE_ERROR, // Keep this at the end. _Static_asserts count on it
 } deflate_state;
 
 typedef struct {
-    uint8_t *data;
-    uint8_t index;
+    uint8_t *data; // Input not yet loaded into `hold`
     size_t size;
+    uint64_t hold; // Next bits of the stream, starting at the lowest bit
+    uint8_t count; // Number of bits in `hold`
 } deflate_bitstream;
 
 typedef struct {
@@ -42,13 +43,97 @@ typedef struct {
     uint8_t *data;
 } deflate_array;
 
+typedef enum {
+    DEFLATE_CODES,
+    DEFLATE_LENS,
+    DEFLATE_DISTS,
+} deflate_huffman_table;
+
+// What a huffman table entry decodes to. The low 4 bits of `op` hold the
+// number of extra bits to read for a BASE, or the index bits of a sub table
+// for a LINK
+#define DEFLATE_HUFFMAN_LITERAL 0x00
+#define DEFLATE_HUFFMAN_BASE    0x10
+#define DEFLATE_HUFFMAN_END     0x20
+#define DEFLATE_HUFFMAN_LINK    0x40
+#define DEFLATE_HUFFMAN_INVALID 0x80
+
+#define DEFLATE_HUFFMAN_OP(entry) ((entry).op & 0xF0)
+#define DEFLATE_HUFFMAN_EXTRA(entry) ((entry).op & 0x0F)
+
+// One slot of a huffman lookup table, indexed by the next bits of the stream
+// (in stream order, so no bit reversal is needed when decoding).
+// `value` is the literal byte, the base length or distance (with the extra
+// bits folded into `op`), or the offset of the sub table for codes longer than
+// the root table.
+typedef struct {
+    uint16_t value;
+    uint8_t bits; // Bits of the code consumed at this level
+    uint8_t op;
+} deflate_huffman_entry;
+
+// Worst case table sizes for complete codes, as calculated by zlib's enough.c
+// 9 bit root table for literal/length codes, 6 bit root for distance codes
+#define DEFLATE_LENCODE_ROOT 9
+#define DEFLATE_DISTCODE_ROOT 6
+#define DEFLATE_CODECODE_ROOT 7
+#define DEFLATE_LENCODE_SIZE 852
+#define DEFLATE_DISTCODE_SIZE 592
+#define DEFLATE_CODECODE_SIZE (1 << DEFLATE_CODECODE_ROOT)
+
+// Fixed codes are at most 9 bits, so always decode in one lookup
+#define DEFLATE_FIXED_LENCODE_ROOT 9
+#define DEFLATE_FIXED_DISTCODE_ROOT 5
+
+typedef struct {
+    uint16_t nlen;
+    uint16_t ndist;
+    uint16_t ncode;
+    uint16_t have;
+    uint8_t lens[320];
+    deflate_huffman_entry codecode[DEFLATE_CODECODE_SIZE];
+    deflate_huffman_entry lencode[DEFLATE_LENCODE_SIZE];
+    deflate_huffman_entry distcode[DEFLATE_DISTCODE_SIZE];
+    // Tables for the current block, either the fixed or the dynamic ones
+    const deflate_huffman_entry *lcode;
+    const deflate_huffman_entry *dcode;
+    uint8_t lroot;
+    uint8_t droot;
+} deflate_huffman;
+
+// RFC 1951 - 2. Matches reach back at most 32K into the output
+#define DEFLATE_WINDOW_SIZE 32768
+// Output is handed to the sink once this much has built up, small enough
+// that it is still in cache
+#define DEFLATE_FLUSH_SIZE (4 * DEFLATE_WINDOW_SIZE)
+
+// Receives the uncompressed data as it goes through, i.e. the output as it is
+// produced when decompressing and the input as it is consumed when
+// compressing. Returning false stops with an error.
+typedef bool (*deflate_sink)(void *data, const uint8_t *buf, size_t size);
+
 typedef struct {
     deflate_state state;
     deflate_bitstream bits;
+    deflate_huffman huffman;
     deflate_array out;
     deflate_array in;
     uint32_t saved;
+    uint8_t extra;
     bool last;
+
+    // Streaming output. When `sink` is set, `out` only keeps the window that
+    // matches can reach back into (unless `keep` is set), everything before
+    // `flushed` has already been given to the sink.
+    deflate_sink sink;
+    void *sink_data;
+    size_t flushed;
+    bool keep;
+
+    // When non-zero, decompression stops (returning false as if it needs more
+    // input) once at least this much output has been collected, e.g. to
+    // look at a header before deciding what to do with the rest
+    size_t limit;
 } deflate_context;
 
 typedef enum {
@@ -68,14 +153,65 @@ typedef enum {
     ZLIB_MAX_COMPRESSOR,
 } zlib_compression_level;
 
+// What to do with an input, from a quick look at a sample of it
+typedef enum {
+    ZLIB_PROBE_COMPRESS, // Compress at the level asked for
+    ZLIB_PROBE_FASTEST,  // Barely compressible, not worth more than the fastest level
+    ZLIB_PROBE_STORE,    // Incompressible, e.g. already compressed. Stored as is
+} zlib_probe_decision;
+
+typedef struct {
+    zlib_probe_decision decision;
+    size_t sampled;   // Bytes looked at, 0 when the input is too small to bother
+    uint32_t entropy; // Order-0 entropy of the sample, in 1/1000 bits per byte
+    uint32_t repeats; // Sampled 4 byte sequences seen earlier in their window, per 1000
+} zlib_probe;
+
 typedef struct {
     zlib_state state;
     zlib_compression_level flevel;
     deflate_context deflate;
+    uint32_t adler;
+
+    // Set to stream decompressed output rather than collecting it in
+    // `deflate.out`. Input can then be fed in chunks through `deflate.bits`,
+    // calling zlib_decompress again after each one while it returns false
+    // without an error.
+    deflate_sink sink;
+    void *sink_data;
+
+    // Compressing big inputs is split across this many threads, 0 or 1 to
+    // keep to the calling one
+    size_t threads;
+
+    // Set to probe the input before compressing it, which may lower `flevel`
+    // or store the data uncompressed. What was decided ends up in `probed`.
+    bool probe;
+    zlib_probe probed;
+
+    // Stream of the external library when built with one, see zlib_backend.h
+    struct zlib_backend_stream *backend;
 } zlib_context;
 
+// The system zlib exports a deflate and inflate of its own, which would lose
+// out to these at link time even inside the library
+#ifdef ZLIB_BACKEND_ZLIB
+#define deflate(ctx) zlib_builtin_deflate(ctx)
+#define inflate(ctx, level) zlib_builtin_inflate(ctx, level)
+#endif
+
+bool deflate(deflate_context *ctx);
+bool deflate_raw(deflate_context *ctx, const uint8_t *data, size_t size, size_t *consumed);
+size_t deflate_unused(const deflate_context *ctx);
+bool deflate_flush(deflate_context *ctx);
+bool deflate_reserve(deflate_context *ctx, size_t size);
+uint32_t zlib_adler32(uint32_t adler, const uint8_t *data, size_t size);
+uint32_t zlib_adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+zlib_probe zlib_probe_input(const uint8_t *data, size_t size);
+const char *zlib_probe_name(zlib_probe_decision decision);
 bool zlib_decompress(zlib_context *ctx);
 bool zlib_compress(zlib_context *ctx);
+void zlib_end(zlib_context *ctx);
 
 // FIXME this should be somewhere else
 void hexdump(uint8_t *data, size_t len);
@@ -90,6 +226,12 @@ void hexdump(uint8_t *data, size_t len);
 #include <string.h>
 #include <ctype.h>
 #include <arpa/inet.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#include "zlib_backend.h"
 
 #define ZLIB_UNREACHABLE() do { fprintf(stderr, "%s:%d: UNREACHABLE\n", __FILE__, __LINE__); fflush(stderr); abort(); } while (0)
 #define ZLIB_UNIMPLENTED(fmt, ...) do { fprintf(stderr, "%s:%d: UNIMPLENTED %s: " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); fflush(stderr); abort(); } while (0)
@@ -186,11 +328,11 @@ void hexdump(uint8_t *data, size_t len) {
     fprintf(stderr, "\033[0m\n");
 }
 
-#define DEFLATE_BITS(ctx) ((ctx)->bits.size * 8 - (ctx)->bits.index)
+#define DEFLATE_BITS(ctx) ((ctx)->bits.size * 8 + (ctx)->bits.count)
 
-#define DEFLATE_CLEAR_BITS(ctx) do { if ((ctx)->bits.index > 0) { (ctx)->bits.index = 0; (ctx)->bits.data ++; (ctx)->bits.size --; } } while (0)
+#define DEFLATE_CLEAR_BITS(ctx) deflate_drop_bits((ctx), (ctx)->bits.count % 8)
 
-#define DEFLATE_BYTES(ctx) (ctx)->bits.size
+#define DEFLATE_BYTES(ctx) ((ctx)->bits.size + (ctx)->bits.count / 8)
 
 #define DEFLATE_ENSURE(ctx, inc) do { \
     if ((ctx)->out.size + (inc) > (ctx)->out.capacity) { \
@@ -226,34 +368,6 @@ void hexdump(uint8_t *data, size_t len) {
 } while (0)
 #endif // PRINT_BITS
 
-typedef struct {
-    uint64_t length;
-    uint64_t code;
-} huffman_tree_entry;
-
-typedef struct {
-    huffman_tree_entry *data;
-    size_t length;
-} huffman_tree;
-
-uint8_t deflate_next(deflate_context *ctx) {
-    assert(ctx != NULL);
-    assert(ctx->bits.data != NULL);
-    if (ctx->bits.size == 0) {
-        return EOF;
-    }
-    assert(ctx->bits.index <= 7);
-    uint8_t ret = (ctx->bits.data[0] >> ctx->bits.index) & 0x1;
-    ctx->bits.index ++;
-    if (ctx->bits.index == 8) {
-        ctx->bits.size --;
-        ctx->bits.data ++;
-        ctx->bits.index = 0;
-    }
-    /* INFO("deflate_next: ret %d, index = %d, size = %lu\n", ret, ctx->bits.index, ctx->bits.size); */
-    return ret;
-}
-
 uint64_t _deflate_reverse_bits(uint64_t num, size_t idx, size_t bits) {
     assert(bits <= 63);
     if (bits <= 1) return num;
@@ -275,47 +389,47 @@ uint64_t deflate_reverse_bits(uint64_t num, size_t bits) {
     return _deflate_reverse_bits(num, 0, bits);
 }
 
-uint64_t _deflate_peek_bits_rev(deflate_context *ctx, size_t bits) {
-    if (DEFLATE_BITS(ctx) < bits) return EOF;
-    assert(bits <= 63);
-    uint8_t bytes = (bits + ctx->bits.index + 7) / 8;
-    switch (bytes) {
-        case 0: return 0;
-        case 1: return (*ctx->bits.data >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 2: return (*(uint16_t *)ctx->bits.data >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 3: return ((((uint64_t)*ctx->bits.data << 16) | (*(uint16_t *)(ctx->bits.data + 1))) >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 4: return (*(uint32_t *)ctx->bits.data >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 5: return (((uint64_t)*ctx->bits.data << 32 | (*(uint32_t *)(ctx->bits.data + 1))) >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 6: return (((uint64_t)*(uint16_t *)ctx->bits.data << 32 | (*(uint32_t *)(ctx->bits.data + 2))) >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 7: return ((((uint64_t)*ctx->bits.data << 48) | ((uint64_t)*(uint16_t *)(ctx->bits.data + 1) << 32) | (*(uint32_t *)(ctx->bits.data + 3))) >> ctx->bits.index) & ((1UL << bits) - 1);
-        case 8: return ((*(uint64_t *)ctx->bits.data) >> ctx->bits.index) & ((1UL << bits) - 1);
-        default:
-            ZLIB_UNREACHABLE();
-            ctx->state = DEFLATE_ERROR;
-            return 0;
+// Refills `hold` so it has at least 56 bits, while there is input. Whole
+// words are loaded at once, only the last few bytes of the input are loaded
+// one at a time. Bits above `count` are either 0 or the upcoming input bits,
+// so loading the same bytes again later doesn't change them.
+void _deflate_refill(deflate_context *ctx) {
+    deflate_bitstream *bits = &ctx->bits;
+    if (bits->size >= 8) {
+        uint64_t word;
+        memcpy(&word, bits->data, sizeof(word));
+        word = le64toh(word);
+        size_t bytes = (63 - bits->count) / 8;
+        bits->hold |= word << bits->count;
+        bits->data += bytes;
+        bits->size -= bytes;
+        bits->count += bytes * 8;
+        return;
+    }
+    while (bits->count <= 56 && bits->size > 0) {
+        bits->hold |= (uint64_t)*bits->data << bits->count;
+        bits->data ++;
+        bits->size --;
+        bits->count += 8;
     }
 }
 
+// Returns the next `bits` bits of the stream without consuming them, the
+// first bit of the stream in the lowest bit (RFC 1951 - 3.1.1). If the input
+// runs out before then, the missing bits are 0.
 uint64_t deflate_peek_bits(deflate_context *ctx, size_t bits) {
-    if (DEFLATE_BITS(ctx) < bits) return EOF;
-    assert(bits <= 63);
-    /* uint64_t ret = deflate_reverse_bits(_deflate_peek_bits_rev(ctx, bits), bits); */
-    /* INFO("deflate_peek_bits(%ld), 0x%lx, 0b", bits, ret); */
-    /* PRINT_BITS(ret, bits); */
-    return deflate_reverse_bits(_deflate_peek_bits_rev(ctx, bits), bits);
+    assert(bits <= 56);
+    if (ctx->bits.count < bits) _deflate_refill(ctx);
+    return ctx->bits.hold & ((1UL << bits) - 1);
 }
 
 void deflate_drop_bits(deflate_context *ctx, size_t bits) {
-    assert(bits <= 63);
-    assert(DEFLATE_BITS(ctx) >= bits);
-    ctx->bits.index += bits;
-    ctx->bits.data += ctx->bits.index / 8;
-    ctx->bits.size -= ctx->bits.index / 8;
-    ctx->bits.index %= 8;
+    assert(bits <= ctx->bits.count);
+    ctx->bits.hold >>= bits;
+    ctx->bits.count -= bits;
 }
 
 uint64_t deflate_next_bits(deflate_context *ctx, size_t bits) {
-    assert(bits <= 63);
     if (DEFLATE_BITS(ctx) < bits) return EOF;
     uint64_t ret = deflate_peek_bits(ctx, bits);
     deflate_drop_bits(ctx, bits);
@@ -324,38 +438,75 @@ uint64_t deflate_next_bits(deflate_context *ctx, size_t bits) {
     return ret;
 }
 
-uint64_t deflate_next_bits_rev(deflate_context *ctx, size_t bits) {
-    assert(bits <= 63);
-    if (DEFLATE_BITS(ctx) < bits) return EOF;
-    uint64_t ret = _deflate_peek_bits_rev(ctx, bits);
-    ctx->bits.index += bits;
-    ctx->bits.data += ctx->bits.index / 8;
-    ctx->bits.size -= ctx->bits.index / 8;
-    ctx->bits.index %= 8;
-    /* INFO("deflate_next_bits_rev(%ld), 0x%lx, 0b", bits, ret); */
-    /* PRINT_BITS(ret, bits); */
-    return ret;
+// Reads whole bytes (little endian), the stream must be byte aligned
+uint64_t deflate_next_bytes(deflate_context *ctx, size_t bytes) {
+    assert(ctx->bits.count % 8 == 0);
+    assert(bytes <= 7);
+    if (DEFLATE_BYTES(ctx) < bytes) return EOF;
+    return deflate_next_bits(ctx, bytes * 8);
 }
 
-uint64_t deflate_next_bytes(deflate_context *ctx, size_t bytes) {
-    assert(ctx->bits.index == 0);
-    if (ctx->bits.size < bytes) return EOF;
-    assert(bytes <= 8);
-    ctx->bits.data += bytes;
-    ctx->bits.size -= bytes;
-    switch (bytes) {
-        case 0: return 0;
-        case 1: return *(ctx->bits.data - bytes);
-        case 2: return *(uint16_t *)(ctx->bits.data - bytes);
-        case 3: return ((uint64_t)*(ctx->bits.data - bytes) << 16) | (*(uint16_t *)(ctx->bits.data - bytes + 1));
-        case 4: return *(uint32_t *)(ctx->bits.data - bytes);
-        case 5: return (uint64_t)*(ctx->bits.data - bytes) << 32 | (*(uint32_t *)(ctx->bits.data - bytes + 1));
-        case 6: return (uint64_t)*(uint16_t *)(ctx->bits.data - bytes) << 32 | (*(uint32_t *)(ctx->bits.data - bytes + 2));
-        case 7: return ((uint64_t)*(ctx->bits.data - bytes) << 48) | ((uint64_t)*(uint16_t *)(ctx->bits.data - bytes + 1) << 32) | (*(uint32_t *)(ctx->bits.data - bytes + 3));
-        case 8: return *(uint64_t *)(ctx->bits.data - bytes);
-        default: ZLIB_UNREACHABLE();
+// Copies out whole bytes, the stream must be byte aligned. Any bytes already
+// loaded into `hold` come first, the rest are copied straight from the input.
+void _deflate_copy_bytes(deflate_context *ctx, size_t bytes) {
+    assert(ctx->bits.count % 8 == 0);
+    assert(bytes <= DEFLATE_BYTES(ctx));
+    DEFLATE_ENSURE(ctx, bytes);
+    while (bytes > 0 && ctx->bits.count > 0) {
+        ctx->out.data[ctx->out.size ++] = ctx->bits.hold & 0xFF;
+        deflate_drop_bits(ctx, 8);
+        bytes --;
     }
-    return (uint64_t)-1;
+    if (bytes > 0) {
+        // Any bits left above `count` are for the bytes being skipped past
+        ctx->bits.hold = 0;
+        DEFLATE_APPEND_BYTES(ctx, ctx->bits.data, bytes);
+        ctx->bits.data += bytes;
+        ctx->bits.size -= bytes;
+    }
+}
+
+// Room kept past the end of the output, so matches can be copied a word at a
+// time without checking for the last few bytes
+#define DEFLATE_OUT_SLACK 8
+#define DEFLATE_MAX_LENGTH 258
+
+// Makes room for `size` bytes of output in total, e.g. once the size is
+// known from a header, so it doesn't need to keep growing. Sizes come from
+// untrusted headers, so failing leaves the output as it was and returns false
+bool deflate_reserve(deflate_context *ctx, size_t size) {
+    if (size > SIZE_MAX - DEFLATE_OUT_SLACK) return false;
+    size_t capacity = size + DEFLATE_OUT_SLACK;
+    if (capacity > ctx->out.capacity) {
+        uint8_t *data = realloc(ctx->out.data, capacity);
+        if (data == NULL) return false;
+        ctx->out.data = data;
+        ctx->out.capacity = capacity;
+    }
+    return true;
+}
+
+// Output size at which decoding needs to stop for a flush or the limit
+size_t _deflate_output_stop(deflate_context *ctx) {
+    size_t stop = ctx->flushed + DEFLATE_FLUSH_SIZE;
+    if (ctx->limit != 0 && ctx->limit < stop) stop = ctx->limit;
+    return stop;
+}
+
+// Gives everything not yet flushed to the sink, then slides the window down
+// to the start of `out`
+bool deflate_flush(deflate_context *ctx) {
+    if (ctx->sink != NULL && ctx->out.size > ctx->flushed &&
+            !ctx->sink(ctx->sink_data, ctx->out.data + ctx->flushed, ctx->out.size - ctx->flushed)) {
+        ctx->state = DEFLATE_ERROR;
+        return false;
+    }
+    if (ctx->sink != NULL && !ctx->keep && ctx->out.size > DEFLATE_WINDOW_SIZE) {
+        memmove(ctx->out.data, ctx->out.data + ctx->out.size - DEFLATE_WINDOW_SIZE, DEFLATE_WINDOW_SIZE);
+        ctx->out.size = DEFLATE_WINDOW_SIZE;
+    }
+    ctx->flushed = ctx->out.size;
+    return true;
 }
 
 bool _deflate_uncompressed(deflate_context *ctx) {
@@ -365,21 +516,22 @@ bool _deflate_uncompressed(deflate_context *ctx) {
             DEFLATE_CLEAR_BITS(ctx);
             if (DEFLATE_BYTES(ctx) < 4) return false;
             uint16_t len = deflate_next_bytes(ctx, 2);
-            int16_t nlen = deflate_next_bytes(ctx, 2);
-            assert(len == (uint16_t)~nlen);
+            uint16_t nlen = deflate_next_bytes(ctx, 2);
+            if ((len ^ nlen) != 0xFFFF) {
+                ctx->state = DEFLATE_ERROR;
+                return false;
+            }
 
             ctx->saved = len;
             ctx->state = DEFLATE_UNCOMPRESSED_DATA;
         }; // fallthrough
 
         case DEFLATE_UNCOMPRESSED_DATA: {
-            assert(ctx->bits.index == 0);
             size_t bytes = ctx->saved >= DEFLATE_BYTES(ctx) ? DEFLATE_BYTES(ctx) : ctx->saved;
             if (bytes > 0) {
-                DEFLATE_APPEND_BYTES(ctx, ctx->bits.data, bytes);
-                ctx->bits.data += bytes;
-                ctx->bits.size -= bytes;
+                _deflate_copy_bytes(ctx, bytes);
                 ctx->saved -= bytes;
+                if (ctx->out.size - ctx->flushed >= DEFLATE_FLUSH_SIZE && !deflate_flush(ctx)) return false;
             }
             if (ctx->saved == 0) {
                 ctx->state = DEFLATE_FINISHED;
@@ -396,264 +548,473 @@ bool _deflate_uncompressed(deflate_context *ctx) {
     return false;
 }
 
-int _deflate_fixed_compression_code(deflate_context *ctx) {
-    // RFC 1951 - 3.2.6 Compression with fixed Huffman codes (BTYPE=01)
-    int code = deflate_peek_bits(ctx, 7);
-    if (code == EOF) return EOF;
-    /* INFO("Trying 7 bit code: "); */
-    /* PRINT_BITS(code, 7); fprintf(stderr, "\n"); */
-    if (code <= 0x17) {
-        // 256 - 279, codes 0b0000000 - 0b0010111
-        /* INFO("256 - 279, codes 0b0000000 - 0b0010111\n"); */
-        code += 256;
-        deflate_drop_bits(ctx, 7);
-    } else {
-        code = deflate_peek_bits(ctx, 8);
-        if (code == EOF) return EOF;
-        /* INFO("Trying 8 bit code: "); */
-        /* PRINT_BITS(code, 8); fprintf(stderr, "\n"); */
-        assert(code >= 0x30);
-        if (code <= 0xBF) {
-            // 0 - 143, codes 0b00110000 - 0b10111111
-            /* INFO("0 - 143, codes 0b00110000 - 0b10111111\n"); */
-            code -= 0x30;
-            deflate_drop_bits(ctx, 8);
-        } else if (code <= 0xC7) {
-            // 280 - 287, codes 0b11000000 - 0b11000111
-            /* INFO("280 - 287, codes 0b11000000 - 0b11000111\n"); */
-            code -= 0xc0;
-            code += 280;
-            deflate_drop_bits(ctx, 8);
+bool _deflate_copy(deflate_context *ctx, uint16_t len, uint32_t dist) {
+    // RFC 1951 - 3.2.3 (the copy may overlap the bytes it is producing)
+    if (dist == 0 || dist > ctx->out.size) {
+        ctx->state = DEFLATE_ERROR;
+        return false;
+    }
+    DEFLATE_ENSURE(ctx, len + DEFLATE_OUT_SLACK);
+    uint8_t *out = ctx->out.data + ctx->out.size;
+    ctx->out.size += len;
+
+    // A run of one byte
+    if (dist == 1) {
+        memset(out, out[-1], len);
+        return true;
+    }
+
+    // Shorter distances repeat a pattern, so once there's a word of it
+    // written, the rest can be copied from a whole number of patterns back
+    size_t i = 0;
+    if (dist < 8) {
+        size_t period = (8 + dist - 1) / dist * dist;
+        for (; i < period && i < len; i ++) out[i] = out[i - dist];
+        dist = period;
+    }
+    // Every word is read from at least a word back, so it has already been
+    // written. The last word can run into the slack past the end
+    for (; i < len; i += 8) memcpy(out + i, out + i - dist, 8);
+    return true;
+}
+
+// RFC 1951 - 3.2.5 base values and extra bits for length codes 257..285
+const uint16_t _deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+const uint8_t _deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+// RFC 1951 - 3.2.5 base values and extra bits for distance codes 0..29
+const uint16_t _deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+const uint8_t _deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// Order the code length code lengths are sent in, RFC 1951 - 3.2.7
+const uint8_t _deflate_codecode_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+// What a symbol decodes to, so the length and distance base values and extra
+// bits are known straight from the table lookup
+deflate_huffman_entry _deflate_huffman_symbol(deflate_huffman_table type, uint16_t sym, uint8_t bits) {
+    _Static_assert(DEFLATE_DISTS == 2, "Tables have changed. May need handling here");
+    switch (type) {
+        case DEFLATE_CODES:
+            return (deflate_huffman_entry){ .value = sym, .bits = bits, .op = DEFLATE_HUFFMAN_LITERAL };
+
+        case DEFLATE_LENS:
+            if (sym < 256) {
+                return (deflate_huffman_entry){ .value = sym, .bits = bits, .op = DEFLATE_HUFFMAN_LITERAL };
+            } else if (sym == 256) {
+                return (deflate_huffman_entry){ .bits = bits, .op = DEFLATE_HUFFMAN_END };
+            } else if (sym < 286) {
+                return (deflate_huffman_entry){
+                    .value = _deflate_length_base[sym - 257],
+                    .bits = bits,
+                    .op = DEFLATE_HUFFMAN_BASE | _deflate_length_extra[sym - 257],
+                };
+            }
+            break;
+
+        case DEFLATE_DISTS:
+            if (sym < 30) {
+                return (deflate_huffman_entry){
+                    .value = _deflate_dist_base[sym],
+                    .bits = bits,
+                    .op = DEFLATE_HUFFMAN_BASE | _deflate_dist_extra[sym],
+                };
+            }
+            break;
+
+        default:
+            ZLIB_UNREACHABLE();
+    }
+    // RFC 1951 - 3.2.6 Codes 286, 287, 30 and 31 will never occur in the data
+    return (deflate_huffman_entry){ .bits = bits, .op = DEFLATE_HUFFMAN_INVALID };
+}
+
+// Builds a (possibly two level) lookup table for the canonical huffman code
+// described by `lens` (RFC 1951 - 3.2.2). Entries are indexed by the next
+// `root` bits of the stream, codes longer than `root` bits get a sub table
+// appended after the root table sized for the longest code sharing the prefix.
+bool deflate_huffman_build(deflate_huffman_table type, const uint8_t *lens, size_t n, uint8_t root,
+        deflate_huffman_entry *table, size_t size) {
+    uint16_t count[16] = {0};
+    for (size_t sym = 0; sym < n; sym ++) {
+        assert(lens[sym] <= 15);
+        count[lens[sym]] ++;
+    }
+
+    uint8_t max = 15;
+    while (max > 0 && count[max] == 0) max --;
+
+    // Reject over subscribed and incomplete codes. The only incomplete codes
+    // allowed are a single code of one bit (RFC 1951 - 3.2.7), and no codes
+    // at all, which zlib accepts for distances in blocks of only literals.
+    // Decoding a symbol from an empty table then hits an invalid entry.
+    int left = 1;
+    for (size_t len = 1; len <= 15; len ++) {
+        left <<= 1;
+        left -= count[len];
+        if (left < 0) return false;
+    }
+    if (left > 0 && max > 1) return false;
+
+    // RFC 1951 - 3.2.2 - Step 2
+    uint16_t next_code[16] = {0};
+    uint16_t code = 0;
+    count[0] = 0;
+    for (size_t len = 1; len <= 15; len ++) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    size_t root_size = (size_t)1 << root;
+    assert(root_size <= size);
+    for (size_t i = 0; i < root_size; i ++) {
+        table[i] = (deflate_huffman_entry){ .op = DEFLATE_HUFFMAN_INVALID };
+    }
+
+    // Size up the sub tables needed for codes longer than the root table
+    uint8_t sub_bits[1 << DEFLATE_LENCODE_ROOT] = {0};
+    assert(root <= DEFLATE_LENCODE_ROOT);
+    uint16_t codes[16];
+    memcpy(codes, next_code, sizeof(codes));
+    for (size_t sym = 0; sym < n; sym ++) {
+        uint8_t len = lens[sym];
+        if (len <= root) continue;
+        uint16_t prefix = deflate_reverse_bits(codes[len] >> (len - root), root);
+        codes[len] ++;
+        if (len - root > sub_bits[prefix]) sub_bits[prefix] = len - root;
+    }
+    size_t used = root_size;
+    for (size_t prefix = 0; prefix < root_size; prefix ++) {
+        if (sub_bits[prefix] == 0) continue;
+        size_t sub_size = (size_t)1 << sub_bits[prefix];
+        if (used + sub_size > size) return false;
+        table[prefix] = (deflate_huffman_entry){
+            .value = used,
+            .bits = root,
+            .op = DEFLATE_HUFFMAN_LINK | sub_bits[prefix],
+        };
+        for (size_t i = 0; i < sub_size; i ++) {
+            table[used + i] = (deflate_huffman_entry){ .op = DEFLATE_HUFFMAN_INVALID };
+        }
+        used += sub_size;
+    }
+
+    // RFC 1951 - 3.2.2 - Step 3, replicating each code over every index that
+    // shares its bits
+    for (size_t sym = 0; sym < n; sym ++) {
+        uint8_t len = lens[sym];
+        if (len == 0) continue;
+        uint16_t rev = deflate_reverse_bits(next_code[len]++, len);
+        if (len <= root) {
+            deflate_huffman_entry entry = _deflate_huffman_symbol(type, sym, len);
+            for (size_t i = rev; i < root_size; i += (size_t)1 << len) {
+                table[i] = entry;
+            }
         } else {
-            code = deflate_peek_bits(ctx, 9);
-            if (code == EOF) return EOF;
-            /* INFO("Trying 9 bit code: "); */
-            /* PRINT_BITS(code, 9); fprintf(stderr, "\n"); */
-            assert(code >= 0x190);
-            assert(code <= 0x1ff);
-            // 144 - 255, codes 0b110010000 - 0b111111111
-            /* INFO("144 - 255, codes 0b110010000 - 0b111111111\n"); */
-            code -= 0x190;
-            code += 144;
-            deflate_drop_bits(ctx, 9);
-        }
-    }
-    return code;
-}
-
-int _deflate_fixed_compression_length_extra(deflate_context *ctx) {
-    uint16_t code = ctx->saved;
-    // RFC 1951 - 3.2.5
-    assert(code >= 265 && code < 285);
-    if (code < 269) {
-        uint8_t offset = 1;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 11 + ((code - 265) << offset) + next;
-    } else if (code < 273) {
-        uint8_t offset = 2;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 19 + ((code - 269) << offset) + next;
-    } else if (code < 277) {
-        uint8_t offset = 3;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 35 + ((code - 273) << offset) + next;
-    } else if (code < 281) {
-        uint8_t offset = 4;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 67 + ((code - 277) << offset) + next;
-    } else if (code < 285) {
-        uint8_t offset = 5;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 131 + ((code - 281) << offset) + next;
+            deflate_huffman_entry link = table[rev & (root_size - 1)];
+            uint8_t drop = len - root;
+            deflate_huffman_entry entry = _deflate_huffman_symbol(type, sym, drop);
+            for (size_t i = rev >> root; i < ((size_t)1 << DEFLATE_HUFFMAN_EXTRA(link)); i += (size_t)1 << drop) {
+                table[link.value + i] = entry;
+            }
+        }
     }
-    ZLIB_UNREACHABLE();
-    ctx->state = DEFLATE_ERROR;
-    return EOF;
-}
-
-int _deflate_fixed_compression_dist_extra(deflate_context *ctx) {
-    uint16_t len = ctx->saved >> 16;
-    uint8_t code = ctx->saved & 0xFF;
-    assert(len >= 3 && len <= 258);
-    assert(code >= 4 && code < 30);
-    // RFC 1951 - 3.2.5
-    if (code < 6) {
-        uint8_t offset = 1;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 5 + ((code - 4) << offset) + next;
-    } else if (code < 8) {
-        uint8_t offset = 2;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 9 + ((code - 6) << offset) + next;
-    } else if (code < 10) {
-        uint8_t offset = 3;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 17 + ((code - 8) << offset) + next;
-    } else if (code < 12) {
-        uint8_t offset = 4;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 33 + ((code - 10) << offset) + next;
-    } else if (code < 14) {
-        uint8_t offset = 5;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 65 + ((code - 12) << offset) + next;
-    } else if (code < 16) {
-        uint8_t offset = 6;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 129 + ((code - 14) << offset) + next;
-    } else if (code < 18) {
-        uint8_t offset = 7;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 257 + ((code - 16) << offset) + next;
-    } else if (code < 20) {
-        uint8_t offset = 8;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 513 + ((code - 18) << offset) + next;
-    } else if (code < 22) {
-        uint8_t offset = 9;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 1025 + ((code - 20) << offset) + next;
-    } else if (code < 24) {
-        uint8_t offset = 10;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 2049 + ((code - 22) << offset) + next;
-    } else if (code < 26) {
-        uint8_t offset = 11;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 4097 + ((code - 24) << offset) + next;
-    } else if (code < 28) {
-        uint8_t offset = 12;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 8193 + ((code - 26) << offset) + next;
-    } else if (code < 30) {
-        uint8_t offset = 13;
-        uint16_t next = deflate_next_bits_rev(ctx, offset);
-        if (next == (uint16_t)EOF) return EOF;
-        return 16385 + ((code - 28) << offset) + next;
+    return true;
+}
+
+// RFC 1951 - 3.2.6 Compression with fixed Huffman codes (BTYPE=01)
+// These never change, so are only built the first time they are needed
+deflate_huffman_entry _deflate_fixed_lencode[1 << DEFLATE_FIXED_LENCODE_ROOT];
+deflate_huffman_entry _deflate_fixed_distcode[1 << DEFLATE_FIXED_DISTCODE_ROOT];
+
+void _deflate_fixed_tables(void) {
+    static bool built = false;
+    if (built) return;
+    uint8_t lens[288];
+    size_t sym = 0;
+    while (sym < 144) lens[sym ++] = 8;
+    while (sym < 256) lens[sym ++] = 9;
+    while (sym < 280) lens[sym ++] = 7;
+    while (sym < 288) lens[sym ++] = 8;
+    bool ok = deflate_huffman_build(DEFLATE_LENS, lens, 288, DEFLATE_FIXED_LENCODE_ROOT,
+                _deflate_fixed_lencode, ZLIB_C_ARRAY_LEN(_deflate_fixed_lencode));
+    for (sym = 0; sym < 32; sym ++) lens[sym] = 5;
+    ok = ok && deflate_huffman_build(DEFLATE_DISTS, lens, 32, DEFLATE_FIXED_DISTCODE_ROOT,
+                _deflate_fixed_distcode, ZLIB_C_ARRAY_LEN(_deflate_fixed_distcode));
+    assert(ok);
+    (void)ok;
+    built = true;
+}
+
+// Decodes the next symbol with at most two table lookups, rather than walking
+// the tree bit by bit. Returns false if more input is needed (nothing is
+// consumed), or sets the error state for codes that aren't in the table.
+bool _deflate_huffman_decode(deflate_context *ctx, const deflate_huffman_entry *table, uint8_t root, deflate_huffman_entry *ret) {
+    uint64_t peek = deflate_peek_bits(ctx, root);
+    deflate_huffman_entry entry = table[peek];
+    uint8_t bits = entry.bits;
+    size_t lookup = root;
+    if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_LINK) {
+        lookup += DEFLATE_HUFFMAN_EXTRA(entry);
+        peek = deflate_peek_bits(ctx, lookup);
+        entry = table[entry.value + (peek >> root)];
+        bits = root + entry.bits;
     }
-    ZLIB_UNREACHABLE();
-    ctx->state = DEFLATE_ERROR;
-    return EOF;
+    if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_INVALID) {
+        // Either an unused code or not enough bits left to know yet
+        if (DEFLATE_BITS(ctx) < lookup && entry.bits == 0) return false;
+        ctx->state = DEFLATE_ERROR;
+        return false;
+    }
+    if (DEFLATE_BITS(ctx) < bits) return false;
+    deflate_drop_bits(ctx, bits);
+    *ret = entry;
+    return true;
 }
 
-bool _deflate_fixed_compression(deflate_context *ctx) {
+bool _deflate_dynamic_tables(deflate_context *ctx) {
+    deflate_huffman *h = &ctx->huffman;
     for (;;) {
         _Static_assert(DEFLATE_ERROR == 13, "States have changed. May need handling here");
         switch (ctx->state) {
-            case DEFLATE_COMPRESSED_FIXED: {
-                uint64_t code = _deflate_fixed_compression_code(ctx);
-                if (code == (uint64_t)EOF) return false;
-
-                /* INFO("Got code %ld\n", code); */
-                // RFC 1951 - 3.2.5. Compressed blocks (length and distance codes)
-                if (code < 256) {
-                    DEFLATE_APPEND(ctx, (uint8_t)code);
-                    break;
-                } else if (code == 256) {
-                    ctx->state = DEFLATE_FINISHED;
-                    return true;
-                } else if (code > 285) {
-                    ZLIB_UNREACHABLE();
+            case DEFLATE_COMPRESSED_DYNAMIC: {
+                // RFC 1951 - 3.2.7
+                if (DEFLATE_BITS(ctx) < 14) return false;
+                h->nlen = deflate_next_bits(ctx, 5) + 257;
+                h->ndist = deflate_next_bits(ctx, 5) + 1;
+                h->ncode = deflate_next_bits(ctx, 4) + 4;
+                /* INFO("Deflating dynamic huffman code, hlit = %d hdist = %d hclen = %d\n", h->nlen, h->ndist, h->ncode); */
+                if (h->nlen > 286 || h->ndist > 30) {
                     ctx->state = DEFLATE_ERROR;
                     return false;
                 }
-
-                ctx->saved = code;
-                ctx->state = DEFLATE_COMPRESSED_FIXED_LENGTH;
+                h->have = 0;
+                ctx->state = DEFLATE_COMPRESSED_DYNAMIC_CODES;
             };
                 // fall through
-            case DEFLATE_COMPRESSED_FIXED_LENGTH: {
-                uint16_t code = ctx->saved;
-                // RFC 1951 - 3.2.5
-                assert(code > 256 && code < 285);
-                if (code < 265) {
-                    ctx->saved = 3 + code - 257;
-                    ctx->state = DEFLATE_COMPRESSED_FIXED_DISTANCE;
-                    break;
-                } else if (code == 285) {
-                    ctx->saved = 258; // Great for dsylexics. Intentionally different as per spec.
-                    ctx->state = DEFLATE_COMPRESSED_FIXED_DISTANCE;
-                    break;
-                } else if (code > 285) {
-                    ZLIB_UNREACHABLE();
+            case DEFLATE_COMPRESSED_DYNAMIC_CODES: {
+                while (h->have < h->ncode) {
+                    if (DEFLATE_BITS(ctx) < 3) return false;
+                    h->lens[_deflate_codecode_order[h->have ++]] = deflate_next_bits(ctx, 3);
+                }
+                while (h->have < ZLIB_C_ARRAY_LEN(_deflate_codecode_order)) {
+                    h->lens[_deflate_codecode_order[h->have ++]] = 0;
+                }
+                if (!deflate_huffman_build(DEFLATE_CODES, h->lens, ZLIB_C_ARRAY_LEN(_deflate_codecode_order),
+                            DEFLATE_CODECODE_ROOT, h->codecode, DEFLATE_CODECODE_SIZE)) {
                     ctx->state = DEFLATE_ERROR;
                     return false;
                 }
-
-                ctx->state = DEFLATE_COMPRESSED_FIXED_LENGTH_EXTRA;
+                h->have = 0;
+                ctx->state = DEFLATE_COMPRESSED_DYNAMIC_TREES;
             };
                 // fall through
-            case DEFLATE_COMPRESSED_FIXED_LENGTH_EXTRA: {
-                ctx->saved = _deflate_fixed_compression_length_extra(ctx);
-                ctx->state = DEFLATE_COMPRESSED_FIXED_DISTANCE;
+            case DEFLATE_COMPRESSED_DYNAMIC_TREES: {
+                while (h->have < h->nlen + h->ndist) {
+                    // Only consume the code once its repeat bits are also available
+                    uint64_t peek = deflate_peek_bits(ctx, DEFLATE_CODECODE_ROOT);
+                    deflate_huffman_entry entry = h->codecode[peek];
+                    if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_INVALID || DEFLATE_BITS(ctx) < entry.bits) {
+                        if (DEFLATE_BITS(ctx) < DEFLATE_CODECODE_ROOT) return false;
+                        ctx->state = DEFLATE_ERROR;
+                        return false;
+                    }
+                    uint8_t extra = 0;
+                    switch (entry.value) {
+                        case 16: extra = 2; break;
+                        case 17: extra = 3; break;
+                        case 18: extra = 7; break;
+                        default: break;
+                    }
+                    if (DEFLATE_BITS(ctx) < (size_t)entry.bits + extra) return false;
+                    deflate_drop_bits(ctx, entry.bits);
+
+                    uint8_t len = 0;
+                    size_t repeat = 1;
+                    switch (entry.value) {
+                        case 16:
+                            if (h->have == 0) {
+                                ctx->state = DEFLATE_ERROR;
+                                return false;
+                            }
+                            len = h->lens[h->have - 1];
+                            repeat = 3 + deflate_next_bits(ctx, extra);
+                            break;
+                        case 17: repeat = 3 + deflate_next_bits(ctx, extra); break;
+                        case 18: repeat = 11 + deflate_next_bits(ctx, extra); break;
+                        default: len = entry.value; break;
+                    }
+                    if (h->have + repeat > (size_t)h->nlen + h->ndist) {
+                        ctx->state = DEFLATE_ERROR;
+                        return false;
+                    }
+                    while (repeat-- > 0) h->lens[h->have ++] = len;
+                }
+
+                // Without an end of block code the block can never finish
+                if (h->lens[256] == 0 ||
+                        !deflate_huffman_build(DEFLATE_LENS, h->lens, h->nlen, DEFLATE_LENCODE_ROOT,
+                            h->lencode, DEFLATE_LENCODE_SIZE) ||
+                        !deflate_huffman_build(DEFLATE_DISTS, h->lens + h->nlen, h->ndist, DEFLATE_DISTCODE_ROOT,
+                            h->distcode, DEFLATE_DISTCODE_SIZE)) {
+                    ctx->state = DEFLATE_ERROR;
+                    return false;
+                }
+                h->lcode = h->lencode;
+                h->dcode = h->distcode;
+                h->lroot = DEFLATE_LENCODE_ROOT;
+                h->droot = DEFLATE_DISTCODE_ROOT;
+                ctx->state = DEFLATE_COMPRESSED_LITERAL;
+                return true;
             };
-                // fall through
-            case DEFLATE_COMPRESSED_FIXED_DISTANCE: {
-                uint16_t len = ctx->saved;
-                assert(len >= 3 && len <= 258);
-                // RFC 1951 - 3.2.6
-                uint8_t code = deflate_next_bits(ctx, 5);
-                if (code == (uint8_t)EOF) return EOF;
-                assert(code < 30);
-                // RFC 1951 - 3.2.5
-                if (code < 4) {
-                    ctx->saved = len << 16 | (code + 1);
-                    ctx->state = DEFLATE_COMPRESSED_FIXED_COPY;
+
+            default:
+                ZLIB_UNREACHABLE();
+                ctx->state = DEFLATE_ERROR;
+                return false;
+        }
+    }
+    ZLIB_UNREACHABLE();
+    ctx->state = DEFLATE_ERROR;
+    return false;
+}
+
+// Looks up the next code given enough bits of input in `hold`, setting `bits`
+// to the length of the code
+deflate_huffman_entry _deflate_huffman_lookup(const deflate_huffman_entry *table, uint8_t root, uint64_t hold, uint8_t *bits) {
+    deflate_huffman_entry entry = table[hold & ((1U << root) - 1)];
+    *bits = entry.bits;
+    if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_LINK) {
+        entry = table[entry.value + ((hold >> root) & ((1U << DEFLATE_HUFFMAN_EXTRA(entry)) - 1))];
+        *bits = root + entry.bits;
+    }
+    return entry;
+}
+
+// The longest a length and distance can be (RFC 1951 - 3.2.5), 15 bit codes
+// with 5 and 13 extra bits
+#define DEFLATE_FAST_BITS 48
+
+// Decodes symbols like _deflate_compressed, but without the checks for
+// running out of input or output or stopping part way through a symbol. It
+// keeps going while there are at least a word of input and room for the
+// longest match left, so every symbol can be decoded in one go (like zlib's
+// inflate_fast). Returns false on errors.
+bool _deflate_fast(deflate_context *ctx) {
+    deflate_huffman *h = &ctx->huffman;
+    deflate_bitstream *b = &ctx->bits;
+    size_t stop = _deflate_output_stop(ctx);
+    while (b->size >= 8 && ctx->out.size < stop) {
+        if (b->count < DEFLATE_FAST_BITS) _deflate_refill(ctx);
+        DEFLATE_ENSURE(ctx, DEFLATE_MAX_LENGTH + DEFLATE_OUT_SLACK);
+
+        uint8_t bits;
+        deflate_huffman_entry entry = _deflate_huffman_lookup(h->lcode, h->lroot, b->hold, &bits);
+        deflate_drop_bits(ctx, bits);
+        if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_LITERAL) {
+            ctx->out.data[ctx->out.size ++] = entry.value;
+            continue;
+        } else if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_END) {
+            ctx->state = DEFLATE_FINISHED;
+            return true;
+        } else if (DEFLATE_HUFFMAN_OP(entry) != DEFLATE_HUFFMAN_BASE) {
+            ctx->state = DEFLATE_ERROR;
+            return false;
+        }
+        uint8_t extra = DEFLATE_HUFFMAN_EXTRA(entry);
+        uint16_t len = entry.value + (b->hold & ((1U << extra) - 1));
+        deflate_drop_bits(ctx, extra);
+
+        entry = _deflate_huffman_lookup(h->dcode, h->droot, b->hold, &bits);
+        if (DEFLATE_HUFFMAN_OP(entry) != DEFLATE_HUFFMAN_BASE) {
+            ctx->state = DEFLATE_ERROR;
+            return false;
+        }
+        deflate_drop_bits(ctx, bits);
+        extra = DEFLATE_HUFFMAN_EXTRA(entry);
+        uint32_t dist = entry.value + (b->hold & ((1U << extra) - 1));
+        deflate_drop_bits(ctx, extra);
+
+        if (!_deflate_copy(ctx, len, dist)) return false;
+    }
+    return true;
+}
+
+bool _deflate_compressed(deflate_context *ctx) {
+    deflate_huffman *h = &ctx->huffman;
+    for (;;) {
+        _Static_assert(DEFLATE_ERROR == 13, "States have changed. May need handling here");
+        switch (ctx->state) {
+            case DEFLATE_COMPRESSED_LITERAL: {
+                if (ctx->out.size >= _deflate_output_stop(ctx)) {
+                    if (ctx->limit != 0 && ctx->out.size >= ctx->limit) return false;
+                    if (!deflate_flush(ctx)) return false;
+                }
+                if (ctx->bits.size >= 8) {
+                    if (!_deflate_fast(ctx)) return false;
+                    if (ctx->state == DEFLATE_FINISHED) return true;
+                    continue;
+                }
+
+                deflate_huffman_entry entry;
+                if (!_deflate_huffman_decode(ctx, h->lcode, h->lroot, &entry)) return false;
+
+                // RFC 1951 - 3.2.5. Compressed blocks (length and distance codes)
+                if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_LITERAL) {
+                    DEFLATE_APPEND(ctx, (uint8_t)entry.value);
                     break;
+                } else if (DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_END) {
+                    ctx->state = DEFLATE_FINISHED;
+                    return true;
                 }
+                assert(DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_BASE);
 
-                ctx->saved = len << 16 | code;
-                ctx->state = DEFLATE_COMPRESSED_FIXED_DISTANCE_EXTRA;
+                ctx->saved = entry.value;
+                ctx->extra = DEFLATE_HUFFMAN_EXTRA(entry);
+                ctx->state = DEFLATE_COMPRESSED_LENGTH_EXTRA;
             };
                 // fall through
-            case DEFLATE_COMPRESSED_FIXED_DISTANCE_EXTRA: {
-                uint16_t len = ctx->saved >> 16;
-                uint32_t dist = _deflate_fixed_compression_dist_extra(ctx);
-                if (dist == (uint32_t)EOF) return false;
-                assert(dist < 32768);
-
-                ctx->saved = len << 16 | dist;
-                ctx->state = DEFLATE_COMPRESSED_FIXED_COPY;
+            case DEFLATE_COMPRESSED_LENGTH_EXTRA: {
+                if (DEFLATE_BITS(ctx) < ctx->extra) return false;
+                ctx->saved += deflate_next_bits(ctx, ctx->extra);
+                ctx->state = DEFLATE_COMPRESSED_DISTANCE;
+            };
+                // fall through
+            case DEFLATE_COMPRESSED_DISTANCE: {
+                deflate_huffman_entry entry;
+                if (!_deflate_huffman_decode(ctx, h->dcode, h->droot, &entry)) return false;
+                assert(DEFLATE_HUFFMAN_OP(entry) == DEFLATE_HUFFMAN_BASE);
+
+                ctx->saved = ctx->saved << 16 | entry.value;
+                ctx->extra = DEFLATE_HUFFMAN_EXTRA(entry);
+                ctx->state = DEFLATE_COMPRESSED_DISTANCE_EXTRA;
             };
-                    // fall through
-            case DEFLATE_COMPRESSED_FIXED_COPY: {
+                // fall through
+            case DEFLATE_COMPRESSED_DISTANCE_EXTRA: {
+                if (DEFLATE_BITS(ctx) < ctx->extra) return false;
+                ctx->saved += deflate_next_bits(ctx, ctx->extra);
+                ctx->state = DEFLATE_COMPRESSED_COPY;
+            };
+                // fall through
+            case DEFLATE_COMPRESSED_COPY: {
                 uint16_t len = ctx->saved >> 16;
                 uint32_t dist = ctx->saved & 0xFFFF;
-                assert(dist <= ctx->out.size);
-                /* INFO("Current output at %lx, copying %d bytes from %d back\n", */
-                /*         ctx->out.size, len, dist); */
-                DEFLATE_ENSURE(ctx, len);
-                while (len > dist) {
-                    DEFLATE_APPEND_BYTES(ctx,
-                            ctx->out.data + ctx->out.size - dist,
-                            dist);
-                    len -= dist;
-                    dist *= 2;
-                }
-                if (len > 0) {
-                    DEFLATE_APPEND_BYTES(ctx,
-                            ctx->out.data + ctx->out.size - dist,
-                            len);
-                }
+                if (!_deflate_copy(ctx, len, dist)) return false;
 
-                ctx->state = DEFLATE_COMPRESSED_FIXED;
+                ctx->state = DEFLATE_COMPRESSED_LITERAL;
             }; break;
 
             default:
@@ -667,81 +1028,11 @@ bool _deflate_fixed_compression(deflate_context *ctx) {
     return false;
 }
 
-bool deflate_dynamic_compression_build_tree(deflate_context *ctx, huffman_tree *tree) {
-    // This may need the bits swapped?
-    // I was working through this, but turns out the reference implementation uses fixed for my input while stepping through debugger
-    ZLIB_UNIMPLENTED("");(void)ctx;(void)tree;return false;
-
-    /* uint8_t hlit = deflate_next_bits(ctx, 5); */
-    /* uint8_t hdist = deflate_next_bits(ctx, 5); */
-    /* uint8_t hclen = deflate_next_bits(ctx, 4); */
-    /* INFO("Deflating dynamic huffman code, hlit = %d hdist = %d hclen = %d\n", hlit, hdist, hclen); */
-    /* uint8_t code_lengths[19] = {0}; */
-    /* uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}; */
-    /* assert(C_ARRAY_LEN(order) == C_ARRAY_LEN(code_lengths)); */
-    /* assert((size_t)hclen + 4 <= C_ARRAY_LEN(code_lengths)); */
-    /* uint8_t max_code = 0; */
-    /* for (size_t i = 0 ; i < (size_t)hclen + 4; i ++) { */
-    /*     assert(order[i] < C_ARRAY_LEN(code_lengths)); */
-    /*     uint8_t code_len = deflate_next_bits(ctx, 3); */
-    /*     code_lengths[order[i]] = code_len; */
-    /*     if (code_len > 0 && order[i] > max_code) { */
-    /*         max_code = order[i]; */
-    /*     } */
-    /* } */
-    /* fprintf(stderr, "max_code %d\n", max_code); */
-    /* tree->data = calloc(max_code + 1, sizeof(huffman_tree)); */
-    /* if (tree->data == NULL) return false; */
-    /* tree->length = max_code + 1; */
-
-    /* for (size_t i = 0; i <= max_code; i ++) { */
-    /*     tree->data[i].length = code_lengths[i]; */
-    /* } */
-
-    /* /1* RFC 1951 - 3.2.2 - Step 1 *1/ */
-    /* uint8_t bl_count[8] = {0}; */
-    /* uint8_t max_bits = 0; */
-    /* for (size_t i = 0 ; i < C_ARRAY_LEN(code_lengths); i ++) { */
-    /*     if (code_lengths[i] == 0) continue; */
-    /*     assert(code_lengths[i] < C_ARRAY_LEN(bl_count)); */
-    /*     bl_count[code_lengths[i]] ++; */
-    /*     if (code_lengths[i] > max_bits) { */
-    /*         max_bits = code_lengths[i]; */
-    /*     } */
-
-    /*     fprintf(stderr, "code_lengths[%ld] = %d\n", i, code_lengths[i]); */
-    /* } */
-
-    /* /1* RFC 1951 - 3.2.2 - Step 2 *1/ */
-    /* uint64_t code = 0; */
-    /* uint64_t next_code[9] = {0}; */
-    /* assert(max_bits < C_ARRAY_LEN(next_code)); */
-    /* assert(max_bits <= C_ARRAY_LEN(bl_count)); */
-    /* bl_count[0] = 0; */
-    /* for (uint8_t bits = 1; bits <= max_bits; bits ++) { */
-    /*     code = (code + bl_count[bits - 1]) << 1; */
-    /*     next_code[bits] = code; */
-
-    /*     fprintf(stderr, "next_code[%d] = 0x%02lx\n", bits, next_code[bits]); */
-    /* } */
-
-    /* /1* RFC 1951 - 3.2.2 - Step 3 *1/ */
-    /* for (uint8_t n = 0; n <= max_code; n ++) { */
-    /*     uint8_t len = tree->data[n].length; */
-    /*     if (len > 0) { */
-    /*         tree->data[n].code = next_code[len]; */
-    /*         next_code[len] ++; */
-    /*     } */
-    /* } */
-    /* UNIMPLENTED(""); */
-    /* return false; */
-}
-
 bool _deflate_header(deflate_context *ctx) {
     assert(ctx->state == DEFLATE_HEADER);
     if (DEFLATE_BITS(ctx) < 3) return false;
     ctx->last = deflate_next_bits(ctx, 1) == 0x1;
-    uint8_t btype = deflate_next_bits_rev(ctx, 2);
+    uint8_t btype = deflate_next_bits(ctx, 2);
 
     /* INFO("Deflating block, bfinal = %d, btype = %x\n", bfinal, btype); */
     assert(btype <= DEFLATE_RESERVED);
@@ -770,30 +1061,30 @@ bool deflate_block(deflate_context *ctx) {
             case DEFLATE_UNCOMPRESSED_DATA:
                 return _deflate_uncompressed(ctx);
 
-            case DEFLATE_COMPRESSED_DYNAMIC: {
-                                                 /* FIXME make sure this works with state machine */
-                ZLIB_UNIMPLENTED("Dynamic huffman tree");
-                /* huffman_tree tree = {0}; */
-                /* if (!deflate_dynamic_compression_build_tree(ctx, &tree)) return false; */
-
-                /* INFO("Huffman tree of dynamic compression\n"); */
-                /* for (size_t i = 0; i < tree.length; i ++) { */
-                /*     fprintf(stderr, "Tree[%ld] = {.length = %ld, .code = 0x%02lx}\n", */
-                /*             i, tree.data[i].length, tree.data[i].code); */
-                /* } */
-
-                /* free(tree.data); */
-            }; break;
+            case DEFLATE_COMPRESSED_DYNAMIC:
+            case DEFLATE_COMPRESSED_DYNAMIC_CODES:
+            case DEFLATE_COMPRESSED_DYNAMIC_TREES:
+                if (!_deflate_dynamic_tables(ctx)) return false;
+                break;
 
             case DEFLATE_COMPRESSED_FIXED:
-            case DEFLATE_COMPRESSED_FIXED_LENGTH:
-            case DEFLATE_COMPRESSED_FIXED_LENGTH_EXTRA:
-            case DEFLATE_COMPRESSED_FIXED_DISTANCE:
-            case DEFLATE_COMPRESSED_FIXED_DISTANCE_EXTRA:
-            case DEFLATE_COMPRESSED_FIXED_COPY:
-                return _deflate_fixed_compression(ctx);
+                _deflate_fixed_tables();
+                ctx->huffman.lcode = _deflate_fixed_lencode;
+                ctx->huffman.dcode = _deflate_fixed_distcode;
+                ctx->huffman.lroot = DEFLATE_FIXED_LENCODE_ROOT;
+                ctx->huffman.droot = DEFLATE_FIXED_DISTCODE_ROOT;
+                ctx->state = DEFLATE_COMPRESSED_LITERAL;
+                break;
+
+            case DEFLATE_COMPRESSED_LITERAL:
+            case DEFLATE_COMPRESSED_LENGTH_EXTRA:
+            case DEFLATE_COMPRESSED_DISTANCE:
+            case DEFLATE_COMPRESSED_DISTANCE_EXTRA:
+            case DEFLATE_COMPRESSED_COPY:
+                return _deflate_compressed(ctx);
 
             case DEFLATE_FINISHED: return true;
+            case DEFLATE_ERROR: return false;
 
             default:
                 ZLIB_UNIMPLENTED("ctx->state = %d", ctx->state);
@@ -803,13 +1094,168 @@ bool deflate_block(deflate_context *ctx) {
 }
 
 bool deflate(deflate_context *ctx) {
-    while (!ctx->last) {
-        if (ctx->state == DEFLATE_FINISHED) ctx->state = DEFLATE_HEADER;
-        if (!deflate_block(ctx)) return false;
+    for (;;) {
+        if (ctx->state == DEFLATE_FINISHED) {
+            if (ctx->last) return deflate_flush(ctx);
+            ctx->state = DEFLATE_HEADER;
+        }
+        if (!deflate_block(ctx)) {
+            // Hold on to any input that's left, so the caller can move on to
+            // the next chunk of the stream
+            _deflate_refill(ctx);
+            return false;
+        }
     }
-    return true;
 }
 
+// RFC 1950 - 8.2 Adler-32
+#define ZLIB_ADLER_BASE 65521
+// Most bytes that can be summed before s2 could overflow 32 bits
+#define ZLIB_ADLER_NMAX 5552
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(__TINYC__)
+#define ZLIB_X86_SIMD
+#include <immintrin.h>
+#endif
+
+uint32_t _zlib_adler32_scalar(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+    while (size > 0) {
+        // The modulo is only needed every NMAX bytes
+        size_t n = size < ZLIB_ADLER_NMAX ? size : ZLIB_ADLER_NMAX;
+        size -= n;
+        while (n-- > 0) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= ZLIB_ADLER_BASE;
+        s2 %= ZLIB_ADLER_BASE;
+    }
+    return s2 << 16 | s1;
+}
+
+#ifdef ZLIB_X86_SIMD
+// The vector kernels sum a block of bytes at a time. Over n blocks of B
+// bytes, s1 gains the sum of every byte, and s2 gains n*B*s1 plus B times
+// the running s1 at the start of each block, plus each byte weighted by how
+// far it is from the end of its block.
+
+uint32_t _zlib_hsum_epi32(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+uint32_t _zlib_adler32_sse2(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    while (size >= 16) {
+        size_t blocks = (size < ZLIB_ADLER_NMAX ? size : ZLIB_ADLER_NMAX) / 16;
+        size -= blocks * 16;
+        s2 += s1 * blocks * 16;
+        __m128i vs1 = zero, vps = zero, vs2 = zero;
+        while (blocks-- > 0) {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+            vps = _mm_add_epi32(vps, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weights_lo));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weights_hi));
+            data += 16;
+        }
+        s1 += _zlib_hsum_epi32(vs1);
+        s2 += _zlib_hsum_epi32(vps) * 16 + _zlib_hsum_epi32(vs2);
+        s1 %= ZLIB_ADLER_BASE;
+        s2 %= ZLIB_ADLER_BASE;
+    }
+    return _zlib_adler32_scalar(s2 << 16 | s1, data, size);
+}
+
+__attribute__((target("avx2")))
+uint32_t _zlib_hsum256_epi32(__m256i v) {
+    return _zlib_hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+uint32_t _zlib_adler32_avx2(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i weights = _mm256_setr_epi8(
+            32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+            16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    while (size >= 32) {
+        size_t blocks = (size < ZLIB_ADLER_NMAX ? size : ZLIB_ADLER_NMAX) / 32;
+        size -= blocks * 32;
+        s2 += s1 * blocks * 32;
+        __m256i vs1 = zero, vps = zero, vs2 = zero;
+        while (blocks-- > 0) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)data);
+            vps = _mm256_add_epi32(vps, vs1);
+            vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(bytes, zero));
+            vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+            data += 32;
+        }
+        s1 += _zlib_hsum256_epi32(vs1);
+        s2 += _zlib_hsum256_epi32(vps) * 32 + _zlib_hsum256_epi32(vs2);
+        s1 %= ZLIB_ADLER_BASE;
+        s2 %= ZLIB_ADLER_BASE;
+    }
+    return _zlib_adler32_sse2(s2 << 16 | s1, data, size);
+}
+#endif // ZLIB_X86_SIMD
+
+// Continues an Adler-32 from a previous value (1 to start), with the
+// fastest kernel this CPU supports
+uint32_t zlib_adler32(uint32_t adler, const uint8_t *data, size_t size) {
+    static uint32_t (*impl)(uint32_t, const uint8_t *, size_t) = NULL;
+    if (impl == NULL) {
+        uint32_t (*picked)(uint32_t, const uint8_t *, size_t) = _zlib_adler32_scalar;
+#ifdef ZLIB_X86_SIMD
+        __builtin_cpu_init();
+        picked = __builtin_cpu_supports("avx2") ? _zlib_adler32_avx2 : _zlib_adler32_sse2;
+#endif
+        impl = picked;
+    }
+    return impl(adler, data, size);
+}
+
+// Checksums the uncompressed data as it goes through, while it is still in
+// cache, before passing it on to the caller's sink
+bool _zlib_sink(void *data, const uint8_t *buf, size_t size) {
+    zlib_context *ctx = data;
+    ctx->adler = zlib_adler32(ctx->adler, buf, size);
+    return ctx->sink == NULL || ctx->sink(ctx->sink_data, buf, size);
+}
+
+// Input bytes not used (yet) by the stream. Once it has finished, these are
+// whatever follows it, e.g. the next object in a pack. The bits left over in
+// the stream's last byte are padding, so that byte counts as used.
+size_t deflate_unused(const deflate_context *ctx) {
+    return DEFLATE_BYTES(ctx);
+}
+
+// Decompresses a single raw DEFLATE stream (RFC 1951, no zlib header or
+// checksum) from the start of `data`, appending the output to `ctx->out` (or
+// handing it to the sink). `consumed` is set to exactly how many bytes of
+// `data` the stream took, so streams that are back to back can be read
+// straight out of one buffer. Returns false if the stream is corrupt, or
+// `data` ends before it does.
+bool deflate_raw(deflate_context *ctx, const uint8_t *data, size_t size, size_t *consumed) {
+    ctx->state = DEFLATE_HEADER;
+    ctx->bits = (deflate_bitstream){ .data = (uint8_t *)data, .size = size };
+    ctx->last = false;
+    ctx->flushed = ctx->out.size;
+    bool ret = deflate(ctx);
+    *consumed = size - deflate_unused(ctx);
+    return ret;
+}
+
+#ifndef ZLIB_BACKEND
 bool zlib_decompress(zlib_context *ctx) {
     assert(ctx != NULL);
     for (;;) {
@@ -817,34 +1263,48 @@ bool zlib_decompress(zlib_context *ctx) {
         switch (ctx->state) {
             case ZLIB_HEADER: {
                 DEFLATE_CLEAR_BITS(&ctx->deflate);
-                if (DEFLATE_BYTES(&ctx->deflate) < 2) return false;
+                if (DEFLATE_BYTES(&ctx->deflate) < 2) {
+                    _deflate_refill(&ctx->deflate);
+                    return false;
+                }
 
                 uint8_t cmf = deflate_next_bytes(&ctx->deflate, 1);
 
                 uint8_t cm = cmf & 0xF;
                 uint8_t cinfo = (cmf & 0xF0) >> 4;
 
-                assert(cm == 8);
-                assert(cinfo <= 7);
-                if (cinfo != 7) ZLIB_UNIMPLENTED("Reading different window sizes than 32K");
-
                 uint8_t flg = deflate_next_bytes(&ctx->deflate, 1);
                 uint16_t check = (uint16_t)cmf * 256 + (uint16_t)flg;
-                assert(check % 31 == 0);
+
+                // Anything but deflate with up to a 32K window is corrupt
+                // (RFC 1950 - 2.2). Smaller windows decode just the same
+                if (cm != 8 || cinfo > 7 || check % 31 != 0) {
+                    ctx->state = ZLIB_ERROR;
+                    return false;
+                }
 
                 uint8_t fdict = (flg >> 5) & 0x1;
                 uint8_t flevel = (flg >> 6) & 0x3;
                 assert(flevel <= ZLIB_MAX_COMPRESSOR);
 
-                if (flevel != 0) {
-                    ZLIB_WARN("FLEVEL not 0. Not used in decompression, but useful for recompression. Ignoring value (%d)\n", flevel);
-                }
+                // FLEVEL is not used in decompression, but useful for recompression
+                /* if (flevel != 0) { */
+                /*     ZLIB_WARN("FLEVEL not 0. Ignoring value (%d)\n", flevel); */
+                /* } */
+                ctx->flevel = flevel;
+                ctx->adler = 1;
+                ctx->deflate.sink = _zlib_sink;
+                ctx->deflate.sink_data = ctx;
+                // Without a sink of our own, all the output is collected
+                ctx->deflate.keep = ctx->sink == NULL;
                 ctx->state = fdict != 0 ? ZLIB_DICT : ZLIB_DEFLATE;
             }; break;
 
             case ZLIB_DICT:
-                ZLIB_UNIMPLENTED("Reading zlib DICTID (see RFC 1950 2.2 Data format)");
-                break; // potentially should fall through?
+                // Nothing can give a preset dictionary (RFC 1950 - 2.2), so
+                // a stream that needs one can't be read
+                ctx->state = ZLIB_ERROR;
+                return false;
 
             case ZLIB_DEFLATE:
                 if (!deflate(&ctx->deflate)) {
@@ -856,18 +1316,14 @@ bool zlib_decompress(zlib_context *ctx) {
                 ctx->state = ZLIB_ADLER;
                 // fall through
             case ZLIB_ADLER: {
-                uint16_t s1 = 1;
-                uint16_t s2 = 0;
-                for (size_t i = 0; i < ctx->deflate.out.size; i ++) {
-                    s1 = ((uint32_t)s1 + ctx->deflate.out.data[i]) % 65521;
-                    s2 = ((uint32_t)s2 + s1) % 65521;
+                if (DEFLATE_BYTES(&ctx->deflate) < 4) {
+                    _deflate_refill(&ctx->deflate);
+                    return false;
                 }
 
-                if (DEFLATE_BYTES(&ctx->deflate) < 4) return false;
-
                 DEFLATE_CLEAR_BITS(&ctx->deflate);
                 uint32_t adler = deflate_next_bytes(&ctx->deflate, 4);
-                if (htonl(adler) != (uint32_t)s2 * 65536 + (uint32_t)s1) {
+                if (htonl(adler) != ctx->adler) {
                     ctx->state = ZLIB_ERROR;
                     return false;
                 }
@@ -885,22 +1341,1226 @@ bool zlib_decompress(zlib_context *ctx) {
     ZLIB_UNREACHABLE();
     return false;
 }
+#endif // ZLIB_BACKEND
+
+
+// log2(x) for x >= 1, in 16.16 fixed point. Each squaring of the mantissa
+// gives the next fractional bit.
+uint32_t _zlib_log2(uint32_t x) {
+    uint32_t ip = 0;
+    while ((x >> ip) > 1) ip ++;
+    uint64_t m = ((uint64_t)x << 31) >> ip; // [1, 2) as 1.31
+    uint32_t r = ip << 16;
+    for (int bit = 15; bit >= 0; bit --) {
+        m = (m * m) >> 31;
+        if (m >= (uint64_t)1 << 32) {
+            m >>= 1;
+            r |= 1u << bit;
+        }
+    }
+    return r;
+}
+
+// RFC 1951 - 4. Compression algorithm details
+// LZ77 with hash chains over the last 32K of input, like zlib's deflate
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_WINDOW_MASK (INFLATE_WINDOW_SIZE - 1)
+#define INFLATE_HASH_BITS 15
+#define INFLATE_HASH_SIZE (1 << INFLATE_HASH_BITS)
+#define INFLATE_MIN_MATCH 3
+#define INFLATE_MAX_MATCH 258
+// Short matches far away cost more than the literals they replace
+#define INFLATE_TOO_FAR 4096
+// Symbols buffered before a block is written out
+#define INFLATE_BLOCK_SYMBOLS (1 << 15)
+#define INFLATE_MAX_STORED 65535
+// RFC 1951 - 3.2.7 Alphabet sizes and code length limits for dynamic blocks
+#define INFLATE_LITERALS 286
+#define INFLATE_DISTANCES 30
+#define INFLATE_CODECODES 19
+#define INFLATE_MAX_BITS 15
+#define INFLATE_MAX_CODECODE_BITS 7
+// Blocks aren't split any smaller than this many symbols, as each dynamic
+// block header costs around 60 bytes
+#define INFLATE_MIN_SPLIT 1024
 
+typedef struct {
+    uint16_t good;  // Search less hard once we have a match this long
+    uint16_t lazy;  // Don't look for a better match at the next byte past this (0 is greedy)
+    uint16_t nice;  // Stop searching once we have a match this long
+    uint16_t chain; // Max number of hash chain entries to check
+    uint16_t iterations; // Passes of optimal parsing over each segment (0 to match lazily or greedily)
+} inflate_config;
+
+// Same trade offs as zlib's levels 1, 5 and 6, which are what it reports as
+// FLEVEL 0-2 (RFC 1950 - 2.2). The max level goes further than zlib's 9,
+// parsing optimally like zopfli.
+const inflate_config _inflate_configs[] = {
+    [ZLIB_FASTEST_COMPRESSOR] = { .good = 4, .lazy = 0, .nice = 8, .chain = 4 },
+    [ZLIB_FAST_COMPRESSOR] = { .good = 8, .lazy = 16, .nice = 32, .chain = 32 },
+    [ZLIB_DEFAULT_COMPRESSOR] = { .good = 8, .lazy = 16, .nice = 128, .chain = 128 },
+    [ZLIB_MAX_COMPRESSOR] = { .good = 32, .lazy = 258, .nice = 258, .chain = 4096, .iterations = 10 },
+};
+
+typedef struct {
+    deflate_context *ctx;
+    inflate_config config;
+
+    // Output bits not yet written to ctx->out, lowest bit first
+    uint64_t hold;
+    uint8_t count;
+
+    // Most recent position for each hash, and the previous position with the
+    // same hash for each position in the window. Positions are truncated to
+    // 32 bits, which is fine as every candidate is checked against the input.
+    uint32_t *head;
+    uint32_t *prev;
+
+    // LZ77 output of the current block. A distance of 0 is a literal
+    uint16_t *dists;
+    uint16_t *lens;
+    size_t symbols;
+    size_t block_start;
+    size_t block_end;
+} inflate_state;
+
+// Huffman codes for the encoder, bits already reversed to stream order
+typedef struct {
+    uint16_t code;
+    uint8_t bits;
+} inflate_code;
+
+inflate_code _inflate_fixed_litcode[288];
+inflate_code _inflate_fixed_distcode[30];
+// Symbols (minus 257 / minus 0) for each match length and distance
+uint8_t _inflate_length_symbol[INFLATE_MAX_MATCH + 1];
+uint8_t _inflate_dist_symbol[512];
+
+void _inflate_tables(void) {
+    static bool built = false;
+    if (built) return;
+
+    // RFC 1951 - 3.2.6
+    for (uint16_t sym = 0; sym < 288; sym ++) {
+        uint16_t code;
+        uint8_t bits;
+        if (sym < 144) {
+            code = 0x30 + sym;
+            bits = 8;
+        } else if (sym < 256) {
+            code = 0x190 + sym - 144;
+            bits = 9;
+        } else if (sym < 280) {
+            code = sym - 256;
+            bits = 7;
+        } else {
+            code = 0xC0 + sym - 280;
+            bits = 8;
+        }
+        _inflate_fixed_litcode[sym] = (inflate_code){ .code = deflate_reverse_bits(code, bits), .bits = bits };
+    }
+    for (uint16_t sym = 0; sym < 30; sym ++) {
+        _inflate_fixed_distcode[sym] = (inflate_code){ .code = deflate_reverse_bits(sym, 5), .bits = 5 };
+    }
 
-bool inflate(deflate_context *ctx) {
-    // Very naive, don't compress at all
+    for (size_t sym = 0; sym < ZLIB_C_ARRAY_LEN(_deflate_length_base); sym ++) {
+        uint16_t end = sym + 1 < ZLIB_C_ARRAY_LEN(_deflate_length_base) ? _deflate_length_base[sym + 1] : INFLATE_MAX_MATCH + 1;
+        for (uint16_t len = _deflate_length_base[sym]; len < end; len ++) {
+            _inflate_length_symbol[len] = sym;
+        }
+    }
+    // 258 has its own code (285) even though 284 could also encode it
+    _inflate_length_symbol[INFLATE_MAX_MATCH] = ZLIB_C_ARRAY_LEN(_deflate_length_base) - 1;
+
+    // Distances up to 256 are looked up directly, after that in steps of 128
+    for (size_t sym = 0; sym < ZLIB_C_ARRAY_LEN(_deflate_dist_base); sym ++) {
+        uint32_t end = sym + 1 < ZLIB_C_ARRAY_LEN(_deflate_dist_base) ? _deflate_dist_base[sym + 1] : INFLATE_WINDOW_SIZE + 1;
+        for (uint32_t dist = _deflate_dist_base[sym]; dist < end; dist ++) {
+            if (dist <= 256) {
+                _inflate_dist_symbol[dist - 1] = sym;
+            } else {
+                _inflate_dist_symbol[256 + ((dist - 1) >> 7)] = sym;
+            }
+        }
+    }
+    built = true;
+}
+
+uint8_t _inflate_dist_code(uint16_t dist) {
+    return dist <= 256 ? _inflate_dist_symbol[dist - 1] : _inflate_dist_symbol[256 + ((dist - 1) >> 7)];
+}
+
+void _inflate_put_bits(inflate_state *st, uint32_t value, uint8_t bits) {
+    assert(bits <= 32);
+    st->hold |= (uint64_t)value << st->count;
+    st->count += bits;
+    if (st->count >= 32) {
+        uint32_t word = htole32((uint32_t)st->hold);
+        DEFLATE_APPEND_BYTES(st->ctx, &word, 4);
+        st->hold >>= 32;
+        st->count -= 32;
+    }
+}
+
+// Pads the output to a whole byte and writes out everything held
+void _inflate_flush_bits(inflate_state *st) {
+    while (st->count > 0) {
+        DEFLATE_APPEND(st->ctx, st->hold & 0xFF);
+        st->hold >>= 8;
+        st->count = st->count > 8 ? st->count - 8 : 0;
+    }
+    st->hold = 0;
+}
 
-    DEFLATE_APPEND(ctx, 0x01); // final, no compression
-    uint16_t len = ctx->in.size;
-    DEFLATE_APPEND(ctx, (uint8_t)len);
-    DEFLATE_APPEND(ctx, (uint8_t)(len >> 8));
-    DEFLATE_APPEND(ctx, (uint8_t)~len);
-    DEFLATE_APPEND(ctx, (uint8_t)(~len >> 8));
-    DEFLATE_APPEND_BYTES(ctx, ctx->in.data, ctx->in.size);
+void _inflate_put_code(inflate_state *st, inflate_code code) {
+    _inflate_put_bits(st, code.code, code.bits);
+}
+
+// RFC 1951 - 3.2.4 Non-compressed blocks (BTYPE=00)
+void _inflate_stored_blocks(inflate_state *st, const uint8_t *data, size_t size, bool last) {
+    do {
+        uint16_t len = size > INFLATE_MAX_STORED ? INFLATE_MAX_STORED : size;
+        bool final = last && len == size;
+        _inflate_put_bits(st, (final ? 1 : 0) | (DEFLATE_NO_COMPRESSION << 1), 3);
+        _inflate_flush_bits(st);
+        DEFLATE_APPEND(st->ctx, (uint8_t)len);
+        DEFLATE_APPEND(st->ctx, (uint8_t)(len >> 8));
+        DEFLATE_APPEND(st->ctx, (uint8_t)~len);
+        DEFLATE_APPEND(st->ctx, (uint8_t)(~len >> 8));
+        DEFLATE_APPEND_BYTES(st->ctx, data, len);
+        data += len;
+        size -= len;
+    } while (size > 0);
+}
+
+size_t _inflate_stored_cost(size_t size) {
+    // Header and padding to a byte (at most), then LEN and NLEN per block
+    size_t blocks = size == 0 ? 1 : (size + INFLATE_MAX_STORED - 1) / INFLATE_MAX_STORED;
+    return blocks * (3 + 7 + 32) + size * 8;
+}
+
+// Symbol counts for a run of buffered symbols, and the input they cover
+typedef struct {
+    uint32_t lit[INFLATE_LITERALS];
+    uint32_t dist[INFLATE_DISTANCES];
+    size_t bytes;
+} inflate_histogram;
+
+void _inflate_histogram_add(inflate_state *st, size_t first, size_t last, inflate_histogram *h) {
+    for (size_t i = first; i < last; i ++) {
+        if (st->dists[i] == 0) {
+            h->lit[st->lens[i]] ++;
+            h->bytes ++;
+        } else {
+            h->lit[257 + _inflate_length_symbol[st->lens[i]]] ++;
+            h->dist[_inflate_dist_code(st->dists[i])] ++;
+            h->bytes += st->lens[i];
+        }
+    }
+}
+
+typedef struct {
+    uint32_t freq;
+    uint16_t sym;
+} inflate_leaf;
+
+// Sorts leaves by frequency with two radix passes, which is stable so equal
+// frequencies stay in symbol order. Blocks never hold enough symbols for a
+// frequency to need more than 16 bits.
+_Static_assert(INFLATE_BLOCK_SYMBOLS < 0xFFFF, "Leaf frequencies need more than 16 bits");
+void _inflate_sort_leaves(inflate_leaf *leaves, inflate_leaf *tmp, size_t n) {
+    for (size_t shift = 0; shift < 16; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < n; i ++) offsets[(leaves[i].freq >> shift) & 0xFF] ++;
+        size_t total = 0;
+        for (size_t b = 0; b < 256; b ++) {
+            size_t count = offsets[b];
+            offsets[b] = total;
+            total += count;
+        }
+        for (size_t i = 0; i < n; i ++) tmp[offsets[(leaves[i].freq >> shift) & 0xFF] ++] = leaves[i];
+        memcpy(leaves, tmp, n * sizeof(*leaves));
+    }
+}
+
+// Huffman code lengths for `freq`, no longer than `maxbits`. Lengths come from
+// Moffat and Katajainen's in place algorithm, then any that are too long are
+// pushed down and the tree rebalanced by lengthening the shortest codes that
+// can take it (like miniz). At least two symbols always get a code, so every
+// code is complete, even for blocks with no matches.
+void _inflate_build_lengths(const uint32_t *freq, size_t n, uint8_t maxbits, uint8_t *lens) {
+    inflate_leaf leaves[INFLATE_LITERALS], tmp[INFLATE_LITERALS];
+    uint32_t a[INFLATE_LITERALS];
+    size_t used = 0;
+    assert(n >= 2 && n <= INFLATE_LITERALS);
+    for (size_t sym = 0; sym < n; sym ++) {
+        lens[sym] = 0;
+        if (freq[sym] > 0) leaves[used ++] = (inflate_leaf){ .freq = freq[sym], .sym = sym };
+    }
+    for (size_t sym = 0; used < 2 && sym < n; sym ++) {
+        if (freq[sym] == 0) leaves[used ++] = (inflate_leaf){ .freq = 1, .sym = sym };
+    }
+    _inflate_sort_leaves(leaves, tmp, used);
+    // The padding above needs n >= 2, which release builds can't see
+    a[0] = a[1] = 0;
+    for (size_t i = 0; i < used; i ++) a[i] = leaves[i].freq;
+
+    // Build the tree: internal nodes replace the leaves they merge, pointing
+    // to their parent, then depths are worked out from the root down
+    assert(used >= 2);
+    size_t root = 0, leaf = 2;
+    a[0] += a[1];
+    for (size_t next = 1; next < used - 1; next ++) {
+        if (leaf >= used || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root ++] = next;
+        } else {
+            a[next] = a[leaf ++];
+        }
+        if (leaf >= used || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root ++] = next;
+        } else {
+            a[next] += a[leaf ++];
+        }
+    }
+    a[used - 2] = 0;
+    for (size_t next = used - 2; next-- > 0;) a[next] = a[a[next]] + 1;
+    {
+        size_t avail = 1, count = 0, depth = 0;
+        size_t node = used - 1; // One past the next internal node to look at
+        size_t next = used;     // One past the next leaf to give a depth to
+        while (avail > 0) {
+            while (node > 0 && a[node - 1] == depth) {
+                count ++;
+                node --;
+            }
+            while (avail > count) {
+                a[-- next] = depth;
+                avail --;
+            }
+            avail = 2 * count;
+            depth ++;
+            count = 0;
+        }
+    }
+
+    // a[i] is now the length for leaves[i], longest first
+    uint32_t count[INFLATE_MAX_BITS + 1] = {0};
+    assert(maxbits <= INFLATE_MAX_BITS);
+    for (size_t i = 0; i < used; i ++) count[a[i] > maxbits ? maxbits : a[i]] ++;
+    uint32_t total = 0;
+    for (size_t len = 1; len <= maxbits; len ++) total += count[len] << (maxbits - len);
+    while (total != (1U << maxbits)) {
+        count[maxbits] --;
+        for (size_t len = maxbits - 1; len > 0; len --) {
+            if (count[len] > 0) {
+                count[len] --;
+                count[len + 1] += 2;
+                break;
+            }
+        }
+        total --;
+    }
+    size_t i = 0;
+    for (size_t len = maxbits; len > 0; len --) {
+        for (uint32_t k = 0; k < count[len]; k ++) lens[leaves[i ++].sym] = len;
+    }
+}
+
+// RFC 1951 - 3.2.2 Canonical codes for the given lengths
+void _inflate_build_codes(const uint8_t *lens, size_t n, inflate_code *codes) {
+    uint16_t count[INFLATE_MAX_BITS + 1] = {0};
+    for (size_t sym = 0; sym < n; sym ++) count[lens[sym]] ++;
+    uint16_t next_code[INFLATE_MAX_BITS + 1] = {0};
+    uint16_t code = 0;
+    count[0] = 0;
+    for (size_t len = 1; len <= INFLATE_MAX_BITS; len ++) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+    for (size_t sym = 0; sym < n; sym ++) {
+        uint8_t len = lens[sym];
+        codes[sym] = (inflate_code){
+            .code = len == 0 ? 0 : deflate_reverse_bits(next_code[len] ++, len),
+            .bits = len,
+        };
+    }
+}
+
+// Codes for a dynamic block and its header (RFC 1951 - 3.2.7)
+typedef struct {
+    uint8_t lens[INFLATE_LITERALS + INFLATE_DISTANCES];
+    inflate_code litcode[INFLATE_LITERALS];
+    inflate_code distcode[INFLATE_DISTANCES];
+    uint16_t nlit;
+    uint8_t ndist;
+    uint8_t ncode;
+
+    // Code lengths, run length encoded with symbols 16, 17 and 18
+    uint8_t rle[INFLATE_LITERALS + INFLATE_DISTANCES];
+    uint8_t rle_extra[INFLATE_LITERALS + INFLATE_DISTANCES];
+    size_t nrle;
+    uint8_t codelens[INFLATE_CODECODES];
+    inflate_code codecode[INFLATE_CODECODES];
+
+    // Bits for everything after BTYPE up to the first symbol
+    size_t header_bits;
+} inflate_tree;
+
+const uint8_t _inflate_codecode_extra[INFLATE_CODECODES] = { [16] = 2, [17] = 3, [18] = 7 };
+
+void _inflate_rle_push(inflate_tree *t, uint8_t sym, uint8_t extra) {
+    t->rle[t->nrle] = sym;
+    t->rle_extra[t->nrle] = extra;
+    t->nrle ++;
+}
+
+void _inflate_dynamic_tree(const inflate_histogram *h, inflate_tree *t) {
+    uint8_t *litlens = t->lens;
+    uint8_t distlens[INFLATE_DISTANCES];
+    // Every block ends with exactly one end of block code
+    uint32_t litfreq[INFLATE_LITERALS];
+    memcpy(litfreq, h->lit, sizeof(litfreq));
+    litfreq[256] = 1;
+    _inflate_build_lengths(litfreq, INFLATE_LITERALS, INFLATE_MAX_BITS, litlens);
+    _inflate_build_lengths(h->dist, INFLATE_DISTANCES, INFLATE_MAX_BITS, distlens);
+    // Only the lengths are needed to pick a block type, the codes themselves
+    // are filled in if the block gets written
+    for (size_t sym = 0; sym < INFLATE_LITERALS; sym ++) t->litcode[sym] = (inflate_code){ .bits = litlens[sym] };
+    for (size_t sym = 0; sym < INFLATE_DISTANCES; sym ++) t->distcode[sym] = (inflate_code){ .bits = distlens[sym] };
+
+    t->nlit = INFLATE_LITERALS;
+    while (t->nlit > 257 && litlens[t->nlit - 1] == 0) t->nlit --;
+    t->ndist = INFLATE_DISTANCES;
+    while (t->ndist > 1 && distlens[t->ndist - 1] == 0) t->ndist --;
+    // The literal/length and distance lengths form a single sequence, and
+    // runs are allowed to cross between them
+    memcpy(t->lens + t->nlit, distlens, t->ndist);
+
+    t->nrle = 0;
+    size_t total = t->nlit + t->ndist;
+    for (size_t i = 0; i < total;) {
+        uint8_t len = t->lens[i];
+        size_t run = 1;
+        while (i + run < total && t->lens[i + run] == len) run ++;
+        i += run;
+        if (len == 0) {
+            while (run >= 11) {
+                size_t r = run > 138 ? 138 : run;
+                _inflate_rle_push(t, 18, r - 11);
+                run -= r;
+            }
+            if (run >= 3) {
+                _inflate_rle_push(t, 17, run - 3);
+                run = 0;
+            }
+        } else if (run >= 4) {
+            _inflate_rle_push(t, len, 0);
+            run --;
+            while (run >= 3) {
+                size_t r = run > 6 ? 6 : run;
+                _inflate_rle_push(t, 16, r - 3);
+                run -= r;
+            }
+        }
+        while (run-- > 0) _inflate_rle_push(t, len, 0);
+    }
+
+    uint32_t freq[INFLATE_CODECODES] = {0};
+    for (size_t i = 0; i < t->nrle; i ++) freq[t->rle[i]] ++;
+    _inflate_build_lengths(freq, INFLATE_CODECODES, INFLATE_MAX_CODECODE_BITS, t->codelens);
+    t->ncode = INFLATE_CODECODES;
+    while (t->ncode > 4 && t->codelens[_deflate_codecode_order[t->ncode - 1]] == 0) t->ncode --;
+
+    t->header_bits = 5 + 5 + 4 + 3 * t->ncode;
+    for (size_t sym = 0; sym < INFLATE_CODECODES; sym ++) {
+        t->header_bits += freq[sym] * (t->codelens[sym] + _inflate_codecode_extra[sym]);
+    }
+}
+
+// Bits for the symbols in `h` with the given codes, including end of block
+// but not the block header
+size_t _inflate_symbols_cost(const inflate_histogram *h, const inflate_code *litcode, const inflate_code *distcode) {
+    size_t bits = litcode[256].bits;
+    for (size_t sym = 0; sym < 256; sym ++) bits += h->lit[sym] * litcode[sym].bits;
+    for (size_t sym = 0; sym < ZLIB_C_ARRAY_LEN(_deflate_length_extra); sym ++) {
+        bits += h->lit[257 + sym] * (litcode[257 + sym].bits + _deflate_length_extra[sym]);
+    }
+    for (size_t sym = 0; sym < INFLATE_DISTANCES; sym ++) {
+        bits += h->dist[sym] * (distcode[sym].bits + _deflate_dist_extra[sym]);
+    }
+    return bits;
+}
+
+typedef struct {
+    deflate_t type;
+    size_t bits;
+} inflate_block_choice;
+
+// Picks whichever block type writes `h` in the fewest bits, filling in `t`
+// when that is a dynamic block
+inflate_block_choice _inflate_choose_block(const inflate_histogram *h, inflate_tree *t) {
+    inflate_block_choice choice = {
+        .type = DEFLATE_FIXED_COMPRESSION,
+        .bits = 3 + _inflate_symbols_cost(h, _inflate_fixed_litcode, _inflate_fixed_distcode),
+    };
+    _inflate_dynamic_tree(h, t);
+    size_t dynamic = 3 + t->header_bits + _inflate_symbols_cost(h, t->litcode, t->distcode);
+    if (dynamic < choice.bits) choice = (inflate_block_choice){ .type = DEFLATE_DYNAMIC_COMPRESSION, .bits = dynamic };
+    size_t stored = _inflate_stored_cost(h->bytes);
+    if (h->bytes > 0 && stored < choice.bits) choice = (inflate_block_choice){ .type = DEFLATE_NO_COMPRESSION, .bits = stored };
+    return choice;
+}
+
+void _inflate_compressed_symbols(inflate_state *st, size_t first, size_t last, const inflate_code *litcode, const inflate_code *distcode) {
+    for (size_t i = first; i < last; i ++) {
+        if (st->dists[i] == 0) {
+            _inflate_put_code(st, litcode[st->lens[i]]);
+        } else {
+            uint16_t len = st->lens[i];
+            uint16_t dist = st->dists[i];
+            uint8_t lsym = _inflate_length_symbol[len];
+            uint8_t dsym = _inflate_dist_code(dist);
+            _inflate_put_code(st, litcode[257 + lsym]);
+            _inflate_put_bits(st, len - _deflate_length_base[lsym], _deflate_length_extra[lsym]);
+            _inflate_put_code(st, distcode[dsym]);
+            _inflate_put_bits(st, dist - _deflate_dist_base[dsym], _deflate_dist_extra[dsym]);
+        }
+    }
+    _inflate_put_code(st, litcode[256]);
+}
+
+// Writes symbols [first, last) as one block (or several stored blocks), for
+// the input starting at `start`. `h` is the histogram of those symbols
+void _inflate_write_block(inflate_state *st, size_t first, size_t last, size_t start, const inflate_histogram *h, bool final) {
+    inflate_tree t;
+    inflate_block_choice choice = _inflate_choose_block(h, &t);
+
+    switch (choice.type) {
+        case DEFLATE_NO_COMPRESSION:
+            _inflate_stored_blocks(st, st->ctx->in.data + start, h->bytes, final);
+            break;
+
+        case DEFLATE_FIXED_COMPRESSION:
+            // RFC 1951 - 3.2.6 Compression with fixed Huffman codes (BTYPE=01)
+            _inflate_put_bits(st, (final ? 1 : 0) | (DEFLATE_FIXED_COMPRESSION << 1), 3);
+            _inflate_compressed_symbols(st, first, last, _inflate_fixed_litcode, _inflate_fixed_distcode);
+            break;
+
+        case DEFLATE_DYNAMIC_COMPRESSION:
+            // RFC 1951 - 3.2.7 Compression with dynamic Huffman codes (BTYPE=10)
+            _inflate_build_codes(t.lens, t.nlit, t.litcode);
+            _inflate_build_codes(t.lens + t.nlit, t.ndist, t.distcode);
+            _inflate_build_codes(t.codelens, INFLATE_CODECODES, t.codecode);
+            _inflate_put_bits(st, (final ? 1 : 0) | (DEFLATE_DYNAMIC_COMPRESSION << 1), 3);
+            _inflate_put_bits(st, t.nlit - 257, 5);
+            _inflate_put_bits(st, t.ndist - 1, 5);
+            _inflate_put_bits(st, t.ncode - 4, 4);
+            for (size_t i = 0; i < t.ncode; i ++) {
+                _inflate_put_bits(st, t.codelens[_deflate_codecode_order[i]], 3);
+            }
+            for (size_t i = 0; i < t.nrle; i ++) {
+                _inflate_put_code(st, t.codecode[t.rle[i]]);
+                _inflate_put_bits(st, t.rle_extra[i], _inflate_codecode_extra[t.rle[i]]);
+            }
+            _inflate_compressed_symbols(st, first, last, t.litcode, t.distcode);
+            break;
+
+        default:
+            ZLIB_UNREACHABLE();
+    }
+}
+
+// Tries splitting symbols [first, last) at each eighth, returning the split
+// point that costs least as two blocks along with the histograms of each side,
+// or `first` if none beat one block
+size_t _inflate_best_split(inflate_state *st, size_t first, size_t last, const inflate_histogram *h,
+        inflate_histogram *left, inflate_histogram *right) {
+    inflate_tree t;
+    size_t best = _inflate_choose_block(h, &t).bits;
+    size_t split = first;
+
+    // Histogram of the first i eighths, the rest is whatever isn't in it
+    inflate_histogram prefix = {0};
+    size_t point = first;
+    for (size_t i = 1; i < 8; i ++) {
+        size_t next = first + (last - first) * i / 8;
+        _inflate_histogram_add(st, point, next, &prefix);
+        point = next;
+
+        inflate_histogram rest = *h;
+        for (size_t sym = 0; sym < INFLATE_LITERALS; sym ++) rest.lit[sym] -= prefix.lit[sym];
+        for (size_t sym = 0; sym < INFLATE_DISTANCES; sym ++) rest.dist[sym] -= prefix.dist[sym];
+        rest.bytes -= prefix.bytes;
+        size_t bits = _inflate_choose_block(&prefix, &t).bits + _inflate_choose_block(&rest, &t).bits;
+        if (bits < best) {
+            best = bits;
+            split = point;
+            *left = prefix;
+            *right = rest;
+        }
+    }
+    return split;
+}
+
+// Writes symbols [first, last) out, splitting them into smaller blocks where
+// the symbol statistics change enough to pay for another block header
+void _inflate_write_blocks(inflate_state *st, size_t first, size_t last, size_t start, const inflate_histogram *h, bool final) {
+    inflate_histogram left, right;
+    size_t split = first;
+    if (last - first >= 2 * INFLATE_MIN_SPLIT) split = _inflate_best_split(st, first, last, h, &left, &right);
+    if (split == first) {
+        _inflate_write_block(st, first, last, start, h, final);
+        return;
+    }
+    _inflate_write_blocks(st, first, split, start, &left, false);
+    _inflate_write_blocks(st, split, last, start + left.bytes, &right, final);
+}
+
+// Writes out the buffered symbols, giving the input they cover to the sink
+void _inflate_flush_block(inflate_state *st, bool last) {
+    deflate_context *ctx = st->ctx;
+    if (ctx->sink != NULL && st->block_end > st->block_start &&
+            !ctx->sink(ctx->sink_data, ctx->in.data + st->block_start, st->block_end - st->block_start)) {
+        ctx->state = DEFLATE_ERROR;
+    }
+    inflate_histogram h = {0};
+    _inflate_histogram_add(st, 0, st->symbols, &h);
+    _inflate_write_blocks(st, 0, st->symbols, st->block_start, &h, last);
+    st->symbols = 0;
+    st->block_start = st->block_end;
+}
+
+void _inflate_literal(inflate_state *st, uint8_t c) {
+    st->dists[st->symbols] = 0;
+    st->lens[st->symbols] = c;
+    st->symbols ++;
+    st->block_end ++;
+    if (st->symbols == INFLATE_BLOCK_SYMBOLS) _inflate_flush_block(st, false);
+}
+
+void _inflate_match(inflate_state *st, uint16_t len, uint16_t dist) {
+    assert(len >= INFLATE_MIN_MATCH && len <= INFLATE_MAX_MATCH);
+    assert(dist >= 1 && dist <= INFLATE_WINDOW_SIZE);
+    st->dists[st->symbols] = dist;
+    st->lens[st->symbols] = len;
+    st->symbols ++;
+    st->block_end += len;
+    if (st->symbols == INFLATE_BLOCK_SYMBOLS) _inflate_flush_block(st, false);
+}
+
+uint32_t _inflate_hash(const uint8_t *p) {
+    uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    return (v * 2654435761U) >> (32 - INFLATE_HASH_BITS);
+}
+
+// Adds `pos` to its hash chain, returning the previous head of the chain
+uint32_t _inflate_insert(inflate_state *st, size_t pos) {
+    uint32_t h = _inflate_hash(st->ctx->in.data + pos);
+    uint32_t cand = st->head[h];
+    st->prev[pos & INFLATE_WINDOW_MASK] = cand;
+    st->head[h] = pos;
+    return cand;
+}
+
+size_t _inflate_match_length(const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t len = 0;
+    while (len + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        uint64_t diff = le64toh(x ^ y);
+        if (diff != 0) {
+#if defined(__GNUC__) || defined(__clang__)
+            return len + __builtin_ctzll(diff) / 8;
+#else
+            while ((diff & 0xFF) == 0) {
+                diff >>= 8;
+                len ++;
+            }
+            return len;
+#endif
+        }
+        len += 8;
+    }
+    while (len < max && a[len] == b[len]) len ++;
+    return len;
+}
+
+// Walks the hash chain from `cand` looking for the longest match at `pos`
+size_t _inflate_longest_match(inflate_state *st, size_t pos, uint32_t cand, size_t prev_len, uint16_t *dist) {
+    const uint8_t *in = st->ctx->in.data;
+    size_t max = st->ctx->in.size - pos;
+    if (max > INFLATE_MAX_MATCH) max = INFLATE_MAX_MATCH;
+    size_t nice = st->config.nice < max ? st->config.nice : max;
+    size_t chain = st->config.chain;
+    if (prev_len >= st->config.good) chain /= 4;
+
+    size_t best = prev_len;
+    uint32_t last_dist = 0;
+    while (chain-- > 0) {
+        uint32_t d = (uint32_t)pos - cand;
+        // Chains only go back in time, anything else is left over from
+        // positions that have already left the window
+        if (d <= last_dist || d > INFLATE_WINDOW_SIZE || d > pos) break;
+        last_dist = d;
+
+        const uint8_t *p = in + pos - d;
+        if (best < max && p[best] == in[pos + best] && p[0] == in[pos]) {
+            size_t len = _inflate_match_length(p, in + pos, max);
+            if (len > best) {
+                best = len;
+                *dist = d;
+                if (len >= nice) break;
+            }
+        }
+        cand = st->prev[cand & INFLATE_WINDOW_MASK];
+    }
+    return best;
+}
+
+void _inflate_greedy(inflate_state *st) {
+    size_t size = st->ctx->in.size;
+    const uint8_t *in = st->ctx->in.data;
+    size_t pos = st->block_end;
+    while (pos < size) {
+        size_t len = 0;
+        uint16_t dist = 0;
+        if (pos + INFLATE_MIN_MATCH <= size) {
+            uint32_t cand = _inflate_insert(st, pos);
+            len = _inflate_longest_match(st, pos, cand, INFLATE_MIN_MATCH - 1, &dist);
+            if (len == INFLATE_MIN_MATCH && dist > INFLATE_TOO_FAR) len = 0;
+        }
+        if (len >= INFLATE_MIN_MATCH) {
+            _inflate_match(st, len, dist);
+            // Long matches are skipped over without hashing, like zlib's deflate_fast
+            if (len <= st->config.nice) {
+                for (size_t i = 1; i < len && pos + i + INFLATE_MIN_MATCH <= size; i ++) {
+                    _inflate_insert(st, pos + i);
+                }
+            }
+            pos += len;
+        } else {
+            _inflate_literal(st, in[pos]);
+            pos ++;
+        }
+    }
+}
+
+// Lazy matching, RFC 1951 - 4. Only takes the match at a position if the
+// next position doesn't have a longer one
+void _inflate_lazy(inflate_state *st) {
+    size_t size = st->ctx->in.size;
+    const uint8_t *in = st->ctx->in.data;
+    size_t prev_len = 0;
+    uint16_t prev_dist = 0;
+    bool pending = false;
+    size_t pos = st->block_end;
+    while (pos < size) {
+        size_t len = 0;
+        uint16_t dist = 0;
+        if (pos + INFLATE_MIN_MATCH <= size) {
+            uint32_t cand = _inflate_insert(st, pos);
+            if (prev_len < st->config.lazy) {
+                len = _inflate_longest_match(st, pos, cand, INFLATE_MIN_MATCH - 1, &dist);
+                if (len == INFLATE_MIN_MATCH && dist > INFLATE_TOO_FAR) len = 0;
+            }
+        }
+
+        if (prev_len >= INFLATE_MIN_MATCH && len <= prev_len) {
+            // The match at the previous position wins
+            _inflate_match(st, prev_len, prev_dist);
+            size_t end = pos - 1 + prev_len;
+            for (pos ++; pos < end; pos ++) {
+                if (pos + INFLATE_MIN_MATCH <= size) _inflate_insert(st, pos);
+            }
+            pending = false;
+            prev_len = 0;
+        } else {
+            if (pending) _inflate_literal(st, in[pos - 1]);
+            pending = true;
+            prev_len = len;
+            prev_dist = dist;
+            pos ++;
+        }
+    }
+    if (pending) _inflate_literal(st, in[size - 1]);
+}
+
+// Optimal parsing, like zopfli. Every match (the closest for each length) is
+// found once for a segment of input, then the cheapest way through the
+// segment is found a few times over, each time costing symbols by how often
+// the previous pass used them.
+#define INFLATE_OPTIMAL_SEGMENT (1 << 16)
+
+typedef struct {
+    uint16_t len;
+    uint16_t dist;
+} inflate_match;
+
+typedef struct {
+    float lit[INFLATE_LITERALS]; // Length symbols include their extra bits
+    float dist[INFLATE_DISTANCES];
+} inflate_cost_model;
+
+typedef struct {
+    // Matches found at each position of the segment, those for position i
+    // are [offsets[i], offsets[i + 1]), getting longer and further away
+    inflate_match *matches;
+    size_t nmatches;
+    size_t capacity;
+    uint32_t *offsets;
+
+    float *cost; // Cheapest cost to get to each position
+    inflate_match *step; // The last step taken to get there, len 1 for a literal
+    inflate_match *path;
+    inflate_match *best;
+    size_t npath;
+    size_t nbest;
+} inflate_optimal;
+
+// Adds every match at `pos` that is longer than the ones closer to it
+void _inflate_all_matches(inflate_state *st, inflate_optimal *opt, size_t pos, uint32_t cand) {
+    const uint8_t *in = st->ctx->in.data;
+    size_t max = st->ctx->in.size - pos;
+    if (max > INFLATE_MAX_MATCH) max = INFLATE_MAX_MATCH;
+    size_t chain = st->config.chain;
+
+    size_t best = INFLATE_MIN_MATCH - 1;
+    uint32_t last_dist = 0;
+    while (chain-- > 0 && best < max) {
+        uint32_t d = (uint32_t)pos - cand;
+        if (d <= last_dist || d > INFLATE_WINDOW_SIZE || d > pos) break;
+        last_dist = d;
+
+        const uint8_t *p = in + pos - d;
+        if (p[best] == in[pos + best] && p[0] == in[pos]) {
+            size_t len = _inflate_match_length(p, in + pos, max);
+            if (len > best) {
+                best = len;
+                opt->matches[opt->nmatches ++] = (inflate_match){ .len = len, .dist = d };
+            }
+        }
+        cand = st->prev[cand & INFLATE_WINDOW_MASK];
+    }
+}
+
+// Symbol costs from the fixed codes, to start from
+void _inflate_fixed_costs(inflate_cost_model *model) {
+    for (size_t sym = 0; sym < INFLATE_LITERALS; sym ++) model->lit[sym] = _inflate_fixed_litcode[sym].bits;
+    for (size_t sym = 0; sym < INFLATE_DISTANCES; sym ++) model->dist[sym] = 5 + _deflate_dist_extra[sym];
+    for (size_t sym = 0; sym < ZLIB_C_ARRAY_LEN(_deflate_length_extra); sym ++) model->lit[257 + sym] += _deflate_length_extra[sym];
+}
+
+// Symbol costs from how often they were used, i.e. -log2 of their
+// probability. Unused symbols cost a bit more than the rarest used one would.
+// Returns what the symbols would cost with those costs.
+float _inflate_histogram_costs(const inflate_histogram *h, inflate_cost_model *model) {
+    uint32_t litsum = 0, distsum = 0;
+    for (size_t sym = 0; sym < INFLATE_LITERALS; sym ++) litsum += h->lit[sym];
+    for (size_t sym = 0; sym < INFLATE_DISTANCES; sym ++) distsum += h->dist[sym];
+    float litlog = _zlib_log2(litsum > 0 ? litsum : 1) / 65536.0f;
+    float distlog = _zlib_log2(distsum > 0 ? distsum : 1) / 65536.0f;
+
+    float total = 0;
+    for (size_t sym = 0; sym < INFLATE_LITERALS; sym ++) {
+        model->lit[sym] = h->lit[sym] == 0 ? litlog + 1 : litlog - _zlib_log2(h->lit[sym]) / 65536.0f;
+    }
+    for (size_t sym = 0; sym < ZLIB_C_ARRAY_LEN(_deflate_length_extra); sym ++) model->lit[257 + sym] += _deflate_length_extra[sym];
+    for (size_t sym = 0; sym < INFLATE_DISTANCES; sym ++) {
+        model->dist[sym] = (h->dist[sym] == 0 ? distlog + 1 : distlog - _zlib_log2(h->dist[sym]) / 65536.0f) + _deflate_dist_extra[sym];
+        total += h->dist[sym] * model->dist[sym];
+    }
+    for (size_t sym = 0; sym < INFLATE_LITERALS; sym ++) total += h->lit[sym] * model->lit[sym];
+    return total;
+}
+
+// Finds the cheapest steps through the n bytes of the segment at `start`,
+// leaving them in `opt->path`, and their histogram in `h`
+void _inflate_optimal_path(inflate_optimal *opt, const uint8_t *in, size_t n, const inflate_cost_model *model, inflate_histogram *h) {
+    float lencost[INFLATE_MAX_MATCH + 1];
+    for (size_t len = INFLATE_MIN_MATCH; len <= INFLATE_MAX_MATCH; len ++) lencost[len] = model->lit[257 + _inflate_length_symbol[len]];
+
+    opt->cost[0] = 0;
+    for (size_t i = 1; i <= n; i ++) opt->cost[i] = INFINITY;
+    for (size_t i = 0; i < n; i ++) {
+        float here = opt->cost[i];
+        if (here + model->lit[in[i]] < opt->cost[i + 1]) {
+            opt->cost[i + 1] = here + model->lit[in[i]];
+            opt->step[i + 1] = (inflate_match){ .len = 1, .dist = 0 };
+        }
+
+        size_t shorter = INFLATE_MIN_MATCH - 1;
+        for (uint32_t m = opt->offsets[i]; m < opt->offsets[i + 1]; m ++) {
+            inflate_match match = opt->matches[m];
+            size_t len = match.len < n - i ? match.len : n - i;
+            // Cut short by the end of the segment, it may not be a match at all
+            if (len < INFLATE_MIN_MATCH) continue;
+            // Runs of the longest matches (long runs of one byte, say) aren't
+            // worth trying every length for
+            if (match.len == INFLATE_MAX_MATCH) shorter = len - 1;
+            float dist = model->dist[_inflate_dist_code(match.dist)];
+            size_t first = shorter + 1 > INFLATE_MIN_MATCH ? shorter + 1 : INFLATE_MIN_MATCH;
+            for (size_t l = first; l <= len; l ++) {
+                float cost = here + lencost[l] + dist;
+                if (cost < opt->cost[i + l]) {
+                    opt->cost[i + l] = cost;
+                    opt->step[i + l] = (inflate_match){ .len = l, .dist = match.dist };
+                }
+            }
+            if (len > shorter) shorter = len;
+        }
+    }
+
+    // Walk back from the end, then turn the steps around
+    opt->npath = 0;
+    for (size_t i = n; i > 0; i -= opt->step[i].len) opt->path[opt->npath ++] = opt->step[i];
+    memset(h, 0, sizeof(*h));
+    for (size_t a = 0, b = opt->npath - 1; a < b; a ++, b --) {
+        inflate_match tmp = opt->path[a];
+        opt->path[a] = opt->path[b];
+        opt->path[b] = tmp;
+    }
+    for (size_t i = 0, pos = 0; i < opt->npath; pos += opt->path[i].len, i ++) {
+        if (opt->path[i].dist == 0) {
+            h->lit[in[pos]] ++;
+        } else {
+            h->lit[257 + _inflate_length_symbol[opt->path[i].len]] ++;
+            h->dist[_inflate_dist_code(opt->path[i].dist)] ++;
+        }
+    }
+}
+
+bool _inflate_optimal(inflate_state *st) {
+    bool ret = true;
+    const uint8_t *in = st->ctx->in.data;
+    size_t size = st->ctx->in.size;
+    inflate_optimal opt = { .capacity = INFLATE_OPTIMAL_SEGMENT };
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+
+    opt.matches = malloc(opt.capacity * sizeof(*opt.matches));
+    opt.offsets = malloc((INFLATE_OPTIMAL_SEGMENT + 1) * sizeof(*opt.offsets));
+    opt.cost = malloc((INFLATE_OPTIMAL_SEGMENT + 1) * sizeof(*opt.cost));
+    opt.step = malloc((INFLATE_OPTIMAL_SEGMENT + 1) * sizeof(*opt.step));
+    opt.path = malloc(INFLATE_OPTIMAL_SEGMENT * sizeof(*opt.path));
+    opt.best = malloc(INFLATE_OPTIMAL_SEGMENT * sizeof(*opt.best));
+    if (opt.matches == NULL || opt.offsets == NULL || opt.cost == NULL || opt.step == NULL || opt.path == NULL || opt.best == NULL) {
+        return_defer(false);
+    }
+
+    // Costs carry over from one segment to the next, input rarely changes
+    // much in between
+    inflate_cost_model model;
+    _inflate_fixed_costs(&model);
+    for (size_t start = st->block_end; start < size; start += INFLATE_OPTIMAL_SEGMENT) {
+        size_t n = size - start < INFLATE_OPTIMAL_SEGMENT ? size - start : INFLATE_OPTIMAL_SEGMENT;
+
+        opt.nmatches = 0;
+        for (size_t i = 0; i < n; i ++) {
+            opt.offsets[i] = opt.nmatches;
+            if (start + i + INFLATE_MIN_MATCH > size) continue;
+            if (opt.capacity - opt.nmatches < INFLATE_MAX_MATCH) {
+                opt.capacity *= 2;
+                inflate_match *matches = realloc(opt.matches, opt.capacity * sizeof(*opt.matches));
+                if (matches == NULL) return_defer(false);
+                opt.matches = matches;
+            }
+            uint32_t cand = _inflate_insert(st, start + i);
+            _inflate_all_matches(st, &opt, start + i, cand);
+        }
+        opt.offsets[n] = opt.nmatches;
+
+        float best = INFINITY;
+        for (size_t iter = 0; iter < st->config.iterations; iter ++) {
+            inflate_histogram h;
+            _inflate_optimal_path(&opt, in + start, n, &model, &h);
+            float cost = _inflate_histogram_costs(&h, &model);
+            if (cost >= best) break;
+            best = cost;
+            inflate_match *tmp = opt.best;
+            opt.best = opt.path;
+            opt.path = tmp;
+            opt.nbest = opt.npath;
+        }
+
+        for (size_t i = 0; i < opt.nbest; i ++) {
+            if (opt.best[i].dist == 0) {
+                _inflate_literal(st, in[st->block_end]);
+            } else {
+                _inflate_match(st, opt.best[i].len, opt.best[i].dist);
+            }
+        }
+    }
+
+#undef return_defer
+defer:
+    free(opt.matches);
+    free(opt.offsets);
+    free(opt.cost);
+    free(opt.step);
+    free(opt.path);
+    free(opt.best);
+    return ret;
+}
+
+// Compresses `ctx->in` after its first `dict` bytes, which are only there for
+// matches to reach back into. Unless it is the `last` part of the stream, the
+// output ends with an empty stored block instead of a final one, which brings
+// it to a byte boundary so that whatever comes next can just be appended.
+bool _inflate(deflate_context *ctx, zlib_compression_level level, size_t dict, bool last) {
+    bool ret = true;
+    inflate_state st = {
+        .ctx = ctx,
+        .config = _inflate_configs[level],
+        .block_start = dict,
+        .block_end = dict,
+    };
+#define return_defer(code) do { ret = (code); goto defer; } while (0);
+    assert(level < ZLIB_C_ARRAY_LEN(_inflate_configs));
+    _inflate_tables();
+
+    st.head = calloc(INFLATE_HASH_SIZE, sizeof(*st.head));
+    st.prev = calloc(INFLATE_WINDOW_SIZE, sizeof(*st.prev));
+    st.dists = malloc(INFLATE_BLOCK_SYMBOLS * sizeof(*st.dists));
+    st.lens = malloc(INFLATE_BLOCK_SYMBOLS * sizeof(*st.lens));
+    if (st.head == NULL || st.prev == NULL || st.dists == NULL || st.lens == NULL) {
+        ctx->state = DEFLATE_ERROR;
+        return_defer(false);
+    }
+
+    assert(dict <= INFLATE_WINDOW_SIZE && dict <= ctx->in.size);
+    for (size_t pos = 0; pos < dict && pos + INFLATE_MIN_MATCH <= ctx->in.size; pos ++) {
+        _inflate_insert(&st, pos);
+    }
+
+    if (st.config.iterations > 0) {
+        if (!_inflate_optimal(&st)) {
+            ctx->state = DEFLATE_ERROR;
+            return_defer(false);
+        }
+    } else if (st.config.lazy == 0) {
+        _inflate_greedy(&st);
+    } else {
+        _inflate_lazy(&st);
+    }
+    assert(st.block_end == ctx->in.size);
+    _inflate_flush_block(&st, last);
+    if (!last) _inflate_stored_blocks(&st, ctx->in.data, 0, false);
+    _inflate_flush_bits(&st);
+    if (ctx->state == DEFLATE_ERROR) return_defer(false);
     ctx->state = DEFLATE_FINISHED;
+
+#undef return_defer
+defer:
+    free(st.head);
+    free(st.prev);
+    free(st.dists);
+    free(st.lens);
+    return ret;
+}
+
+bool inflate(deflate_context *ctx, zlib_compression_level level) {
+    return _inflate(ctx, level, 0, true);
+}
+
+// Writes `ctx->in` out as stored blocks, without looking for matches
+bool inflate_stored(deflate_context *ctx) {
+    inflate_state st = { .ctx = ctx };
+    size_t pos = 0;
+    do {
+        size_t len = ctx->in.size - pos > INFLATE_MAX_STORED ? INFLATE_MAX_STORED : ctx->in.size - pos;
+        if (ctx->sink != NULL && len > 0 && !ctx->sink(ctx->sink_data, ctx->in.data + pos, len)) {
+            ctx->state = DEFLATE_ERROR;
+            return false;
+        }
+        _inflate_stored_blocks(&st, ctx->in.data + pos, len, pos + len == ctx->in.size);
+        pos += len;
+    } while (pos < ctx->in.size);
+    _inflate_flush_bits(&st);
+    ctx->state = DEFLATE_FINISHED;
+    return true;
+}
+
+// RFC 1950 - 9. Adler-32 of two pieces of data back to back, from the
+// checksums of each and the length of the second. The first piece adds its
+// sum of bytes once for every byte of the second to the second sum.
+uint32_t zlib_adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    uint32_t rem = len2 % ZLIB_ADLER_BASE;
+    uint32_t a1 = adler1 & 0xFFFF, b1 = adler1 >> 16;
+    uint32_t a2 = adler2 & 0xFFFF, b2 = adler2 >> 16;
+    // Both checksums start a at 1, so one of those has to come back off
+    uint32_t a = (a1 + a2 + ZLIB_ADLER_BASE - 1) % ZLIB_ADLER_BASE;
+    uint32_t b = (uint32_t)(((uint64_t)rem * a1 + b1 + b2 + ZLIB_ADLER_BASE - rem) % ZLIB_ADLER_BASE);
+    return b << 16 | a;
+}
+
+// Big inputs are split into chunks this size to compress in parallel, like
+// pigz. Each chunk still sees the 32K before it, so little is lost.
+#define ZLIB_PARALLEL_CHUNK (1 << 20)
+
+typedef struct {
+    const uint8_t *in;
+    size_t size;
+    zlib_compression_level level;
+    size_t nchunks;
+    atomic_size_t next;
+    atomic_bool failed;
+    deflate_array *outs;
+    uint32_t *adlers;
+} zlib_parallel;
+
+bool _zlib_chunk_sink(void *data, const uint8_t *buf, size_t size) {
+    uint32_t *adler = data;
+    *adler = zlib_adler32(*adler, buf, size);
     return true;
 }
 
+void *_zlib_parallel_worker(void *data) {
+    zlib_parallel *job = data;
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->nchunks) break;
+
+        size_t start = i * ZLIB_PARALLEL_CHUNK;
+        size_t end = start + ZLIB_PARALLEL_CHUNK < job->size ? start + ZLIB_PARALLEL_CHUNK : job->size;
+        size_t dict = start < DEFLATE_WINDOW_SIZE ? start : DEFLATE_WINDOW_SIZE;
+        job->adlers[i] = 1;
+        deflate_context chunk = {
+            .in = { .data = (uint8_t *)job->in + start - dict, .size = end - start + dict },
+            .sink = _zlib_chunk_sink,
+            .sink_data = &job->adlers[i],
+        };
+        if (!_inflate(&chunk, job->level, dict, i + 1 == job->nchunks)) job->failed = true;
+        job->outs[i] = chunk.out;
+    }
+    return NULL;
+}
+
+// Compresses the chunks of `ctx->deflate.in` on `threads` threads (this one
+// included) and appends them in order, combining their checksums
+bool _zlib_compress_parallel(zlib_context *ctx, size_t threads) {
+    bool ret = true;
+    size_t size = ctx->deflate.in.size;
+    zlib_parallel job = {
+        .in = ctx->deflate.in.data,
+        .size = size,
+        .level = ctx->flevel,
+        .nchunks = (size + ZLIB_PARALLEL_CHUNK - 1) / ZLIB_PARALLEL_CHUNK,
+    };
+    if (threads > job.nchunks) threads = job.nchunks;
+    job.outs = calloc(job.nchunks, sizeof(*job.outs));
+    job.adlers = calloc(job.nchunks, sizeof(*job.adlers));
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    size_t started = 0;
+    if (job.outs == NULL || job.adlers == NULL || tids == NULL) {
+        free(job.outs);
+        free(job.adlers);
+        free(tids);
+        return false;
+    }
+
+    // The shared tables and the Adler-32 kernel are set up on first use, so
+    // do that here before any workers can race on them
+    _inflate_tables();
+    zlib_adler32(1, NULL, 0);
+
+    // Fewer threads than asked for is fine, the rest of the chunks are just
+    // picked up by the ones that did start
+    while (started + 1 < threads && pthread_create(&tids[started], NULL, _zlib_parallel_worker, &job) == 0) {
+        started ++;
+    }
+    _zlib_parallel_worker(&job);
+    for (size_t i = 0; i < started; i ++) pthread_join(tids[i], NULL);
+    if (job.failed) ret = false;
+
+    uint32_t adler = 1;
+    for (size_t i = 0; i < job.nchunks; i ++) {
+        if (ret) {
+            size_t len = i + 1 < job.nchunks ? ZLIB_PARALLEL_CHUNK : size - i * ZLIB_PARALLEL_CHUNK;
+            DEFLATE_APPEND_BYTES(&ctx->deflate, job.outs[i].data, job.outs[i].size);
+            adler = zlib_adler32_combine(adler, job.adlers[i], len);
+        }
+        free(job.outs[i].data);
+    }
+    ctx->adler = adler;
+    free(job.outs);
+    free(job.adlers);
+    free(tids);
+    return ret;
+}
+
+// Inputs smaller than this are compressed without probing, they are cheap
+// either way
+#define ZLIB_PROBE_MIN 4096
+// Big inputs are sampled in this many windows of this size, spread evenly
+#define ZLIB_PROBE_WINDOW 4096
+#define ZLIB_PROBE_WINDOWS 16
+#define ZLIB_PROBE_HASH_BITS 12
+
+// Entropy (in millibits per byte) and repeats (per 1000) past which
+// compressing isn't worth it. Deflate can't get below the order-0 entropy
+// without repeats to turn into matches.
+#define ZLIB_PROBE_STORE_ENTROPY 7950
+#define ZLIB_PROBE_STORE_REPEATS 10
+#define ZLIB_PROBE_FASTEST_ENTROPY 7500
+#define ZLIB_PROBE_FASTEST_REPEATS 50
+
+// Looks at a sample of the input to guess how well it will compress, from
+// its byte histogram and how often 4 byte sequences come back
+zlib_probe zlib_probe_input(const uint8_t *data, size_t size) {
+    zlib_probe probe = { .decision = ZLIB_PROBE_COMPRESS };
+    if (size < ZLIB_PROBE_MIN) return probe;
+
+    uint32_t counts[256] = {0};
+    uint32_t seen[1 << ZLIB_PROBE_HASH_BITS];
+    size_t grams = 0, repeats = 0;
+    size_t windows = size <= ZLIB_PROBE_WINDOW * ZLIB_PROBE_WINDOWS ? 1 : ZLIB_PROBE_WINDOWS;
+    size_t window = windows == 1 ? size : ZLIB_PROBE_WINDOW;
+    for (size_t w = 0; w < windows; w ++) {
+        const uint8_t *p = data + (windows == 1 ? 0 : (size - window) / (windows - 1) * w);
+        for (size_t i = 0; i < window; i ++) counts[p[i]] ++;
+
+        memset(seen, 0, sizeof(seen));
+        for (size_t i = 0; i + 4 <= window; i ++) {
+            uint32_t v;
+            memcpy(&v, p + i, 4);
+            uint32_t h = (v * 2654435761U) >> (32 - ZLIB_PROBE_HASH_BITS);
+            if (seen[h] == v) repeats ++;
+            seen[h] = v;
+            grams ++;
+        }
+        probe.sampled += window;
+    }
+
+    // H = log2(n) - sum(c * log2(c)) / n
+    uint64_t sum = 0;
+    for (size_t i = 0; i < 256; i ++) {
+        if (counts[i] > 0) sum += (uint64_t)counts[i] * _zlib_log2(counts[i]);
+    }
+    uint64_t entropy = _zlib_log2(probe.sampled) - sum / probe.sampled;
+    probe.entropy = (uint32_t)((entropy * 1000) >> 16);
+    probe.repeats = (uint32_t)(repeats * 1000 / grams);
+
+    if (probe.entropy >= ZLIB_PROBE_STORE_ENTROPY && probe.repeats < ZLIB_PROBE_STORE_REPEATS) {
+        probe.decision = ZLIB_PROBE_STORE;
+    } else if (probe.entropy >= ZLIB_PROBE_FASTEST_ENTROPY && probe.repeats < ZLIB_PROBE_FASTEST_REPEATS) {
+        probe.decision = ZLIB_PROBE_FASTEST;
+    }
+    return probe;
+}
+
+const char *zlib_probe_name(zlib_probe_decision decision) {
+    _Static_assert(ZLIB_PROBE_STORE == 2, "Decisions have changed. May need handling here");
+    switch (decision) {
+        case ZLIB_PROBE_COMPRESS: return "compress";
+        case ZLIB_PROBE_FASTEST: return "fastest";
+        case ZLIB_PROBE_STORE: return "store";
+        default: ZLIB_UNREACHABLE();
+    }
+}
+
+#ifndef ZLIB_BACKEND
 bool zlib_compress(zlib_context *ctx) {
     assert(ctx != NULL);
     for (;;) {
@@ -913,16 +2573,26 @@ bool zlib_compress(zlib_context *ctx) {
                 uint8_t cmf = (cinfo & 0xF) << 4 | (cm & 0xF);
                 DEFLATE_APPEND(&ctx->deflate, cmf);
 
+                if (ctx->probe) {
+                    ctx->probed = zlib_probe_input(ctx->deflate.in.data, ctx->deflate.in.size);
+                    // RFC 1950 - 2.2. Stored data is marked as the fastest
+                    // level too, like zlib does for level 0
+                    if (ctx->probed.decision != ZLIB_PROBE_COMPRESS) ctx->flevel = ZLIB_FASTEST_COMPRESSOR;
+                }
+
                 // FIXME support dictionaries
                 uint8_t fdict = 0;
-                // FIXME support configuring this
-                uint8_t flevel = ZLIB_FASTEST_COMPRESSOR; // ZLIB_DEFAULT_COMPRESSOR;
+                assert(ctx->flevel <= ZLIB_MAX_COMPRESSOR);
+                uint8_t flevel = ctx->flevel;
 
                 uint8_t flg = ((fdict & 0x1) << 5) | ((flevel & 0x3) << 6);
                 uint16_t check = (uint16_t)cmf * 256 + (uint16_t)flg;
                 flg += 31 - (check % 31);
                 DEFLATE_APPEND(&ctx->deflate, flg);
 
+                ctx->adler = 1;
+                ctx->deflate.sink = _zlib_sink;
+                ctx->deflate.sink_data = ctx;
                 ctx->state = fdict != 0 ? ZLIB_DICT : ZLIB_DEFLATE;
             }; break;
 
@@ -931,7 +2601,19 @@ bool zlib_compress(zlib_context *ctx) {
                 break; // potentially should fall through?
 
             case ZLIB_DEFLATE:
-                if (!inflate(&ctx->deflate)) {
+                if (ctx->probe && ctx->probed.decision == ZLIB_PROBE_STORE) {
+                    if (!inflate_stored(&ctx->deflate)) {
+                        ctx->state = ZLIB_ERROR;
+                        return false;
+                    }
+                } else if (ctx->threads > 1 && ctx->sink == NULL && ctx->deflate.in.size >= 2 * ZLIB_PARALLEL_CHUNK) {
+                    // Chunks are done out of order, so only without a sink
+                    if (!_zlib_compress_parallel(ctx, ctx->threads)) {
+                        ctx->state = ZLIB_ERROR;
+                        return false;
+                    }
+                    ctx->deflate.state = DEFLATE_FINISHED;
+                } else if (!inflate(&ctx->deflate, ctx->flevel)) {
                     if (ctx->deflate.state == DEFLATE_ERROR) {
                         ctx->state = ZLIB_ERROR;
                     }
@@ -940,14 +2622,7 @@ bool zlib_compress(zlib_context *ctx) {
                 ctx->state = ZLIB_ADLER;
                 // fall through
             case ZLIB_ADLER: {
-                uint16_t s1 = 1;
-                uint16_t s2 = 0;
-                for (size_t i = 0; i < ctx->deflate.in.size; i ++) {
-                    s1 = ((uint32_t)s1 + ctx->deflate.in.data[i]) % 65521;
-                    s2 = ((uint32_t)s2 + s1) % 65521;
-                }
-
-                uint32_t adler = ntohl((uint32_t)s2 * 65536 + (uint32_t)s1);
+                uint32_t adler = ntohl(ctx->adler);
                 DEFLATE_APPEND(&ctx->deflate, adler);
                 DEFLATE_APPEND(&ctx->deflate, adler >> 8);
                 DEFLATE_APPEND(&ctx->deflate, adler >> 16);
@@ -964,5 +2639,106 @@ bool zlib_compress(zlib_context *ctx) {
         }
     }
 }
+#endif // ZLIB_BACKEND
+
+#ifdef ZLIB_BACKEND
+// Same as above, but with the external library doing the work
+
+bool zlib_decompress(zlib_context *ctx) {
+    assert(ctx != NULL);
+    deflate_context *d = &ctx->deflate;
+    if (ctx->state == ZLIB_FINISHED) return true;
+    if (ctx->state == ZLIB_ERROR) return false;
+    if (ctx->backend == NULL) {
+        ctx->backend = zlib_backend_open();
+        if (ctx->backend == NULL) {
+            ctx->state = ZLIB_ERROR;
+            return false;
+        }
+        ctx->state = ZLIB_DEFLATE;
+    }
+
+    for (;;) {
+        if (d->limit != 0 && d->out.size >= d->limit) return false;
+        // With a sink, only the latest piece of output is kept
+        if (ctx->sink != NULL) d->out.size = 0;
+        DEFLATE_ENSURE(d, DEFLATE_WINDOW_SIZE);
+        size_t room = d->out.capacity - d->out.size;
+        size_t produced = room;
+        const uint8_t *in = d->bits.data;
+        zlib_backend_status status = zlib_backend_decompress(ctx->backend, &in, &d->bits.size, d->out.data + d->out.size, &produced);
+        d->bits.data = (uint8_t *)in;
+        d->out.size += produced;
+        if (status != ZLIB_BACKEND_ERROR && ctx->sink != NULL && produced > 0 &&
+                !ctx->sink(ctx->sink_data, d->out.data + d->out.size - produced, produced)) {
+            status = ZLIB_BACKEND_ERROR;
+        }
+
+        if (status == ZLIB_BACKEND_ERROR) {
+            ctx->state = ZLIB_ERROR;
+            d->state = DEFLATE_ERROR;
+            zlib_end(ctx);
+            return false;
+        }
+        if (status == ZLIB_BACKEND_END) {
+            ctx->state = ZLIB_FINISHED;
+            d->state = DEFLATE_FINISHED;
+            zlib_end(ctx);
+            return true;
+        }
+        if (produced < room) return false;
+    }
+}
+
+bool zlib_compress(zlib_context *ctx) {
+    assert(ctx != NULL);
+    if (ctx->state == ZLIB_FINISHED) return true;
+    if (ctx->probe) {
+        ctx->probed = zlib_probe_input(ctx->deflate.in.data, ctx->deflate.in.size);
+        if (ctx->probed.decision != ZLIB_PROBE_COMPRESS) ctx->flevel = ZLIB_FASTEST_COMPRESSOR;
+    }
+    // zlib's levels for each FLEVEL, RFC 1950 - 2.2
+    static const int levels[] = {
+        [ZLIB_FASTEST_COMPRESSOR] = 1,
+        [ZLIB_FAST_COMPRESSOR] = 5,
+        [ZLIB_DEFAULT_COMPRESSOR] = 6,
+        [ZLIB_MAX_COMPRESSOR] = 9,
+    };
+    assert(ctx->flevel <= ZLIB_MAX_COMPRESSOR);
+    int level = ctx->probe && ctx->probed.decision == ZLIB_PROBE_STORE ? 0 : levels[ctx->flevel];
+
+    deflate_context *d = &ctx->deflate;
+    uint8_t *out = NULL;
+    size_t size = 0;
+    if ((ctx->sink != NULL && d->in.size > 0 && !ctx->sink(ctx->sink_data, d->in.data, d->in.size)) ||
+            !zlib_backend_compress(d->in.data, d->in.size, level, &out, &size)) {
+        ctx->state = ZLIB_ERROR;
+        d->state = DEFLATE_ERROR;
+        return false;
+    }
+    if (d->out.data == NULL) {
+        d->out = (deflate_array){ .size = size, .capacity = size, .data = out };
+    } else {
+        DEFLATE_APPEND_BYTES(d, out, size);
+        free(out);
+    }
+    const uint8_t *adler = d->out.data + d->out.size - 4;
+    ctx->adler = (uint32_t)adler[0] << 24 | (uint32_t)adler[1] << 16 | (uint32_t)adler[2] << 8 | adler[3];
+    ctx->state = ZLIB_FINISHED;
+    d->state = DEFLATE_FINISHED;
+    return true;
+}
+#endif // ZLIB_BACKEND
+
+// Frees what the context holds on to while it is in use, other than the
+// output. Needed when stopping before the end of a stream.
+void zlib_end(zlib_context *ctx) {
+#ifdef ZLIB_BACKEND
+    zlib_backend_close(ctx->backend);
+    ctx->backend = NULL;
+#else
+    (void)ctx;
+#endif
+}
 
 #endif
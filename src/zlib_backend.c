@@ -0,0 +1,211 @@
+#include "zlib_backend.h"
+
+#ifdef ZLIB_BACKEND
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(ZLIB_BACKEND_ZLIB) || defined(ZLIB_BACKEND_ZLIB_NG)
+
+#ifdef ZLIB_BACKEND_ZLIB
+#include <zlib.h>
+#define ZB(name) name
+typedef z_stream zb_stream;
+typedef uLongf zb_size;
+#else
+// zlib-ng's own API, so it can sit next to the system zlib
+#include <zlib-ng.h>
+#define ZB(name) zng_ ## name
+typedef zng_stream zb_stream;
+typedef size_t zb_size;
+#endif
+
+struct zlib_backend_stream {
+    zb_stream z;
+};
+
+const char *zlib_backend_name(void) {
+#ifdef ZLIB_BACKEND_ZLIB
+    return "zlib " ZLIB_VERSION;
+#else
+    return "zlib-ng " ZLIBNG_VERSION;
+#endif
+}
+
+zlib_backend_stream *zlib_backend_open(void) {
+    zlib_backend_stream *stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) return NULL;
+    if (ZB(inflateInit)(&stream->z) != Z_OK) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+zlib_backend_status zlib_backend_decompress(zlib_backend_stream *stream, const uint8_t **in, size_t *insize, uint8_t *out, size_t *outsize) {
+    size_t room = *outsize;
+    *outsize = 0;
+    // avail_in and avail_out are 32 bits, so big buffers go in a piece at a time
+    for (;;) {
+        stream->z.next_in = (void *)*in;
+        stream->z.avail_in = *insize > UINT_MAX ? UINT_MAX : *insize;
+        stream->z.next_out = out + *outsize;
+        stream->z.avail_out = room - *outsize > UINT_MAX ? UINT_MAX : room - *outsize;
+        size_t avail_in = stream->z.avail_in, avail_out = stream->z.avail_out;
+        int ret = ZB(inflate)(&stream->z, Z_NO_FLUSH);
+        *in += avail_in - stream->z.avail_in;
+        *insize -= avail_in - stream->z.avail_in;
+        *outsize += avail_out - stream->z.avail_out;
+        if (ret == Z_STREAM_END) return ZLIB_BACKEND_END;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) return ZLIB_BACKEND_ERROR;
+        if (*insize == 0 || *outsize == room) return ZLIB_BACKEND_MORE;
+    }
+}
+
+void zlib_backend_close(zlib_backend_stream *stream) {
+    if (stream == NULL) return;
+    ZB(inflateEnd)(&stream->z);
+    free(stream);
+}
+
+bool zlib_backend_compress(const uint8_t *in, size_t size, int level, uint8_t **out, size_t *outsize) {
+    zb_size bound = ZB(compressBound)(size);
+    *out = malloc(bound);
+    if (*out == NULL) return false;
+    if (ZB(compress2)(*out, &bound, in, size, level) != Z_OK) {
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+    *outsize = bound;
+    return true;
+}
+
+#elif defined(ZLIB_BACKEND_LIBDEFLATE)
+
+#include <libdeflate.h>
+
+// libdeflate only works on whole buffers, so input is collected until it holds
+// the whole stream, which is then decompressed in one go and handed out as
+// there is room for it
+struct zlib_backend_stream {
+    struct libdeflate_decompressor *decompressor;
+    uint8_t *in;
+    size_t insize;
+    size_t incapacity;
+    size_t tried; // Input there was at the last try, which was too little
+    uint8_t *out;
+    size_t outsize;
+    size_t given;
+    bool done;
+};
+
+const char *zlib_backend_name(void) {
+    return "libdeflate " LIBDEFLATE_VERSION_STRING;
+}
+
+zlib_backend_stream *zlib_backend_open(void) {
+    zlib_backend_stream *stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) return NULL;
+    stream->decompressor = libdeflate_alloc_decompressor();
+    if (stream->decompressor == NULL) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// Tries to decompress the input collected so far. A stream that is cut short
+// looks just like a corrupt one, so failing only means trying again with more
+zlib_backend_status _zlib_backend_try(zlib_backend_stream *stream, size_t *unused) {
+    size_t capacity = stream->insize * 4 < (1 << 16) ? 1 << 16 : stream->insize * 4;
+    for (;;) {
+        uint8_t *out = realloc(stream->out, capacity);
+        if (out == NULL) return ZLIB_BACKEND_ERROR;
+        stream->out = out;
+        size_t used = 0;
+        enum libdeflate_result ret = libdeflate_zlib_decompress_ex(stream->decompressor, stream->in, stream->insize,
+                                                                   stream->out, capacity, &used, &stream->outsize);
+        if (ret == LIBDEFLATE_SUCCESS) {
+            *unused = stream->insize - used;
+            stream->done = true;
+            return ZLIB_BACKEND_END;
+        }
+        if (ret != LIBDEFLATE_INSUFFICIENT_SPACE) return ZLIB_BACKEND_MORE;
+        capacity *= 2;
+    }
+}
+
+zlib_backend_status zlib_backend_decompress(zlib_backend_stream *stream, const uint8_t **in, size_t *insize, uint8_t *out, size_t *outsize) {
+    if (!stream->done) {
+        bool eof = *insize == 0;
+        if (stream->insize + *insize > stream->incapacity) {
+            size_t capacity = stream->incapacity == 0 ? 1 << 12 : stream->incapacity;
+            while (capacity < stream->insize + *insize) capacity *= 2;
+            uint8_t *buf = realloc(stream->in, capacity);
+            if (buf == NULL) return ZLIB_BACKEND_ERROR;
+            stream->in = buf;
+            stream->incapacity = capacity;
+        }
+        if (*insize > 0) memcpy(stream->in + stream->insize, *in, *insize);
+        stream->insize += *insize;
+        size_t added = *insize;
+        *in += *insize;
+        *insize = 0;
+
+        // Trying again each time a little more input comes in would be
+        // quadratic, so wait for it to double (or run out)
+        if (!eof && stream->insize < 2 * stream->tried) {
+            *outsize = 0;
+            return ZLIB_BACKEND_MORE;
+        }
+        stream->tried = stream->insize;
+        size_t unused = 0;
+        zlib_backend_status status = _zlib_backend_try(stream, &unused);
+        if (status == ZLIB_BACKEND_ERROR || (status == ZLIB_BACKEND_MORE && eof)) return ZLIB_BACKEND_ERROR;
+        if (status == ZLIB_BACKEND_MORE) {
+            *outsize = 0;
+            return ZLIB_BACKEND_MORE;
+        }
+        // Whatever follows the stream came in with this last bit of input,
+        // as it wasn't complete without it
+        if (unused > added) unused = added;
+        *in -= unused;
+        *insize = unused;
+    }
+
+    size_t len = stream->outsize - stream->given < *outsize ? stream->outsize - stream->given : *outsize;
+    memcpy(out, stream->out + stream->given, len);
+    stream->given += len;
+    *outsize = len;
+    return stream->given == stream->outsize ? ZLIB_BACKEND_END : ZLIB_BACKEND_MORE;
+}
+
+void zlib_backend_close(zlib_backend_stream *stream) {
+    if (stream == NULL) return;
+    libdeflate_free_decompressor(stream->decompressor);
+    free(stream->in);
+    free(stream->out);
+    free(stream);
+}
+
+bool zlib_backend_compress(const uint8_t *in, size_t size, int level, uint8_t **out, size_t *outsize) {
+    // libdeflate goes up to 12, all slower and smaller than zlib's 9
+    struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level == 9 ? 12 : level);
+    if (compressor == NULL) return false;
+    size_t bound = libdeflate_zlib_compress_bound(compressor, size);
+    *out = malloc(bound);
+    *outsize = *out == NULL ? 0 : libdeflate_zlib_compress(compressor, in, size, *out, bound);
+    libdeflate_free_compressor(compressor);
+    if (*outsize == 0) {
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+    return true;
+}
+
+#endif
+
+#endif // ZLIB_BACKEND
@@ -0,0 +1,38 @@
+#ifndef ZLIB_BACKEND_H
+#define ZLIB_BACKEND_H
+
+// zlib_compress and zlib_decompress can be handed off to an external library
+// instead of the engine in zlib.h, to compare against it. CMake's
+// GIT_ZLIB_BACKEND option picks which one. Those libraries declare names
+// (deflate, inflate, ...) that clash with zlib.h, so they're only included in
+// zlib_backend.c, and this is the narrow interface between the two.
+
+#if defined(ZLIB_BACKEND_ZLIB) || defined(ZLIB_BACKEND_ZLIB_NG) || defined(ZLIB_BACKEND_LIBDEFLATE)
+#define ZLIB_BACKEND
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    ZLIB_BACKEND_MORE,  // Needs more input, or more room for output
+    ZLIB_BACKEND_END,   // The stream has ended and all its output was given out
+    ZLIB_BACKEND_ERROR,
+} zlib_backend_status;
+
+typedef struct zlib_backend_stream zlib_backend_stream;
+
+const char *zlib_backend_name(void);
+zlib_backend_stream *zlib_backend_open(void);
+// Decompresses from `*in`, advancing it and `*insize` past the input used, into
+// `out`. `*outsize` is the room in `out` going in, and how much was written
+// coming out.
+zlib_backend_status zlib_backend_decompress(zlib_backend_stream *stream, const uint8_t **in, size_t *insize, uint8_t *out, size_t *outsize);
+void zlib_backend_close(zlib_backend_stream *stream);
+// Compresses `in` to a zlib stream at `level` (0 to store, 1-9 as in zlib),
+// returning it in a buffer from malloc
+bool zlib_backend_compress(const uint8_t *in, size_t size, int level, uint8_t **out, size_t *outsize);
+
+#endif
+
+#endif // ZLIB_BACKEND_H